@@ -27,56 +27,174 @@ function replaceText(tab_id, next_txt) {
   chrome.tabs.sendRequest(tab_id, {cmd: "replace_selected", text: next_txt}, function() {});
 }
 
-function version() {
-  try {
-    return plugin().gpg_version();
-  } catch(e) {
-    if (e.type == "undefined_method") {
-      return "Plugin Unavailable.";
-    } else {
-      return e;
+// Transports to the native code. The NPAPI plugin answers synchronously,
+// the native messaging host asynchronously and possibly out of order; both
+// offer call(method, args, callback) with callback(result, error).
+var pluginTransport = {
+  call: function(method, args, callback) {
+    var p = plugin(), result;
+    try {
+      // NPAPI methods do not support apply()
+      switch (args.length) {
+        case 0: result = p[method](); break;
+        case 1: result = p[method](args[0]); break;
+        default: result = p[method](args[0], args[1]); break;
+      }
+    } catch(e) {
+      callback(undefined, e);
+      return;
+    }
+    callback(result);
+  }
+};
+
+var nativeTransport = {
+  host: "com.cryptochrome.host",
+  port: null,
+  nextId: 1,
+  pending: {},
+
+  connect: function() {
+    var self = this;
+    this.port = chrome.runtime.connectNative(this.host);
+
+    this.port.onMessage.addListener(function(msg) {
+      var callback = self.pending[msg.id];
+      if (!callback) return;
+      delete self.pending[msg.id];
+
+      if ("error" in msg) {
+        callback(undefined, msg.error);
+      } else {
+        callback(msg.result);
+      }
+    });
+
+    this.port.onDisconnect.addListener(function() {
+      var error = chrome.runtime.lastError ? chrome.runtime.lastError.message
+                                           : "Native host disconnected";
+      var pending = self.pending;
+      self.port = null;
+      self.pending = {};
+      for (var id in pending) {
+        pending[id](undefined, error);
+      }
+    });
+
+    // a new host process starts with the default configuration
+    var path = localStorage["gpg-path"];
+    if (path != undefined) {
+      this.post("set_gpg_path", [path], function() {});
+    }
+  },
+
+  post: function(method, args, callback) {
+    var id = this.nextId++;
+    this.pending[id] = callback;
+    this.port.postMessage({id: id, method: method, args: args});
+  },
+
+  call: function(method, args, callback) {
+    if (!this.port) {
+      this.connect();
     }
+    this.post(method, args, callback);
   }
+};
+
+function transport() {
+  return localStorage["transport"] == "native" ? nativeTransport : pluginTransport;
+}
+
+function callNative(method, args, callback) {
+  transport().call(method, args, callback || function() {});
+}
+
+// Adapt a text callback to callNative, passing errors on as text.
+function textResult(callback) {
+  return function(result, error) {
+    if (callback) {
+      callback(error != undefined ? "" + error : result);
+    }
+  };
 }
 
-function setPath(path) {
+function version(callback) {
+  callNative("gpg_version", [], function(result, error) {
+    if (error == undefined) {
+      callback(result);
+    } else if (error.type == "undefined_method") {
+      callback("Plugin Unavailable.");
+    } else {
+      callback("" + error);
+    }
+  });
+}
+
+function stats(callback) {
+  callNative("stats", [], function(result, error) {
+    callback(error != undefined ? {} : result);
+  });
+}
+
+function setPath(path, callback) {
   if (path.length > 0 && localStorage["gpg-path"] != "gpg") {
     localStorage["gpg-path"] = path;
   } else {
     localStorage.removeItem("gpg-path");
   }
-  return plugin().set_gpg_path(path);
+  callNative("set_gpg_path", [path], textResult(callback));
 }
 
 
-function encryptText(clear_txt) {
+function encryptText(clear_txt, callback) {
   if(clear_txt && clear_txt.length) {
     var recipient = prompt("Please enter the recipients email","");
-    return plugin().encrypt(recipient, clear_txt);
+    callNative("encrypt", [recipient, clear_txt], textResult(callback));
+  } else {
+    callback("");
   }
-  return "";
 }
 
-function decryptText(cipher_txt) {
+function decryptText(cipher_txt, callback) {
   if (cipher_txt && cipher_txt.length) {
-    return plugin().decrypt(cipher_txt);
+    callNative("decrypt", [cipher_txt], textResult(callback));
+  } else {
+    callback("");
   }
-  return "";
 }
 
-function clearsignText(clear_txt) {
+// Decrypt blocks which are about to be read in the background. The
+// plaintexts stay in the plugin's cache until an explicit decrypt.
+function prefetchBlocks(blocks) {
+  callNative("prefetch", [blocks]);
+}
+
+// Decrypt all blocks found on a page with a single call.
+function decryptBlocks(blocks, callback) {
+  callNative("decrypt_batch", [blocks], function(result, error) {
+    if (error != undefined) {
+      result = blocks.map(function() { return {ok: false, text: "" + error}; });
+    }
+    callback(result);
+  });
+}
+
+function clearsignText(clear_txt, callback) {
   if (clear_txt && clear_txt.length) {
-    return plugin().clearsign(clear_txt);
+    callNative("clearsign", [clear_txt], textResult(callback));
+  } else {
+    callback("");
   }
-  return "";
 }
 
-function encryptSignText (clear_txt) {
+function encryptSignText (clear_txt, callback) {
   if(clear_txt && clear_txt.length) {
     var recipient = prompt("Please enter the recipients email","");
-    return plugin().encrypt_sign(recipient, clear_txt);
+    callNative("encrypt_sign", [recipient, clear_txt], textResult(callback));
+  } else {
+    callback("");
   }
-  return "";
 }
 
 function withTabSelection (tab, processor, replace) {
@@ -84,7 +202,7 @@ function withTabSelection (tab, processor, replace) {
 
   chrome.tabs.executeScript(tab.id, {"file": "content_script.js", "allFrames": true}, function() {
     chrome.tabs.sendRequest(tab.id, {cmd: "get_selected"}, function(response) {
-      responseHandler(processor(response.msg));
+      processor(response.msg, responseHandler);
     });
   });
 }
@@ -93,8 +211,9 @@ function withClipboard(tab, processor) {
   text = readClipboard();
 
   chrome.tabs.executeScript(tab.id, {"file": "content_script.js"}, function() {
-    var processed = processor(text);
-    replaceText(tab.id, processed);
+    processor(text, function(processed) {
+      replaceText(tab.id, processed);
+    });
   });
 }
 
@@ -140,12 +259,92 @@ function load()
   } });
 }
 
+// Origin of a URL such as "https://mail.example.com", or "" for URLs
+// without one (about:blank, data:, unparseable input).
+function originOf(url) {
+  try {
+    var origin = new URL(url).origin;
+    return origin == "null" ? "" : origin;
+  } catch(e) {
+    return "";
+  }
+}
+
+function autoDecryptOrigins() {
+  try {
+    return JSON.parse(localStorage["auto-decrypt-origins"] || "[]");
+  } catch(e) {
+    return [];
+  }
+}
+
+// Plaintext shown in a page can be read by the page's scripts, so blocks
+// are only decrypted automatically for origins the user listed. sender.url
+// is the frame's own URL, so a listed site embedded in another one still
+// qualifies but a foreign frame inside a listed site does not.
+function autoDecryptAllowed(sender) {
+  if (localStorage["auto-decrypt"] != "true") {
+    return false;
+  }
+  var origin = originOf(sender.url || "");
+  return origin != "" && autoDecryptOrigins().indexOf(origin) >= 0;
+}
+
 chrome.extension.onRequest.addListener(function(request, sender, sendResponse) {
   if (request.cmd == "version") {
     path = localStorage["gpg-path"] || "";
-    sendResponse({version:version(), path:path});
+    version(function(v) {
+      sendResponse({version:v, path:path});
+    });
   } else if (request.cmd == "setpath") {
-    sendResponse({version:setPath(request.path)});
+    setPath(request.path, function(v) {
+      sendResponse({version:v});
+    });
+  } else if (request.cmd == "stats") {
+    stats(function(s) {
+      sendResponse({stats:s});
+    });
+  } else if (request.cmd == "transport") {
+    sendResponse({native: localStorage["transport"] == "native"});
+  } else if (request.cmd == "set_transport") {
+    localStorage["transport"] = request.native ? "native" : "plugin";
+    sendResponse({native: request.native});
+  } else if (request.cmd == "autodetect") {
+    sendResponse({enabled: localStorage["auto-decrypt"] == "true",
+                  decrypt: autoDecryptAllowed(sender),
+                  origins: autoDecryptOrigins(),
+                  prefetch: localStorage["prefetch"] == "true"});
+  } else if (request.cmd == "set_autodetect") {
+    localStorage["auto-decrypt"] = request.enabled ? "true" : "false";
+    sendResponse({enabled: request.enabled});
+  } else if (request.cmd == "set_autodetect_origins") {
+    var origins = [];
+    request.origins.forEach(function(entry) {
+      var origin = originOf(entry.trim());
+      if (origin != "" && origins.indexOf(origin) < 0) {
+        origins.push(origin);
+      }
+    });
+    localStorage["auto-decrypt-origins"] = JSON.stringify(origins);
+    sendResponse({origins: origins});
+  } else if (request.cmd == "set_prefetch") {
+    localStorage["prefetch"] = request.enabled ? "true" : "false";
+    if (!request.enabled) {
+      callNative("clear_cache", []);
+    }
+    sendResponse({enabled: request.enabled});
+  } else if (request.cmd == "prefetch_blocks") {
+    prefetchBlocks(request.blocks);
+    sendResponse({});
+  } else if (request.cmd == "decrypt_blocks") {
+    if (!autoDecryptAllowed(sender)) {
+      var message = "Automatic decryption is not enabled for " + (originOf(sender.url || "") || "this page");
+      sendResponse({results: request.blocks.map(function() { return {ok: false, text: message}; })});
+      return;
+    }
+    decryptBlocks(request.blocks, function(results) {
+      sendResponse({results: results});
+    });
   }
 });
 
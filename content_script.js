@@ -63,43 +63,263 @@ if (!chrome.extension.onRequest.hasListener(channel)) {
   chrome.extension.onRequest.addListener(channel);
 }
 
-// Search the text nodes for PGP message.
-// Return null if none is found.
-
-/*function decrypt() {
-	console.log("called");
-	chrome.extension.sendRequest($("#crypto_text").text(), function(response) {
-		console.log(response);
-		$("#crypto_text").text(response)
-	});
-	}
+// Auto-detect mode: find armored PGP messages in the page, decrypt them in
+// one batch and show the plaintext in place of the armor. Text nodes are
+// walked once; afterwards only content added to the page is scanned.
+// Prefetch mode finds the messages the same way but leaves the page alone:
+// once a message scrolls into view it is decrypted in the background, so a
+// later "Decrypt" of it answers from the plugin's cache.
+var pgpScanner = pgpScanner || (function() {
+  var BEGIN = "-----BEGIN PGP MESSAGE-----";
+  var END = "-----END PGP MESSAGE-----";
+  var MAX_BLOCK = 1 << 20;
+  var MARK = "data-cryptochrome";
 
-var findCrypto = function() {
-	var found;
-	var re = /-----[\s\S]+?-----[\s\S]+?-----[\s\S]+?-----/gm;
-	var matches = [];
-	var node = document.body;
-
-	while (e = re.exec(node.innerHTML))
-	{
-		// store match position and original text
-		if (e[0].search("PGP") > 0)
-		{
-			matches.push( [re.lastIndex - e[0].length,
-						   e[0],
-						   e[0].replace(/<[^>]+>/g, "")] );
-		}
-	}
+  var SKIP = {SCRIPT: 1, STYLE: 1, NOSCRIPT: 1, TEXTAREA: 1, INPUT: 1, SELECT: 1};
+  var BLOCK = {DIV: 1, P: 1, PRE: 1, LI: 1, TR: 1, BLOCKQUOTE: 1,
+               H1: 1, H2: 1, H3: 1, H4: 1, H5: 1, H6: 1};
 
-	var template = '<div style="outline-width:5px; outline-style:solid; outline-color:red"><pre style="word-wrap; break-word; white-space; pre-wrap;"><div id="crypto_text">cryptotext<div><a href="#">Decrypt</a></div></div></div></pre>';
-	
+  var pending = [];   // subtrees added since the last scan
+  var timer = null;
 
-	for (var i = matches.length - 1; i >= 0; --i)
-	{
-		node.innerHTML = node.innerHTML.replace(matches[i][1], template.replace("cryptotext", matches[i][2]) );
-	}
+  var autodecrypt = false;
+  var observer = null;    // IntersectionObserver of the prefetch mode
+  var prefetched = {};    // armor texts already handed out for prefetching
 
-	$("#crypto_text > div > a").click(decrypt); 
-  return null;
-}*/
+  // Rebuild canonical armor from text that may have lost or gained
+  // whitespace through HTML rendering.
+  function normalizeArmor(text) {
+    var lines = text.split("\n").map(function(l) { return l.trim(); })
+                    .filter(function(l) { return l.length > 0; });
+    var out = [lines[0]];
+    var i = 1;
+    while (i < lines.length && /^[A-Za-z-]+: /.test(lines[i])) {
+      out.push(lines[i++]);
+    }
+    out.push("");
+    return out.concat(lines.slice(i)).join("\n") + "\n";
+  }
+
+  function acceptNode(node) {
+    if (node.nodeType == Node.ELEMENT_NODE &&
+        (SKIP[node.nodeName] || node.hasAttribute(MARK) || node.isContentEditable)) {
+      return NodeFilter.FILTER_REJECT;
+    }
+    return NodeFilter.FILTER_ACCEPT;
+  }
+
+  // Walk root once and return the armored blocks with their DOM positions.
+  // Our own plaintext, which may quote a message, is never scanned.
+  function scan(root, blocks) {
+    if (root.closest && root.closest("[" + MARK + "]")) {
+      return;
+    }
+    var walker = document.createTreeWalker(root,
+        NodeFilter.SHOW_ELEMENT | NodeFilter.SHOW_TEXT, {acceptNode: acceptNode}, false);
+    var block = null;
+    var node;
+
+    while ((node = walker.nextNode())) {
+      if (node.nodeType == Node.ELEMENT_NODE) {
+        if (block && (node.nodeName == "BR" || BLOCK[node.nodeName])) {
+          block.text += "\n";
+        }
+        continue;
+      }
+
+      var data = node.data;
+      var pos = 0;
+
+      while (pos < data.length) {
+        if (!block) {
+          var begin = data.indexOf(BEGIN, pos);
+          if (begin < 0) break;
+          block = {text: "", startNode: node, startOffset: begin};
+          pos = begin;
+        }
+
+        var end = data.indexOf(END, pos);
+        if (end < 0) {
+          block.text += data.substring(pos);
+          if (block.text.length > MAX_BLOCK) {
+            block = null;
+          }
+          break;
+        }
+
+        end += END.length;
+        block.text += data.substring(pos, end);
+        block.endNode = node;
+        block.endOffset = end;
+        blocks.push(block);
+        block = null;
+        pos = end;
+      }
+    }
+  }
+
+  function show(block, plaintext, diagnostics) {
+    var range = block.range;
+    var pre = document.createElement("pre");
+    pre.setAttribute(MARK, "plaintext");
+    pre.style.cssText = "white-space: pre-wrap; word-wrap: break-word; " +
+                        "outline: 2px solid #3a3; padding: 4px;";
+    pre.textContent = plaintext;
+    if (diagnostics) {
+      pre.title = diagnostics;    // gpg's messages, e.g. the signature status
+    }
+    range.deleteContents();
+    range.insertNode(pre);
+    range.detach();
+  }
+
+  function process() {
+    timer = null;
+
+    // in document order a root's descendants follow it, so a root inside
+    // another one, which would be scanned twice, comes right after it
+    var roots = pending.filter(function(root) { return document.contains(root); });
+    pending = [];
+    roots.sort(function(a, b) {
+      return a.compareDocumentPosition(b) & Node.DOCUMENT_POSITION_FOLLOWING ? -1 : 1;
+    });
+
+    var blocks = [];
+    var last = null;
+    roots.forEach(function(root) {
+      if (!last || !last.contains(root)) {
+        scan(root, blocks);
+        last = root;
+      }
+    });
+    if (blocks.length == 0) {
+      return;
+    }
+
+    if (!autodecrypt) {
+      prefetchWhenVisible(blocks);
+      return;
+    }
+
+    // a block still being decrypted is marked on its start node, so a
+    // mutation scanning it again before the reply does not send it twice
+    blocks = blocks.filter(function(block) {
+      block.armor = normalizeArmor(block.text);
+      var inflight = block.startNode.cryptochromeInFlight;
+      if (inflight && inflight[block.armor]) {
+        return false;
+      }
+      if (!inflight) {
+        inflight = block.startNode.cryptochromeInFlight = {};
+      }
+      inflight[block.armor] = true;
+      return true;
+    });
+    if (blocks.length == 0) {
+      return;
+    }
+
+    // live ranges keep their position while earlier blocks are replaced
+    blocks.forEach(function(block) {
+      block.range = document.createRange();
+      block.range.setStart(block.startNode, block.startOffset);
+      block.range.setEnd(block.endNode, block.endOffset);
+    });
+
+    chrome.extension.sendRequest({
+        cmd: "decrypt_blocks",
+        blocks: blocks.map(function(b) { return b.armor; })
+      }, function(response) {
+        blocks.forEach(function(block) {
+          delete block.startNode.cryptochromeInFlight[block.armor];
+        });
+        if (!response) {
+          return;
+        }
+        response.results.forEach(function(result, i) {
+          if (result.ok) {
+            show(blocks[i], result.text, result.diagnostics);
+          }
+        });
+      });
+  }
+
+  // Watch the element around each block and prefetch all blocks of an
+  // element when it comes near the viewport.
+  function prefetchWhenVisible(blocks) {
+    if (!observer) {
+      observer = new IntersectionObserver(function(entries) {
+        var texts = [];
+        entries.forEach(function(entry) {
+          if (entry.isIntersecting) {
+            observer.unobserve(entry.target);
+            texts = texts.concat(entry.target.cryptochromeBlocks);
+            delete entry.target.cryptochromeBlocks;
+          }
+        });
+        if (texts.length > 0) {
+          chrome.extension.sendRequest({cmd: "prefetch_blocks", blocks: texts}, function() {});
+        }
+      }, {rootMargin: "200px"});
+    }
+
+    blocks.forEach(function(block) {
+      var text = normalizeArmor(block.text);
+      if (prefetched[text]) {
+        return;
+      }
+      prefetched[text] = true;
+
+      var range = document.createRange();
+      range.setStart(block.startNode, block.startOffset);
+      range.setEnd(block.endNode, block.endOffset);
+      var el = range.commonAncestorContainer;
+      if (el.nodeType != Node.ELEMENT_NODE) {
+        el = el.parentNode;
+      }
+      range.detach();
+
+      if (!el.cryptochromeBlocks) {
+        el.cryptochromeBlocks = [];
+        observer.observe(el);
+      }
+      el.cryptochromeBlocks.push(text);
+    });
+  }
+
+  function schedule(root) {
+    pending.push(root);
+    if (!timer) {
+      timer = setTimeout(process, 100);
+    }
+  }
+
+  function start() {
+    schedule(document.body);
+
+    new MutationObserver(function(mutations) {
+      mutations.forEach(function(m) {
+        if (m.type == "characterData") {
+          schedule(m.target.parentNode);
+        } else {
+          for (var i = 0; i < m.addedNodes.length; ++i) {
+            schedule(m.addedNodes[i].nodeType == Node.TEXT_NODE
+                     ? m.addedNodes[i].parentNode : m.addedNodes[i]);
+          }
+        }
+      });
+    }).observe(document.body, {childList: true, subtree: true, characterData: true});
+  }
+
+  chrome.extension.sendRequest({cmd: "autodetect"}, function(response) {
+    if (!response || !document.body) {
+      return;
+    }
+    autodecrypt = response.decrypt;
+    if (response.decrypt || (response.prefetch && window.IntersectionObserver)) {
+      start();
+    }
+  });
 
+  return {scan: scan, normalizeArmor: normalizeArmor};
+})();
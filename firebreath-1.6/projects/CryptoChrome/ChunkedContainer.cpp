@@ -0,0 +1,657 @@
+/**********************************************************\
+
+  ChunkedContainer.cpp
+
+\**********************************************************/
+
+#include "stx-execpipe.h"
+#include <algorithm>
+#include <stdexcept>
+
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "ChunkedContainer.h"
+#include "CryptoChromeCore.h"
+#include "PgpArmor.h"
+#include "Sha256.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+static const char s_magic[] = "CRYPTOCHROME-CONTAINER 1\n";
+static const char s_trailer_magic[] = "CCTRAIL1";
+
+static const unsigned int s_magic_len = sizeof(s_magic) - 1;
+static const unsigned int s_trailer_len = 8 + 16;
+
+/// manifests larger than this are rejected before gpg sees them
+static const unsigned long s_max_manifest = 64 << 20;
+
+/// OpenPGP framing added to a chunk never comes close to this
+static const unsigned long s_max_overhead = 1 << 20;
+
+static double timestamp()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static std::string errno_message(const std::string& what)
+{
+    return what + ": " + strerror(errno);
+}
+
+static bool pread_full(int fd, void* data, size_t len, off_t offset)
+{
+    char* p = static_cast<char*>(data);
+    while (len > 0)
+    {
+        ssize_t rb = pread(fd, p, len, offset);
+        if (rb < 0 && errno == EINTR) continue;
+        if (rb <= 0) return false;
+        p += rb; len -= rb; offset += rb;
+    }
+    return true;
+}
+
+static bool pwrite_full(int fd, const void* data, size_t len, off_t offset)
+{
+    const char* p = static_cast<const char*>(data);
+    while (len > 0)
+    {
+        ssize_t wb = pwrite(fd, p, len, offset);
+        if (wb < 0 && errno == EINTR) continue;
+        if (wb <= 0) return false;
+        p += wb; len -= wb; offset += wb;
+    }
+    return true;
+}
+
+/// Writes the plaintext of one chunk to its place in the output file and
+/// counts it, so a chunk decrypting to the wrong length is noticed.
+class RangeSink : public stx::PipeSink
+{
+private:
+    int m_fd;
+    off_t m_offset, m_end;
+    unsigned long long m_written;
+    bool m_failed;
+
+public:
+    RangeSink(int fd, off_t offset, off_t length)
+        : m_fd(fd), m_offset(offset), m_end(offset + length), m_written(0), m_failed(false)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+        m_written += datalen;
+
+        // excess data must not overwrite the next chunk
+        if (m_failed || m_offset + datalen > m_end) {
+            m_failed = true;
+            return;
+        }
+        if (!pwrite_full(m_fd, data, datalen, m_offset))
+            m_failed = true;
+        m_offset += datalen;
+    }
+
+    virtual void eof()
+    {
+    }
+
+    bool failed() const { return m_failed; }
+    unsigned long long written() const { return m_written; }
+};
+
+/// Collects gpg's messages for the error of a failed run.
+class MessageSink : public stx::PipeSink
+{
+private:
+    std::string& m_messages;
+
+public:
+    explicit MessageSink(std::string& messages)
+        : m_messages(messages)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+        m_messages.append(static_cast<const char*>(data), datalen);
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+struct ChunkedContainer::Job
+{
+    ChunkedContainer* container;
+    const std::vector<std::string>* recipients;
+    CryptoChromeCore::Compression compression;
+    unsigned long long size;
+    unsigned int chunks;
+    int in_fd, out_fd;
+
+    std::vector<Entry> entries;
+
+    Mutex lock;
+    unsigned int next;
+    unsigned long long append;      // end of the chunks written so far
+    std::string error;              // first error, stops the other workers
+
+    /// Take the next chunk index. Returns false when done or failed.
+    bool take(unsigned int& i)
+    {
+        MutexLock l(lock);
+        if (next >= chunks || !error.empty()) return false;
+        i = next++;
+        return true;
+    }
+
+    void fail(const std::string& message)
+    {
+        MutexLock l(lock);
+        if (error.empty()) error = message;
+    }
+};
+
+ChunkedContainer::ChunkedContainer(CryptoChromeCore& core, unsigned long chunk_size,
+                                   JobScheduler::Priority prio)
+    : m_core(core), m_chunk_size(chunk_size), m_prio(prio)
+{
+}
+
+void ChunkedContainer::run_workers(Job& job, void* (*worker)(void*))
+{
+    unsigned int threads = std::min<unsigned int>(job.chunks, m_core.scheduler().limit(m_prio));
+
+    std::vector<pthread_t> tids;
+    for (unsigned int i = 1; i < threads; ++i)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker, &job) != 0)
+            break;
+        tids.push_back(tid);
+    }
+
+    worker(&job);
+
+    for (unsigned int i = 0; i < tids.size(); ++i)
+        pthread_join(tids[i], NULL);
+}
+
+void* ChunkedContainer::encrypt_main(void* arg)
+{
+    Job& job = *static_cast<Job*>(arg);
+    ChunkedContainer& self = *job.container;
+    CryptoChromeCore& core = self.m_core;
+    CryptoChromeCore::Operation op = CryptoChromeCore::OP_ENCRYPT_CONTAINER;
+
+    CryptoChromeCore::TemplateRef templates(core);
+    CryptoChromeCore::ArgVector storage;
+    const std::vector<std::string>& gpgargs =
+        CryptoChromeCore::build_args(templates, CryptoChromeCore::OP_ENCRYPT_FILE,
+                                     *job.recipients, job.compression, storage);
+
+    unsigned int i;
+    while (job.take(i))
+    {
+        unsigned long long offset = static_cast<unsigned long long>(i) * self.m_chunk_size;
+        unsigned long long length = std::min<unsigned long long>(self.m_chunk_size,
+                                                                 job.size - offset);
+
+        JobScheduler::Ticket ticket(core.scheduler(), self.m_prio);
+        double t0 = timestamp();
+
+        if (!ticket.acquire()) {
+            core.record_stats(op, NULL, timestamp() - t0, true);
+            job.fail("Cancelled");
+            break;
+        }
+
+        double queue_time = timestamp() - t0;
+
+        std::string crypt;
+        crypt.reserve(length + 4096);
+
+        std::string messages;
+        MessageSink message_sink(messages);
+
+        // each worker maps its own range, so the workers share the file
+        // descriptor and gpg reads the chunk straight from the page cache
+        stx::ExecPipe ep;
+        ep.set_input_mapped(job.in_fd, offset, length);
+        ep.add_execp(&gpgargs);
+        ep.add_stderr_output(&message_sink);
+        ep.set_output_string(&crypt);
+
+        bool ok;
+        try {
+            ep.run();
+            ok = ep.all_return_codes_zero();
+        }
+        catch (std::runtime_error &e) {
+            core.record_stats(op, &ep, queue_time, true);
+            job.fail(e.what());
+            break;
+        }
+
+        core.record_stats(op, &ep, queue_time, !ok);
+
+        if (!ok) {
+            std::ostringstream oss;
+            oss << "gpg failed on chunk " << i << " with exit code " << ep.get_return_code(0);
+            job.fail(CryptoChromeCore::with_messages(oss.str(), messages));
+            break;
+        }
+
+        Entry& e = job.entries[i];
+        e.length = crypt.size();
+        e.sha256 = Sha256::hex(crypt);
+        {
+            // chunks are appended in completion order, the manifest
+            // restores the order
+            MutexLock l(job.lock);
+            e.offset = job.append;
+            job.append += crypt.size();
+        }
+
+        if (!pwrite_full(job.out_fd, crypt.data(), crypt.size(), e.offset)) {
+            job.fail(errno_message("Could not write output file"));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+bool ChunkedContainer::sign_manifest(const std::string& text, std::string& signed_text,
+                                     std::string& message)
+{
+    m_core.ensure_agent(CryptoChromeCore::OP_CLEARSIGN);
+
+    // signed like a clearsign() of the text, with that operation's profile
+    CryptoChromeCore::TemplateRef templates(m_core);
+    const std::vector<std::string>& gpgargs = templates.args(CryptoChromeCore::OP_CLEARSIGN);
+
+    std::string messages;
+    MessageSink message_sink(messages);
+
+    stx::ExecPipe ep;
+    ep.set_input_string(&text);
+    ep.add_execp(&gpgargs);
+    ep.add_stderr_output(&message_sink);
+    ep.set_output_string(&signed_text);
+
+    try {
+        ep.run();
+    }
+    catch (std::runtime_error &e) {
+        message = e.what();
+        return false;
+    }
+
+    if (!ep.all_return_codes_zero()) {
+        std::ostringstream oss;
+        oss << "gpg could not sign the manifest, exit code " << ep.get_return_code(0);
+        message = CryptoChromeCore::with_messages(oss.str(), messages);
+        return false;
+    }
+    return true;
+}
+
+bool ChunkedContainer::encrypt(const std::vector<std::string>& recipients,
+                               const std::string& in_path, const std::string& out_path,
+                               std::string& message,
+                               const CryptoChromeCore::Compression& compression)
+{
+    Job job;
+    job.container = this;
+    job.recipients = &recipients;
+    job.next = 0;
+    job.append = s_magic_len;
+
+    job.in_fd = open(in_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (job.in_fd < 0) {
+        message = errno_message("Could not open input file");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(job.in_fd, &st) != 0) {
+        message = errno_message("Could not stat input file");
+        close(job.in_fd);
+        return false;
+    }
+
+    job.size = st.st_size;
+    job.compression = CryptoChromeCore::resolve(
+        compression, compression.automatic && CryptoChromeCore::incompressible_file(job.in_fd));
+
+    // an empty file still gets one (empty) chunk
+    job.chunks = std::max<unsigned long long>(1, (job.size + m_chunk_size - 1) / m_chunk_size);
+    job.entries.resize(job.chunks);
+
+    job.out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (job.out_fd < 0) {
+        message = errno_message("Could not create output file");
+        close(job.in_fd);
+        return false;
+    }
+
+    if (!pwrite_full(job.out_fd, s_magic, s_magic_len, 0))
+        job.fail(errno_message("Could not write output file"));
+    else
+        run_workers(job, &encrypt_main);
+
+    close(job.in_fd);
+
+    if (job.error.empty())
+    {
+        std::ostringstream manifest;
+        manifest << "CryptoChrome container 1\n"
+                 << "chunk-size " << m_chunk_size << "\n"
+                 << "size " << job.size << "\n"
+                 << "chunks " << job.chunks << "\n";
+        for (unsigned int i = 0; i < job.chunks; ++i) {
+            const Entry& e = job.entries[i];
+            manifest << "chunk " << i << " " << e.offset << " " << e.length << " "
+                     << e.sha256 << "\n";
+        }
+
+        std::string signed_manifest;
+        if (sign_manifest(manifest.str(), signed_manifest, job.error))
+        {
+            char trailer[s_trailer_len + 1];
+            snprintf(trailer, sizeof(trailer), "%s%016llx", s_trailer_magic, job.append);
+            signed_manifest.append(trailer, s_trailer_len);
+
+            if (!pwrite_full(job.out_fd, signed_manifest.data(), signed_manifest.size(),
+                             job.append))
+                job.error = errno_message("Could not write output file");
+        }
+    }
+
+    if (close(job.out_fd) != 0 && job.error.empty())
+        job.error = errno_message("Could not write output file");
+
+    message = job.error;
+    return job.error.empty();
+}
+
+bool ChunkedContainer::verify_manifest(const std::string& signed_text, std::string& text,
+                                       std::string& message)
+{
+    // gpg --decrypt also accepts unsigned messages, so insist on a single
+    // clearsigned block
+    std::vector<PgpArmor::Block> blocks;
+    PgpArmor::split(signed_text, blocks);
+
+    if (blocks.size() != 1 || blocks[0].type != "SIGNED MESSAGE" || blocks[0].begin != 0) {
+        message = "Container manifest is not a signed message";
+        return false;
+    }
+    if (!PgpArmor::check(signed_text, blocks[0], message))
+        return false;
+
+    CryptoChromeCore::TemplateRef templates(m_core);
+    const std::vector<std::string>& gpgargs = templates.args(CryptoChromeCore::OP_DECRYPT_FILE);
+
+    std::string messages;
+    MessageSink message_sink(messages);
+
+    stx::ExecPipe ep;
+    ep.set_input_string(&signed_text);
+    ep.add_execp(&gpgargs);
+    ep.add_stderr_output(&message_sink);
+    ep.set_output_string(&text);
+
+    try {
+        ep.run();
+    }
+    catch (std::runtime_error &e) {
+        message = e.what();
+        return false;
+    }
+
+    // gpg exits with 0 only if the signature is good
+    if (!ep.all_return_codes_zero()) {
+        message = CryptoChromeCore::with_messages(
+            "Bad or unverifiable signature on the container manifest", messages);
+        return false;
+    }
+    return true;
+}
+
+void* ChunkedContainer::decrypt_main(void* arg)
+{
+    Job& job = *static_cast<Job*>(arg);
+    ChunkedContainer& self = *job.container;
+    CryptoChromeCore& core = self.m_core;
+    CryptoChromeCore::Operation op = CryptoChromeCore::OP_DECRYPT_CONTAINER;
+
+    CryptoChromeCore::TemplateRef templates(core);
+    const std::vector<std::string>& gpgargs = templates.args(CryptoChromeCore::OP_DECRYPT_FILE);
+
+    unsigned int i;
+    while (job.take(i))
+    {
+        const Entry& e = job.entries[i];
+
+        std::string crypt(e.length, 0);
+        if (e.length > 0 && !pread_full(job.in_fd, &crypt[0], e.length, e.offset)) {
+            job.fail("Could not read chunk from the container");
+            break;
+        }
+        if (Sha256::hex(crypt) != e.sha256) {
+            std::ostringstream oss;
+            oss << "Chunk " << i << " of the container was modified";
+            job.fail(oss.str());
+            break;
+        }
+
+        unsigned long long offset = static_cast<unsigned long long>(i) * self.m_chunk_size;
+        unsigned long long length = std::min<unsigned long long>(self.m_chunk_size,
+                                                                 job.size - offset);
+
+        JobScheduler::Ticket ticket(core.scheduler(), self.m_prio);
+        double t0 = timestamp();
+
+        if (!ticket.acquire()) {
+            core.record_stats(op, NULL, timestamp() - t0, true);
+            job.fail("Cancelled");
+            break;
+        }
+
+        double queue_time = timestamp() - t0;
+
+        RangeSink sink(job.out_fd, offset, length);
+        std::string messages;
+        MessageSink message_sink(messages);
+
+        stx::ExecPipe ep;
+        ep.set_input_string(&crypt);
+        ep.add_execp(&gpgargs);
+        ep.add_stderr_output(&message_sink);
+        ep.set_output_sink(&sink);
+
+        try {
+            ep.run();
+        }
+        catch (std::runtime_error &e) {
+            core.record_stats(op, &ep, queue_time, true);
+            job.fail(e.what());
+            break;
+        }
+
+        bool ok = ep.all_return_codes_zero() && !sink.failed() && sink.written() == length;
+        core.record_stats(op, &ep, queue_time, !ok);
+
+        if (!ok) {
+            std::ostringstream oss;
+            if (!ep.all_return_codes_zero())
+                oss << "gpg failed on chunk " << i << " with exit code " << ep.get_return_code(0);
+            else if (sink.written() != length)
+                oss << "Chunk " << i << " decrypted to " << sink.written()
+                    << " bytes instead of " << length;
+            else
+                oss << errno_message("Could not write output file");
+            job.fail(CryptoChromeCore::with_messages(oss.str(), messages));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+bool ChunkedContainer::parse_manifest(const std::string& text,
+                                      unsigned long long manifest_offset,
+                                      unsigned long& chunk_size, unsigned long long& size,
+                                      std::vector<Entry>& entries, std::string& message)
+{
+    std::istringstream in(text);
+    std::string line, key;
+
+    message = "Invalid container manifest";
+
+    if (!std::getline(in, line) || line != "CryptoChrome container 1")
+        return false;
+
+    unsigned long long count;
+    if (!(in >> key) || key != "chunk-size" || !(in >> chunk_size) || chunk_size == 0 ||
+        !(in >> key) || key != "size" || !(in >> size) ||
+        !(in >> key) || key != "chunks" || !(in >> count))
+        return false;
+
+    if (count != std::max<unsigned long long>(1, (size + chunk_size - 1) / chunk_size))
+        return false;
+    if (count > manifest_offset)    // every chunk takes at least a byte
+        return false;
+
+    entries.resize(count);
+    for (unsigned long long i = 0; i < count; ++i)
+    {
+        Entry& e = entries[i];
+        unsigned long long index;
+
+        if (!(in >> key) || key != "chunk" || !(in >> index) || index != i ||
+            !(in >> e.offset >> e.length >> e.sha256) || e.sha256.size() != 64)
+            return false;
+
+        if (e.offset < s_magic_len || e.offset > manifest_offset ||
+            e.length > manifest_offset - e.offset || e.length > chunk_size + s_max_overhead)
+            return false;
+    }
+
+    if (in >> key)      // trailing garbage
+        return false;
+
+    message.clear();
+    return true;
+}
+
+bool ChunkedContainer::decrypt(const std::string& in_path, const std::string& out_path,
+                               std::string& message)
+{
+    // once for all chunks instead of in every worker
+    m_core.ensure_agent(CryptoChromeCore::OP_DECRYPT_CONTAINER);
+
+    Job job;
+    job.container = this;
+    job.recipients = NULL;
+    job.next = 0;
+    job.append = 0;
+
+    job.in_fd = open(in_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (job.in_fd < 0) {
+        message = errno_message("Could not open input file");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(job.in_fd, &st) != 0) {
+        message = errno_message("Could not stat input file");
+        close(job.in_fd);
+        return false;
+    }
+
+    unsigned long long file_size = st.st_size;
+    char magic[s_magic_len];
+    char trailer[s_trailer_len + 1];
+
+    if (file_size < s_magic_len + s_trailer_len ||
+        !pread_full(job.in_fd, magic, s_magic_len, 0) ||
+        memcmp(magic, s_magic, s_magic_len) != 0 ||
+        !pread_full(job.in_fd, trailer, s_trailer_len, file_size - s_trailer_len) ||
+        memcmp(trailer, s_trailer_magic, 8) != 0)
+    {
+        message = "Not a CryptoChrome container";
+        close(job.in_fd);
+        return false;
+    }
+
+    trailer[s_trailer_len] = 0;
+    char* end;
+    unsigned long long manifest_offset = strtoull(trailer + 8, &end, 16);
+    unsigned long long manifest_end = file_size - s_trailer_len;
+
+    if (*end != 0 || manifest_offset < s_magic_len || manifest_offset > manifest_end ||
+        manifest_end - manifest_offset > s_max_manifest)
+    {
+        message = "Invalid container trailer";
+        close(job.in_fd);
+        return false;
+    }
+
+    std::string signed_manifest(manifest_end - manifest_offset, 0);
+    std::string manifest;
+
+    if (!pread_full(job.in_fd, &signed_manifest[0], signed_manifest.size(), manifest_offset)) {
+        message = errno_message("Could not read input file");
+        close(job.in_fd);
+        return false;
+    }
+
+    if (!verify_manifest(signed_manifest, manifest, message) ||
+        !parse_manifest(manifest, manifest_offset, m_chunk_size, job.size, job.entries, message))
+    {
+        close(job.in_fd);
+        return false;
+    }
+    job.chunks = job.entries.size();
+
+    job.out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (job.out_fd < 0) {
+        message = errno_message("Could not create output file");
+        close(job.in_fd);
+        return false;
+    }
+
+    // chunks are written at their offsets in any order
+    if (ftruncate(job.out_fd, job.size) != 0)
+        job.fail(errno_message("Could not write output file"));
+    else
+        run_workers(job, &decrypt_main);
+
+    close(job.in_fd);
+    if (close(job.out_fd) != 0 && job.error.empty())
+        job.error = errno_message("Could not write output file");
+
+    message = job.error;
+    return job.error.empty();
+}
@@ -0,0 +1,96 @@
+/**********************************************************\
+
+  ChunkedContainer.h
+
+  Container format for very large files. The input is split into
+  fixed-size chunks which are encrypted by concurrent gpg processes,
+  so the work scales with the number of cores instead of being bound
+  to a single gpg. A clearsigned manifest records the position, size
+  and SHA-256 of every encrypted chunk; decryption checks the
+  signature and the hashes before the chunks are decrypted in
+  parallel again.
+
+  Layout of a container file:
+
+    "CRYPTOCHROME-CONTAINER 1\n"
+    encrypted chunks, binary OpenPGP messages in completion order
+    clearsigned manifest
+    "CCTRAIL1" and the manifest offset as 16 hex digits
+
+  The manifest text is
+
+    CryptoChrome container 1
+    chunk-size BYTES
+    size BYTES
+    chunks N
+    chunk INDEX OFFSET LENGTH SHA256      (N lines)
+
+  It only describes the ciphertext; plaintext hashes would let anyone
+  confirm guesses of the content.
+
+\**********************************************************/
+
+#ifndef H_ChunkedContainer
+#define H_ChunkedContainer
+
+#include <string>
+#include <vector>
+
+#include "CryptoChromeCore.h"
+
+class ChunkedContainer
+{
+public:
+    static const unsigned long default_chunk_size = 16 << 20;
+
+    /// The chunks are processed in up to the scheduler's limit of threads
+    /// for prio, each gpg run taking a ticket of that class. The chunk size
+    /// of an existing container is read from its manifest.
+    ChunkedContainer(CryptoChromeCore& core, unsigned long chunk_size = default_chunk_size,
+                     JobScheduler::Priority prio = JobScheduler::BULK);
+
+    /// Encrypt in_path for all recipients into the container out_path and
+    /// sign its manifest with the default key. Automatic compression is
+    /// decided once from samples of the whole file. Returns false and sets
+    /// message on errors.
+    bool encrypt(const std::vector<std::string>& recipients, const std::string& in_path,
+                 const std::string& out_path, std::string& message,
+                 const CryptoChromeCore::Compression& compression =
+                     CryptoChromeCore::Compression());
+
+    /// Verify and decrypt the container in_path into out_path. Returns false
+    /// and sets message on errors.
+    bool decrypt(const std::string& in_path, const std::string& out_path, std::string& message);
+
+private:
+    CryptoChromeCore& m_core;
+    unsigned long m_chunk_size;
+    JobScheduler::Priority m_prio;
+
+    /// Position of one encrypted chunk in the container.
+    struct Entry
+    {
+        unsigned long long offset, length;
+        std::string sha256;     // hex digest of the encrypted chunk
+    };
+
+    /// State shared by the worker threads of one encrypt or decrypt.
+    struct Job;
+
+    static void* encrypt_main(void* arg);
+    static void* decrypt_main(void* arg);
+
+    /// Run the worker function with up to the bulk class limit of threads.
+    void run_workers(Job& job, void* (*worker)(void*));
+
+    bool sign_manifest(const std::string& text, std::string& signed_text, std::string& message);
+    bool verify_manifest(const std::string& signed_text, std::string& text, std::string& message);
+
+    /// Parse the verified manifest and check it against the layout of the
+    /// container, whose manifest starts at manifest_offset.
+    static bool parse_manifest(const std::string& text, unsigned long long manifest_offset,
+                               unsigned long& chunk_size, unsigned long long& size,
+                               std::vector<Entry>& entries, std::string& message);
+};
+
+#endif // H_ChunkedContainer
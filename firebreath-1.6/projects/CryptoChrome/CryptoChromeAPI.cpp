@@ -8,12 +8,20 @@
 #include "variant_list.h"
 #include "DOM/Document.h"
 #include "global/config.h"
-#include "stx-execpipe.h"
 #include <stdexcept>
 #include <iostream>
 
 #include "CryptoChromeAPI.h"
 
+/// The {ok, text} result of the methods which report success and a message.
+static FB::VariantMap ok_text(bool ok, const std::string& text)
+{
+    FB::VariantMap result;
+    result["ok"] = ok;
+    result["text"] = text;
+    return result;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// @fn FB::variant CryptoChromeAPI::echo(const FB::variant& msg)
 ///
@@ -22,8 +30,9 @@
 ///////////////////////////////////////////////////////////////////////////////
 FB::variant CryptoChromeAPI::echo(const FB::variant& msg)
 {
-    static int n(0);
-    fire_echo("So far, you clicked this many times: ", n++);
+    // pages may call in from several threads
+    static AtomicCounter n(0);
+    fire_echo("So far, you clicked this many times: ", n.fetch_add(1));
 
     // return "foobar";
     return msg;
@@ -68,168 +77,278 @@ void CryptoChromeAPI::testEvent()
     fire_test();
 }
 
-std::string CryptoChromeAPI::get_gpg()
+FB::VariantMap CryptoChromeAPI::stats()
 {
-  if (m_gpgpath.length() == 0) {
-    return "gpg";
-  }
-  return m_gpgpath;
+    FB::VariantMap result;
+    CryptoChromeCore::StatsMap stats = m_core.stats();
+
+    for (CryptoChromeCore::StatsMap::const_iterator it = stats.begin();
+         it != stats.end(); ++it)
+    {
+        const CryptoChromeCore::OpStats& os = it->second;
+        FB::VariantMap op;
+
+        op["calls"] = os.calls;
+        op["failures"] = os.failures;
+        op["coalesced"] = os.coalesced;
+        op["cache_hits"] = os.cache_hits;
+        op["session_key_hits"] = os.session_key_hits;
+        op["queue_time"] = os.queue_time;
+        op["wall_time"] = os.wall_time;
+        op["spawn_time"] = os.spawn_time;
+        op["first_byte_time"] = os.first_byte_time;
+        op["user_time"] = os.user_time;
+        op["sys_time"] = os.sys_time;
+        op["bytes_in"] = os.bytes_in;
+        op["bytes_out"] = os.bytes_out;
+        op["select_calls"] = os.select_calls;
+        op["read_calls"] = os.read_calls;
+        op["write_calls"] = os.write_calls;
+        op["peak_buffer"] = os.peak_buffer;
+
+        result[it->first] = op;
+    }
+
+    return result;
+}
+
+void CryptoChromeAPI::reset_stats()
+{
+    m_core.reset_stats();
 }
 
 // Configuration
 std::string CryptoChromeAPI::gpg_version()
 {
-    stx::ExecPipe ep;               // creates new pipe
-    
-    std::vector<std::string> gpgargs;
-    gpgargs.push_back(get_gpg());
-    gpgargs.push_back("--version");
-    ep.add_execp(&gpgargs);
-
-    std::string output;
-    ep.set_output_string(&output);
-    
-    try {
-        ep.run();
-    }
-    catch (std::runtime_error &e) {
-        return e.what();
-    }
+    return m_core.gpg_version();
+}
 
-    return output;
+std::string CryptoChromeAPI::set_gpg_path(const std::string& path)
+{
+    return m_core.set_gpg_path(path);
 }
 
-std::string CryptoChromeAPI::set_gpg_path(std::string path)
+FB::VariantMap CryptoChromeAPI::set_gpg_profile(const std::string& name,
+                                                const std::vector<std::string>& options)
 {
-    m_gpgpath = path;
-    return this->gpg_version();
+    std::string message;
+    bool ok = m_core.set_profile(name, options, message);
+    return ok_text(ok, message);
 }
 
+FB::VariantMap CryptoChromeAPI::remove_gpg_profile(const std::string& name)
+{
+    std::string message;
+    bool ok = m_core.remove_profile(name, message);
+    return ok_text(ok, message);
+}
 
+FB::VariantMap CryptoChromeAPI::use_gpg_profile(const std::string& operation,
+                                                const std::string& name)
+{
+    CryptoChromeCore::Operation op;
+    if (!CryptoChromeCore::parse_op(operation, op))
+        return ok_text(false, "Unknown operation " + operation);
 
-// Text Processing
-std::string CryptoChromeAPI::decrypt(std::string crypt_txt)
-{
-    stx::ExecPipe ep;               // creates new pipe
-
-    ep.set_input_string(&crypt_txt);
-    
-    std::vector<std::string> gpgargs;
-    gpgargs.push_back(get_gpg());
-    gpgargs.push_back("--quiet");
-    gpgargs.push_back("--no-tty"); 
-    gpgargs.push_back("--decrypt");
-    gpgargs.push_back("--use-agent");
-    gpgargs.push_back("--logger-fd");
-    gpgargs.push_back("1");
-    ep.add_execp(&gpgargs);
-
-    std::string output;
-    ep.set_output_string(&output);
-    
-
-    try {
-        ep.run();
+    std::string message;
+    bool ok = m_core.use_profile(op, name, message);
+    return ok_text(ok, message);
+}
+
+FB::VariantMap CryptoChromeAPI::gpg_profiles()
+{
+    CryptoChromeCore::ProfileMap profiles;
+    std::map<std::string, std::string> operations;
+    m_core.profiles(profiles, operations);
+
+    FB::VariantMap defined;
+    for (CryptoChromeCore::ProfileMap::const_iterator it = profiles.begin();
+         it != profiles.end(); ++it)
+    {
+        defined[it->first] = FB::VariantList(it->second.begin(), it->second.end());
     }
-    catch (std::runtime_error &e) {
-        return e.what();
+
+    FB::VariantMap applied;
+    for (std::map<std::string, std::string>::const_iterator it = operations.begin();
+         it != operations.end(); ++it)
+    {
+        applied[it->first] = it->second;
     }
 
-    return output;
+    FB::VariantMap result;
+    result["profiles"] = defined;
+    result["operations"] = applied;
+    return result;
+}
+
+// Text Processing
+std::string CryptoChromeAPI::decrypt(const std::string& crypt_txt)
+{
+    return m_core.decrypt(crypt_txt);
 }
 
-std::string CryptoChromeAPI::encrypt(std::string recipient, std::string clear_txt)
+CryptoChromeCore::Compression CryptoChromeAPI::compression_arg(
+    const boost::optional<std::string>& compression)
 {
-    stx::ExecPipe ep;
+    CryptoChromeCore::Compression c;
+    if (compression && !CryptoChromeCore::Compression::parse(*compression, c))
+        throw FB::script_error("Unknown compression " + *compression);
+    return c;
+}
 
-    ep.set_input_string(&clear_txt);
+std::string CryptoChromeAPI::encrypt(const std::string& recipient,
+                                     const std::string& clear_txt,
+                                     const boost::optional<std::string>& compression)
+{
+    return m_core.encrypt(recipient, clear_txt, compression_arg(compression));
+}
 
-    std::vector<std::string> gpgargs;
-    gpgargs.push_back(get_gpg());
-    gpgargs.push_back("--encrypt");
-    gpgargs.push_back("--quiet");
-    gpgargs.push_back("--no-tty"); 
-    gpgargs.push_back("--always-trust");    // maybe remove this?
-    gpgargs.push_back("--armor");
-    gpgargs.push_back("--logger-fd");
-    gpgargs.push_back("1");
-    gpgargs.push_back("--recipient");
-    gpgargs.push_back(recipient);   // email of the recipient
-    ep.add_execp(&gpgargs);
+std::string CryptoChromeAPI::clearsign(const std::string& clear_txt)
+{
+    return m_core.clearsign(clear_txt);
+}
 
-    std::string output;
-    ep.set_output_string(&output);
+std::string CryptoChromeAPI::encrypt_sign(const std::string& recipient,
+                                          const std::string& clear_txt,
+                                          const boost::optional<std::string>& compression)
+{
+    return m_core.encrypt_sign(recipient, clear_txt, compression_arg(compression));
+}
 
-    try {
-        ep.run();
-    }
-    catch (std::runtime_error &e) {
-        return e.what();
+FB::VariantList CryptoChromeAPI::decrypt_batch(const std::vector<std::string>& blocks,
+                                               const boost::optional<std::string>& priority)
+{
+    JobScheduler::Priority prio = JobScheduler::BULK;
+    if (priority && !JobScheduler::parse_priority(*priority, prio))
+        throw FB::script_error("Unknown priority " + *priority);
+
+    std::vector<CryptoChromeCore::Result> results;
+    m_core.decrypt_batch(blocks, results, prio);
+
+    FB::VariantList list;
+    for (unsigned int i = 0; i < results.size(); ++i) {
+        FB::VariantMap result = ok_text(results[i].ok, results[i].output);
+        result["diagnostics"] = results[i].diagnostics;
+        list.push_back(result);
     }
+    return list;
+}
 
-    return output;
+// File Processing
+FB::VariantMap CryptoChromeAPI::run_file(CryptoChromeCore::Operation op,
+                                         const std::vector<std::string>& recipients,
+                                         const std::string& in_path, const std::string& out_path,
+                                         JobScheduler::Priority prio,
+                                         const CryptoChromeCore::Compression& compression)
+{
+    std::string message;
+    bool ok = m_core.run_file(op, recipients, in_path, out_path, message, prio, compression);
+    return ok_text(ok, message);
 }
 
-std::string CryptoChromeAPI::clearsign(std::string clear_txt)
+FB::VariantMap CryptoChromeAPI::encrypt_file(const std::vector<std::string>& recipients,
+                                             const std::string& in_path, const std::string& out_path,
+                                             const boost::optional<std::string>& compression)
 {
-    stx::ExecPipe ep;
+    return run_file(CryptoChromeCore::OP_ENCRYPT_FILE, recipients, in_path, out_path,
+                    JobScheduler::INTERACTIVE, compression_arg(compression));
+}
 
-    ep.set_input_string(&clear_txt);
+FB::VariantMap CryptoChromeAPI::decrypt_file(const std::string& in_path, const std::string& out_path)
+{
+    return run_file(CryptoChromeCore::OP_DECRYPT_FILE, std::vector<std::string>(), in_path, out_path);
+}
 
-    std::vector<std::string> gpgargs;
-    gpgargs.push_back(get_gpg());
-    gpgargs.push_back("--clearsign");
-    gpgargs.push_back("--quiet");
-    gpgargs.push_back("--no-tty"); 
-    gpgargs.push_back("--armor");
-    gpgargs.push_back("--logger-fd");
-    gpgargs.push_back("1");
-    ep.add_execp(&gpgargs);
+FB::VariantMap CryptoChromeAPI::sign_file(const std::string& in_path, const std::string& out_path)
+{
+    return run_file(CryptoChromeCore::OP_SIGN_FILE, std::vector<std::string>(), in_path, out_path);
+}
 
-    std::string output;
-    ep.set_output_string(&output);
+// the chunks run in the bulk class, so decrypting a page stays responsive
+FB::VariantMap CryptoChromeAPI::encrypt_container(const std::vector<std::string>& recipients,
+                                                  const std::string& in_path,
+                                                  const std::string& out_path,
+                                                  const boost::optional<std::string>& compression)
+{
+    return run_file(CryptoChromeCore::OP_ENCRYPT_CONTAINER, recipients, in_path, out_path,
+                    JobScheduler::BULK, compression_arg(compression));
+}
 
-    try {
-        ep.run();
-    }
-    catch (std::runtime_error &e) {
-        return e.what();
-    }
+FB::VariantMap CryptoChromeAPI::decrypt_container(const std::string& in_path,
+                                                  const std::string& out_path)
+{
+    return run_file(CryptoChromeCore::OP_DECRYPT_CONTAINER, std::vector<std::string>(),
+                    in_path, out_path, JobScheduler::BULK);
+}
 
-    return output;
+int CryptoChromeAPI::cancel_queued(const std::string& priority)
+{
+    JobScheduler::Priority prio;
+    if (!JobScheduler::parse_priority(priority, prio))
+        throw FB::script_error("Unknown priority " + priority);
+
+    return m_core.scheduler().cancel_queued(prio);
 }
 
+void CryptoChromeAPI::prefetch(const std::vector<std::string>& blocks)
+{
+    m_core.prefetch(blocks);
+}
 
-std::string CryptoChromeAPI::encrypt_sign(std::string recipient, std::string clear_txt)
+void CryptoChromeAPI::clear_cache()
 {
-    stx::ExecPipe ep;
+    m_core.clear_cache();
+}
 
-    ep.set_input_string(&clear_txt);
+FB::VariantMap CryptoChromeAPI::agent_status()
+{
+    GpgAgent::Status st = m_core.agent().status();
+
+    FB::VariantMap result;
+    result["running"] = st.running;
+    result["pid"] = st.pid;
+    result["version"] = st.version;
+    result["default_cache_ttl"] = st.default_cache_ttl;
+    result["max_cache_ttl"] = st.max_cache_ttl;
+    result["presets"] = st.presets;
+    result["restarts"] = st.restarts;
+    result["last_check"] = st.last_check;
+    result["keepalive"] = m_core.agent().keepalive();
+    return result;
+}
 
-    std::vector<std::string> gpgargs;
-    gpgargs.push_back(get_gpg());
-    gpgargs.push_back("--encrypt");
-    gpgargs.push_back("--sign");
-    gpgargs.push_back("--quiet");
-    gpgargs.push_back("--no-tty"); 
-    gpgargs.push_back("--always-trust");    // maybe remove this?
-    gpgargs.push_back("--armor");
-    gpgargs.push_back("--logger-fd");
-    gpgargs.push_back("1");
-    gpgargs.push_back("--recipient");
-    gpgargs.push_back(recipient);   // email of the recipient
-    ep.add_execp(&gpgargs);
+FB::VariantMap CryptoChromeAPI::agent_start()
+{
+    std::string message;
+    bool ok = m_core.agent().ensure(message);
+    return ok_text(ok, message);
+}
 
-    std::string output;
-    ep.set_output_string(&output);
+void CryptoChromeAPI::set_agent_keepalive(int seconds)
+{
+    if (seconds < 0)
+        throw FB::script_error("Keepalive interval must not be negative");
 
-    try {
-        ep.run();
-    }
-    catch (std::runtime_error &e) {
-        return e.what();
-    }
+    m_core.agent().set_keepalive(seconds);
+}
+
+FB::VariantMap CryptoChromeAPI::set_cache_ttl(int default_ttl, int max_ttl)
+{
+    std::string message;
+    bool ok = m_core.agent().set_cache_ttl(default_ttl, max_ttl, false, message);
+    return ok_text(ok, message);
+}
 
-    return output;
+FB::VariantMap CryptoChromeAPI::preset_passphrase(const std::string& key,
+                                                  const std::string& passphrase)
+{
+    std::string message;
+    bool ok = m_core.agent().preset_passphrase(
+        key, secure_string(passphrase.data(), passphrase.size()), message);
+    return ok_text(ok, message);
+}
 
-}
\ No newline at end of file
+void CryptoChromeAPI::clear_passphrases()
+{
+    m_core.agent().clear_passphrases();
+}
@@ -10,6 +10,7 @@
 #include "JSAPIAuto.h"
 #include "BrowserHost.h"
 #include "CryptoChrome.h"
+#include "CryptoChromeCore.h"
 
 #ifndef H_CryptoChromeAPI
 #define H_CryptoChromeAPI
@@ -36,11 +37,35 @@ public:
 
         registerMethod("gpg_version",   make_method(this, &CryptoChromeAPI::gpg_version));
         registerMethod("set_gpg_path",   make_method(this, &CryptoChromeAPI::set_gpg_path));
+        registerMethod("set_gpg_profile",   make_method(this, &CryptoChromeAPI::set_gpg_profile));
+        registerMethod("remove_gpg_profile",   make_method(this, &CryptoChromeAPI::remove_gpg_profile));
+        registerMethod("use_gpg_profile",   make_method(this, &CryptoChromeAPI::use_gpg_profile));
+        registerMethod("gpg_profiles",   make_method(this, &CryptoChromeAPI::gpg_profiles));
 
         registerMethod("decrypt",   make_method(this, &CryptoChromeAPI::decrypt));
         registerMethod("encrypt",   make_method(this, &CryptoChromeAPI::encrypt));
         registerMethod("clearsign",   make_method(this, &CryptoChromeAPI::clearsign));
         registerMethod("encrypt_sign",   make_method(this, &CryptoChromeAPI::encrypt_sign));
+        registerMethod("decrypt_batch",   make_method(this, &CryptoChromeAPI::decrypt_batch));
+
+        registerMethod("encrypt_file",   make_method(this, &CryptoChromeAPI::encrypt_file));
+        registerMethod("decrypt_file",   make_method(this, &CryptoChromeAPI::decrypt_file));
+        registerMethod("sign_file",   make_method(this, &CryptoChromeAPI::sign_file));
+        registerMethod("encrypt_container",   make_method(this, &CryptoChromeAPI::encrypt_container));
+        registerMethod("decrypt_container",   make_method(this, &CryptoChromeAPI::decrypt_container));
+        registerMethod("cancel_queued",   make_method(this, &CryptoChromeAPI::cancel_queued));
+        registerMethod("prefetch",   make_method(this, &CryptoChromeAPI::prefetch));
+        registerMethod("clear_cache",   make_method(this, &CryptoChromeAPI::clear_cache));
+
+        registerMethod("agent_status",   make_method(this, &CryptoChromeAPI::agent_status));
+        registerMethod("agent_start",   make_method(this, &CryptoChromeAPI::agent_start));
+        registerMethod("set_agent_keepalive",   make_method(this, &CryptoChromeAPI::set_agent_keepalive));
+        registerMethod("set_cache_ttl",   make_method(this, &CryptoChromeAPI::set_cache_ttl));
+        registerMethod("preset_passphrase",   make_method(this, &CryptoChromeAPI::preset_passphrase));
+        registerMethod("clear_passphrases",   make_method(this, &CryptoChromeAPI::clear_passphrases));
+
+        registerMethod("stats",   make_method(this, &CryptoChromeAPI::stats));
+        registerMethod("reset_stats",   make_method(this, &CryptoChromeAPI::reset_stats));
 
         
 
@@ -54,8 +79,6 @@ public:
         registerProperty("version",
                          make_property(this,
                                        &CryptoChromeAPI::get_version));
-        
-        m_gpgpath = std::string();
     }
 
     ///////////////////////////////////////////////////////////////////////////////
@@ -81,13 +104,66 @@ public:
 
     // Configuration
     std::string gpg_version();
-    std::string set_gpg_path(std::string path);
+    std::string set_gpg_path(const std::string& path);
+
+    // Named gpg option profiles applied per operation; the setters return
+    // {ok, text} with an error message in text. Options are given as
+    // ["--trust-model", "direct"] or ["--trust-model=direct"].
+    FB::VariantMap set_gpg_profile(const std::string& name,
+                                   const std::vector<std::string>& options);
+    FB::VariantMap remove_gpg_profile(const std::string& name);
+    // An empty name runs operation without a profile
+    FB::VariantMap use_gpg_profile(const std::string& operation, const std::string& name);
+    // {profiles: {name: [options]}, operations: {operation: name}}
+    FB::VariantMap gpg_profiles();
 
     // Text Processing
-    std::string decrypt(std::string crypt_txt);
-    std::string encrypt(std::string recipient, std::string clear_txt);
-    std::string clearsign(std::string clear_txt);
-    std::string encrypt_sign(std::string recipient, std::string clear_txt);
+    std::string decrypt(const std::string& crypt_txt);
+    // The optional compression is "auto" (default), "none", a level 0-9,
+    // an algorithm (zip, zlib, bzip2) or "algorithm:level"
+    std::string encrypt(const std::string& recipient, const std::string& clear_txt,
+                        const boost::optional<std::string>& compression);
+    std::string clearsign(const std::string& clear_txt);
+    std::string encrypt_sign(const std::string& recipient, const std::string& clear_txt,
+                             const boost::optional<std::string>& compression);
+    FB::VariantList decrypt_batch(const std::vector<std::string>& blocks,
+                                  const boost::optional<std::string>& priority);
+
+    // File Processing, returning {ok, text} with an error message in text
+    FB::VariantMap encrypt_file(const std::vector<std::string>& recipients,
+                                const std::string& in_path, const std::string& out_path,
+                                const boost::optional<std::string>& compression);
+    FB::VariantMap decrypt_file(const std::string& in_path, const std::string& out_path);
+    FB::VariantMap sign_file(const std::string& in_path, const std::string& out_path);
+
+    // Chunked containers for very large files, processed by parallel gpg runs
+    FB::VariantMap encrypt_container(const std::vector<std::string>& recipients,
+                                     const std::string& in_path, const std::string& out_path,
+                                     const boost::optional<std::string>& compression);
+    FB::VariantMap decrypt_container(const std::string& in_path, const std::string& out_path);
+
+    // Drop the waiting jobs of a priority class ("prefetch" or "bulk")
+    int cancel_queued(const std::string& priority);
+
+    // Decrypt blocks in the background and cache the plaintexts for decrypt
+    void prefetch(const std::vector<std::string>& blocks);
+    void clear_cache();
+
+    // gpg-agent session; agent_start, set_cache_ttl and preset_passphrase
+    // return {ok, text} with an error message in text
+    FB::VariantMap agent_status();
+    FB::VariantMap agent_start();
+    // Check the agent every seconds in the background, 0 to stop
+    void set_agent_keepalive(int seconds);
+    // Cache lifetimes in seconds, gpg-agent.conf is restored when the plugin unloads
+    FB::VariantMap set_cache_ttl(int default_ttl, int max_ttl);
+    // Needs allow-preset-passphrase in gpg-agent.conf
+    FB::VariantMap preset_passphrase(const std::string& key, const std::string& passphrase);
+    void clear_passphrases();
+
+    // Performance counters aggregated per operation since the last reset
+    FB::VariantMap stats();
+    void reset_stats();
     
     // Event helpers
     FB_JSAPI_EVENT(test, 0, ());
@@ -97,12 +173,23 @@ public:
     void testEvent();
 
 private:
+    FB::VariantMap run_file(CryptoChromeCore::Operation op,
+                            const std::vector<std::string>& recipients,
+                            const std::string& in_path, const std::string& out_path,
+                            JobScheduler::Priority prio = JobScheduler::INTERACTIVE,
+                            const CryptoChromeCore::Compression& compression =
+                                CryptoChromeCore::Compression());
+
+    static CryptoChromeCore::Compression compression_arg(
+        const boost::optional<std::string>& compression);
+
     CryptoChromeWeakPtr m_plugin;
     FB::BrowserHostPtr m_host;
 
     std::string m_testString;
-    std::string m_gpgpath;
-    std::string get_gpg();
+
+    /// gpg logic shared with the standalone tools
+    CryptoChromeCore m_core;
 };
 
 #endif // H_CryptoChromeAPI
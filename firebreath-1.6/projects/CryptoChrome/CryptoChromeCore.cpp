@@ -0,0 +1,1503 @@
+/**********************************************************\
+
+  CryptoChromeCore.cpp
+
+\**********************************************************/
+
+#include "stx-execpipe.h"
+#include <algorithm>
+#include <stdexcept>
+
+#include <sstream>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "CryptoChromeCore.h"
+#include "ChunkedContainer.h"
+#include "PgpArmor.h"
+#include "SecureMemory.h"
+#include "Sha256.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+static const char* const s_op_names[] = {
+    "version", "decrypt", "encrypt", "clearsign", "encrypt_sign",
+    "encrypt_file", "decrypt_file", "sign_file", "encrypt_container", "decrypt_container"
+};
+
+/// Input files from this size on are passed to gpg from a mapping and
+/// dropped from the page cache afterwards, instead of being read by gpg.
+static const off_t s_mapped_input_size = 64 << 20;
+
+const char* CryptoChromeCore::op_name(Operation op)
+{
+    return s_op_names[op];
+}
+
+bool CryptoChromeCore::is_file_op(Operation op)
+{
+    return op == OP_ENCRYPT_FILE || op == OP_DECRYPT_FILE || op == OP_SIGN_FILE ||
+        op == OP_ENCRYPT_CONTAINER || op == OP_DECRYPT_CONTAINER;
+}
+
+bool CryptoChromeCore::parse_op(const std::string& name, Operation& op)
+{
+    for (unsigned int i = 0; i < sizeof(s_op_names) / sizeof(s_op_names[0]); ++i) {
+        if (name == s_op_names[i]) {
+            op = static_cast<Operation>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CryptoChromeCore::Compression::parse(const std::string& spec, Compression& c)
+{
+    c = Compression();
+    if (spec.empty() || spec == "auto")
+        return true;
+
+    c.automatic = false;
+    if (spec == "none") {
+        c.level = 0;
+        return true;
+    }
+
+    std::string algo = spec, level;
+    std::string::size_type colon = spec.find(':');
+    if (colon != std::string::npos) {
+        algo = spec.substr(0, colon);
+        level = spec.substr(colon + 1);
+        if (level.empty()) return false;
+    }
+    else if (spec.size() == 1 && isdigit(static_cast<unsigned char>(spec[0]))) {
+        algo.clear();
+        level = spec;
+    }
+
+    if (!algo.empty() && algo != "zip" && algo != "zlib" && algo != "bzip2")
+        return false;
+    if (!level.empty()) {
+        if (level.size() != 1 || !isdigit(static_cast<unsigned char>(level[0])))
+            return false;
+        c.level = level[0] - '0';
+    }
+
+    c.algo = algo;
+    return true;
+}
+
+bool CryptoChromeCore::incompressible(const char* data, unsigned long len)
+{
+    // small inputs compress quickly anyway and give no reliable estimate
+    if (len < 1024) return false;
+    if (len > 64 * 1024) len = 64 * 1024;
+
+    unsigned long count[256] = { 0 };
+    for (unsigned long i = 0; i < len; ++i)
+        ++count[static_cast<unsigned char>(data[i])];
+
+    // compressed and encrypted data come close to 8 bits of entropy per
+    // byte, text stays around 5 and even machine code below 7
+    double entropy = 0;
+    for (unsigned int i = 0; i < 256; ++i) {
+        if (!count[i]) continue;
+        double p = static_cast<double>(count[i]) / len;
+        entropy -= p * log(p);
+    }
+    return entropy / log(2.0) > 7.5;
+}
+
+bool CryptoChromeCore::incompressible_file(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+
+    // four samples, so a compressible header or tail does not decide alone
+    static const unsigned int samples = 4, sample_size = 16 * 1024;
+    std::string buffer(samples * sample_size, 0);
+    unsigned long used = 0;
+
+    for (unsigned int i = 0; i < samples; ++i)
+    {
+        off_t offset = st.st_size / samples * i;
+        ssize_t rb = pread(fd, &buffer[used], sample_size, offset);
+        if (rb > 0) used += rb;
+    }
+
+    return incompressible(buffer.data(), used);
+}
+
+CryptoChromeCore::Compression CryptoChromeCore::resolve(const Compression& compression,
+                                                       bool incompressible_input)
+{
+    Compression c = compression;
+    if (c.automatic) {
+        c.automatic = false;
+        if (incompressible_input)
+            c.level = 0;
+    }
+    return c;
+}
+
+/// Collects gpg's output in secure memory, so growing the buffer leaves no
+/// stray copies of the plaintext on the heap.
+class SecureStringSink : public stx::PipeSink
+{
+private:
+    secure_string& m_output;
+
+public:
+    explicit SecureStringSink(secure_string& output)
+        : m_output(output)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+        m_output.append(static_cast<const char*>(data), datalen);
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+/// Collects gpg's messages, which hold no secrets.
+class StringSink : public stx::PipeSink
+{
+private:
+    std::string& m_output;
+
+public:
+    explicit StringSink(std::string& output)
+        : m_output(output)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+        m_output.append(static_cast<const char*>(data), datalen);
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+/// The pipe of a thread's gpg runs, which is reset and run again by its
+/// next call instead of setting up a new one.
+struct GpgPipe
+{
+    stx::ExecPipe pipe;
+    CryptoChromeCore::ArgVector argv;   // gpg's command line, read by run()
+    bool ready;                         // gpg's stage was added
+
+    GpgPipe() : ready(false) {}
+
+    /// Unbind the last run's streams, argv must be set.
+    stx::ExecPipe& prepare()
+    {
+        pipe.reset();
+        if (!ready) {
+            pipe.add_execp(&argv.args);
+            ready = true;
+        }
+        return pipe;
+    }
+
+    /// A pipe whose run() threw may be left in any state, so use a new one.
+    void discard()
+    {
+        pipe = stx::ExecPipe();
+        ready = false;
+    }
+};
+
+static GpgPipe& gpg_pipe()
+{
+    // never destroyed: threads may still exit during static destruction
+    static ThreadLocal<GpgPipe>* pipes = new ThreadLocal<GpgPipe>;
+    return pipes->get();
+}
+
+static double timestamp()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+CryptoChromeCore::CryptoChromeCore()
+    : m_templates(build_templates("gpg", NULL)), m_session_keys(4096, 1 << 20, 3600),
+      m_prefetch_running(0), m_stopping(false)
+{
+    m_agent.set_gpg(m_templates->args[OP_VERSION][0]);
+}
+
+CryptoChromeCore::~CryptoChromeCore()
+{
+    {
+        MutexLock lock(m_prefetch_lock);
+        m_stopping = true;
+    }
+
+    // prefetches still waiting for a slot give up, running ones finish
+    m_scheduler.cancel_queued(JobScheduler::PREFETCH);
+
+    {
+        MutexLock lock(m_prefetch_lock);
+        while (m_prefetch_running > 0)
+            m_prefetch_cond.wait(m_prefetch_lock);
+    }
+
+    release_templates(m_templates);
+}
+
+bool CryptoChromeCore::stopping()
+{
+    MutexLock lock(m_prefetch_lock);
+    return m_stopping;
+}
+
+CryptoChromeCore::OpStats::OpStats()
+    : calls(0), failures(0), coalesced(0), cache_hits(0), session_key_hits(0),
+      queue_time(0), wall_time(0), spawn_time(0), first_byte_time(0), user_time(0), sys_time(0),
+      bytes_in(0), bytes_out(0),
+      select_calls(0), read_calls(0), write_calls(0),
+      peak_buffer(0)
+{
+}
+
+std::string CryptoChromeCore::get_gpg() const
+{
+    MutexLock lock(m_config_lock);
+
+    if (m_gpgpath.length() == 0) {
+        return "gpg";
+    }
+    return m_gpgpath;
+}
+
+/// Find program in PATH as execvp() would, so the children can exec it
+/// without searching. Returns program itself if it contains a slash or is
+/// not found.
+static std::string resolve_program(const std::string& program)
+{
+    if (program.find('/') != std::string::npos)
+        return program;
+
+    const char* env = getenv("PATH");
+    std::string path = env ? env : "/bin:/usr/bin";
+
+    std::string::size_type pos = 0;
+    while (true)
+    {
+        std::string::size_type colon = path.find(':', pos);
+        std::string dir = path.substr(pos, colon == std::string::npos ? colon : colon - pos);
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + program;
+
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate.c_str(), X_OK) == 0)
+            return candidate;
+
+        if (colon == std::string::npos)
+            return program;
+        pos = colon + 1;
+    }
+}
+
+static AtomicCounter s_template_serial;
+
+CryptoChromeCore::ArgTemplates* CryptoChromeCore::build_templates(const std::string& gpg,
+                                                                  const std::vector<std::string>* options)
+{
+    ArgTemplates* templates = new ArgTemplates;
+    templates->serial = s_template_serial.fetch_add(1) + 1;
+    templates->refs = 1;
+
+    std::string program = resolve_program(gpg);
+
+    for (unsigned int i = 0; i < num_operations; ++i)
+    {
+        Operation op = static_cast<Operation>(i);
+        std::vector<std::string>& gpgargs = templates->args[i];
+
+        gpgargs.push_back(program);
+
+        switch (op)
+        {
+        case OP_VERSION:
+            gpgargs.push_back("--version");
+            break;
+
+        // gpg's messages go to stderr, which execute() keeps apart from the
+        // output
+        case OP_DECRYPT:
+            gpgargs.push_back("--quiet");
+            gpgargs.push_back("--no-tty");
+            gpgargs.push_back("--decrypt");
+            gpgargs.push_back("--use-agent");
+            break;
+
+        case OP_CLEARSIGN:
+            gpgargs.push_back("--clearsign");
+            gpgargs.push_back("--quiet");
+            gpgargs.push_back("--no-tty");
+            gpgargs.push_back("--armor");
+            break;
+
+        case OP_ENCRYPT:
+        case OP_ENCRYPT_SIGN:
+            gpgargs.push_back("--encrypt");
+            if (op == OP_ENCRYPT_SIGN)
+                gpgargs.push_back("--sign");
+            gpgargs.push_back("--quiet");
+            gpgargs.push_back("--no-tty");
+            gpgargs.push_back("--always-trust");    // maybe remove this?
+            gpgargs.push_back("--armor");
+            break;
+
+        // the file operations write binary data to the output file, so gpg's
+        // messages must not go to stdout
+        case OP_ENCRYPT_FILE:
+            gpgargs.push_back("--encrypt");
+            gpgargs.push_back("--quiet");
+            gpgargs.push_back("--no-tty");
+            gpgargs.push_back("--always-trust");
+            break;
+
+        case OP_DECRYPT_FILE:
+            gpgargs.push_back("--decrypt");
+            gpgargs.push_back("--quiet");
+            gpgargs.push_back("--no-tty");
+            gpgargs.push_back("--use-agent");
+            break;
+
+        case OP_SIGN_FILE:
+            gpgargs.push_back("--detach-sign");
+            gpgargs.push_back("--quiet");
+            gpgargs.push_back("--no-tty");
+            gpgargs.push_back("--use-agent");
+            break;
+
+        // the containers run gpg per chunk with the arguments of the file
+        // operations, see ChunkedContainer
+        case OP_ENCRYPT_CONTAINER:
+        case OP_DECRYPT_CONTAINER:
+            break;
+        }
+
+        // after the built-in options, so a profile's --trust-model wins
+        // over --always-trust
+        if (options)
+            gpgargs.insert(gpgargs.end(), options[i].begin(), options[i].end());
+
+        if (op == OP_ENCRYPT || op == OP_ENCRYPT_SIGN || op == OP_ENCRYPT_FILE) {
+            gpgargs.push_back("--recipient");
+            gpgargs.push_back("");
+        }
+    }
+
+    return templates;
+}
+
+void CryptoChromeCore::release_templates(ArgTemplates* templates) const
+{
+    {
+        MutexLock lock(m_config_lock);
+        if (--templates->refs > 0)
+            return;
+    }
+    delete templates;
+}
+
+CryptoChromeCore::TemplateRef::TemplateRef(const CryptoChromeCore& core)
+    : m_core(core)
+{
+    MutexLock lock(core.m_config_lock);
+    m_templates = core.m_templates;
+    ++m_templates->refs;
+}
+
+CryptoChromeCore::TemplateRef::~TemplateRef()
+{
+    m_core.release_templates(m_templates);
+}
+
+void CryptoChromeCore::ArgVector::copy(const TemplateRef& templates, Operation op)
+{
+    const std::vector<std::string>& tmpl = templates.args(op);
+
+    if (serial == templates.serial() && this->op == op && args.size() >= tmpl.size()) {
+        args.resize(tmpl.size());
+        return;
+    }
+
+    args = tmpl;
+    serial = templates.serial();
+    this->op = op;
+}
+
+const std::vector<std::string>&
+CryptoChromeCore::build_args(const TemplateRef& templates, Operation op,
+                             const std::string* recipients, unsigned int num_recipients,
+                             const Compression& compression, ArgVector& storage)
+{
+    const std::vector<std::string>& args = templates.args(op);
+
+    bool encrypting = (op == OP_ENCRYPT || op == OP_ENCRYPT_SIGN || op == OP_ENCRYPT_FILE);
+    if (!encrypting)
+        return args;
+
+    storage.copy(templates, op);
+    std::vector<std::string>& out = storage.args;
+
+    if (num_recipients == 0) {
+        out.resize(out.size() - 2);     // drop the empty slot
+        storage.serial = 0;
+    }
+    else {
+        out.back() = recipients[0];
+    }
+
+    if (!compression.algo.empty()) {
+        out.push_back("--compress-algo");
+        out.push_back(compression.algo);
+    }
+    if (compression.level >= 0) {
+        out.push_back("-z");
+        out.push_back(std::string(1, '0' + compression.level));
+    }
+
+    for (unsigned int i = 1; i < num_recipients; ++i) {
+        out.push_back("--recipient");
+        out.push_back(recipients[i]);
+    }
+
+    return out;
+}
+
+unsigned long long CryptoChromeCore::flight_key(Operation op, const std::string& recipient,
+                                                const std::string& input)
+{
+    // 64-bit FNV-1a, only used to find candidates which are compared in full
+    unsigned long long h = 14695981039346656037ULL;
+
+    h = (h ^ static_cast<unsigned int>(op)) * 1099511628211ULL;
+    for (std::string::size_type i = 0; i < recipient.size(); ++i)
+        h = (h ^ static_cast<unsigned char>(recipient[i])) * 1099511628211ULL;
+    h = (h ^ 0xff) * 1099511628211ULL;
+    for (std::string::size_type i = 0; i < input.size(); ++i)
+        h = (h ^ static_cast<unsigned char>(input[i])) * 1099511628211ULL;
+
+    return h;
+}
+
+bool CryptoChromeCore::run(Operation op, const std::string& recipient,
+                           const std::string& input, std::string& output,
+                           JobScheduler::Priority prio, const Compression& compression,
+                           std::string* diagnostics)
+{
+    if (is_file_op(op)) {
+        output = std::string(op_name(op)) + " works on files, not strings";
+        return false;
+    }
+
+    std::string messages;
+    bool ok = run_shared(op, recipient, input, compression, output, messages, prio);
+
+    if (diagnostics)
+        diagnostics->swap(messages);
+    else if (ok)
+        output += messages;
+
+    return ok;
+}
+
+bool CryptoChromeCore::run_shared(Operation op, const std::string& recipient,
+                                  const std::string& input, const Compression& compression,
+                                  std::string& output, std::string& diagnostics,
+                                  JobScheduler::Priority prio)
+{
+    unsigned long long key = flight_key(op, recipient, input);
+
+    {
+        MutexLock lock(m_flight_lock);
+
+        for (FlightMap::iterator it = m_flights.lower_bound(key);
+             it != m_flights.end() && it->first == key; ++it)
+        {
+            Flight* f = it->second;
+            if (f->op != op || *f->recipient != recipient || *f->input != input ||
+                !(*f->compression == compression))
+                continue;
+
+            // join the identical run and copy its result. A queued run of
+            // a lower class must not make this caller wait longer.
+            if (f->ticket)
+                m_scheduler.promote(*f->ticket, prio);
+
+            ++f->waiters;
+            while (!f->done)
+                f->cond.wait(m_flight_lock);
+
+            output = *f->output;
+            diagnostics = *f->diagnostics;
+            bool ok = f->ok;
+
+            if (--f->waiters == 0)
+                f->cond.broadcast();
+
+            MutexLock slock(m_stats_lock);
+            m_stats[op_name(op)].coalesced += 1;
+            return ok;
+        }
+    }
+
+    JobScheduler::Ticket ticket(m_scheduler, prio);
+
+    Flight flight;
+    flight.op = op;
+    flight.recipient = &recipient;
+    flight.input = &input;
+    flight.compression = &compression;
+    flight.ticket = &ticket;
+    flight.done = false;
+    flight.ok = false;
+    flight.output = &output;
+    flight.diagnostics = &diagnostics;
+    flight.waiters = 0;
+
+    FlightMap::iterator self;
+    {
+        MutexLock lock(m_flight_lock);
+        self = m_flights.insert(std::make_pair(key, &flight));
+    }
+
+    double t0 = timestamp();
+
+    if (ticket.acquire()) {
+        flight.ok = execute(op, recipient, input, compression, output, diagnostics,
+                            timestamp() - t0);
+    }
+    else {
+        record_stats(op, NULL, timestamp() - t0, true);
+        output = "Cancelled";
+        flight.ok = false;
+    }
+
+    MutexLock lock(m_flight_lock);
+    m_flights.erase(self);
+    flight.done = true;
+    flight.cond.broadcast();
+
+    // output and flight must stay alive until every waiter has its copy
+    while (flight.waiters > 0)
+        flight.cond.wait(m_flight_lock);
+
+    return flight.ok;
+}
+
+void CryptoChromeCore::ensure_agent(Operation op)
+{
+    switch (op)
+    {
+    case OP_DECRYPT:
+    case OP_CLEARSIGN:
+    case OP_ENCRYPT_SIGN:
+    case OP_DECRYPT_FILE:
+    case OP_SIGN_FILE:
+    case OP_DECRYPT_CONTAINER:
+    {
+        std::string message;
+        m_agent.ensure(message);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool CryptoChromeCore::execute(Operation op, const std::string& recipient,
+                               const std::string& input, const Compression& compression,
+                               std::string& output, std::string& diagnostics,
+                               double queue_time)
+{
+    if (op == OP_DECRYPT)
+        return execute_decrypt(input, output, diagnostics, queue_time);
+
+    bool encrypting = (op == OP_ENCRYPT || op == OP_ENCRYPT_SIGN);
+    Compression c = resolve(compression, encrypting && compression.automatic &&
+                            incompressible(input.data(), input.size()));
+
+    TemplateRef templates(*this);
+    GpgPipe& gp = gpg_pipe();
+    // the thread's last command line is patched if it used the same template
+    const std::vector<std::string>& gpgargs =
+        build_args(templates, op, &recipient, encrypting ? 1 : 0, c, gp.argv);
+    if (&gpgargs != &gp.argv.args)
+        gp.argv.copy(templates, op);
+
+    ensure_agent(op);
+
+    stx::ExecPipe& ep = gp.prepare();
+
+    if (op != OP_VERSION)
+        ep.set_input_string(&input);
+
+    secure_string buffer;
+    std::string messages;
+    SecureStringSink sink(buffer);
+    StringSink message_sink(messages);
+    ep.set_output_sink(&sink);
+    ep.add_stderr_output(&message_sink);
+
+    try {
+        ep.run();
+    }
+    catch (std::runtime_error &e) {
+        record_stats(op, &ep, queue_time, true);
+        gp.discard();
+        output = e.what();
+        diagnostics.clear();
+        return false;
+    }
+
+    bool ok = ep.all_return_codes_zero();
+    record_stats(op, &ep, queue_time, !ok);
+
+    // a single copy of the final size leaves the secure memory. Partial
+    // output of a failed run is dropped in favour of the error.
+    if (ok)
+        output.assign(buffer.data(), buffer.size());
+    else
+        output = messages;
+
+    diagnostics.swap(messages);
+    return ok;
+}
+
+bool CryptoChromeCore::execute_decrypt(const std::string& input, std::string& output,
+                                       std::string& diagnostics, double queue_time)
+{
+    Sha256 sha;
+    sha.update(input.data(), input.size());
+    std::string digest = sha.digest();
+
+    secure_string session_key;
+    if (m_session_keys.lookup(digest, session_key))
+    {
+        if (run_decrypt(input, session_key, true, output, diagnostics, queue_time)) {
+            MutexLock lock(m_stats_lock);
+            m_stats[op_name(OP_DECRYPT)].session_key_hits += 1;
+            return true;
+        }
+
+        // fall back to the secret key
+        m_session_keys.erase(digest);
+        session_key.clear();
+    }
+
+    ensure_agent(OP_DECRYPT);
+
+    bool ok = run_decrypt(input, session_key, false, output, diagnostics, queue_time);
+    if (ok && !session_key.empty())
+        m_session_keys.insert(digest, session_key);
+
+    return ok;
+}
+
+bool CryptoChromeCore::run_decrypt(const std::string& input, secure_string& session_key,
+                                   bool reuse, std::string& output, std::string& diagnostics,
+                                   double queue_time)
+{
+    TemplateRef templates(*this);
+    GpgPipe& gp = gpg_pipe();
+    gp.argv.copy(templates, OP_DECRYPT);
+    std::vector<std::string>& gpgargs = gp.argv.args;
+
+    stx::ExecPipe& ep = gp.prepare();
+    ep.set_input_string(&input);
+
+    secure_string buffer, log, status;
+    SecureStringSink sink(buffer), log_sink(log), status_sink(status);
+    ep.set_output_sink(&sink);
+
+    // gpg logs the session key, so its messages are kept in secure memory
+    ep.add_stderr_output(&log_sink);
+
+    std::ostringstream fds;
+    if (reuse) {
+        fds << ep.add_fd_input(session_key.data(), session_key.size());
+        gpgargs.push_back("--override-session-key-fd");
+        gpgargs.push_back(fds.str());
+    }
+    else {
+        fds << ep.add_fd_output(&status_sink);
+        gpgargs.push_back("--show-session-key");
+        gpgargs.push_back("--status-fd");
+        gpgargs.push_back(fds.str());
+    }
+
+    try {
+        ep.run();
+    }
+    catch (std::runtime_error &e) {
+        record_stats(OP_DECRYPT, &ep, queue_time, true);
+        gp.discard();
+        output = e.what();
+        diagnostics.clear();
+        return false;
+    }
+
+    bool ok = ep.all_return_codes_zero();
+    record_stats(OP_DECRYPT, &ep, queue_time, !ok);
+
+    // "[GNUPG:] SESSION_KEY algo:hexkey"
+    static const char tag[] = "[GNUPG:] SESSION_KEY ";
+    secure_string::size_type pos = status.find(tag);
+    if (!reuse && pos != secure_string::npos) {
+        pos += sizeof(tag) - 1;
+        session_key.assign(status, pos, status.find('\n', pos) - pos);
+    }
+
+    // all of gpg's messages except those showing the session key
+    diagnostics.clear();
+    for (secure_string::size_type begin = 0; begin < log.size(); )
+    {
+        secure_string::size_type end = log.find('\n', begin);
+        end = (end == secure_string::npos) ? log.size() : end + 1;
+
+        if (session_key.empty() ||
+            log.find(session_key.c_str(), begin, session_key.size()) >= end)
+            diagnostics.append(log.data() + begin, end - begin);
+
+        begin = end;
+    }
+
+    if (ok)
+        output.assign(buffer.data(), buffer.size());
+    else
+        output = diagnostics;
+
+    return ok;
+}
+
+bool CryptoChromeCore::run_file(Operation op, const std::vector<std::string>& recipients,
+                                const std::string& in_path, const std::string& out_path,
+                                std::string& message, JobScheduler::Priority prio,
+                                const Compression& compression)
+{
+    if (!is_file_op(op)) {
+        message = std::string(op_name(op)) + " is not a file operation";
+        return false;
+    }
+    if (in_path.empty() || out_path.empty()) {
+        message = "Input and output file must be given";
+        return false;
+    }
+    if ((op == OP_ENCRYPT_FILE || op == OP_ENCRYPT_CONTAINER) && recipients.empty()) {
+        message = "No recipients given";
+        return false;
+    }
+
+    // gpg leaves partial output behind on errors, so write next to the
+    // destination and rename on success
+    std::string part_path = out_path + ".part";
+
+    bool ok;
+    if (op == OP_ENCRYPT_CONTAINER) {
+        ChunkedContainer container(*this, ChunkedContainer::default_chunk_size, prio);
+        ok = container.encrypt(recipients, in_path, part_path, message, compression);
+    }
+    else if (op == OP_DECRYPT_CONTAINER) {
+        ChunkedContainer container(*this, ChunkedContainer::default_chunk_size, prio);
+        ok = container.decrypt(in_path, part_path, message);
+    }
+    else {
+        ok = execute_file(op, recipients, in_path, part_path, compression, message, prio);
+    }
+
+    if (ok && rename(part_path.c_str(), out_path.c_str()) != 0) {
+        ok = false;
+        message = std::string("Could not rename output file: ") + strerror(errno);
+    }
+
+    if (ok)
+        message.clear();
+    else
+        unlink(part_path.c_str());
+
+    return ok;
+}
+
+bool CryptoChromeCore::execute_file(Operation op, const std::vector<std::string>& recipients,
+                                    const std::string& in_path, const std::string& part_path,
+                                    const Compression& compression, std::string& message,
+                                    JobScheduler::Priority prio)
+{
+    // a missing input is reported by the pipe. Other threads may fork
+    // while it is open, so it is not inherited by their children.
+    int in_fd = open(in_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    bool mapped = in_fd >= 0 && fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= s_mapped_input_size;
+
+    bool skip_compression = false;
+    if (op == OP_ENCRYPT_FILE && compression.automatic && in_fd >= 0)
+        skip_compression = incompressible_file(in_fd);
+
+    TemplateRef templates(*this);
+    ArgVector storage;
+    const std::vector<std::string>& gpgargs =
+        build_args(templates, op, recipients, resolve(compression, skip_compression), storage);
+
+    JobScheduler::Ticket ticket(m_scheduler, prio);
+    double t0 = timestamp();
+
+    if (!ticket.acquire()) {
+        record_stats(op, NULL, timestamp() - t0, true);
+        message = "Cancelled";
+        if (in_fd >= 0) close(in_fd);
+        return false;
+    }
+
+    double queue_time = timestamp() - t0;
+
+    ensure_agent(op);
+
+    std::string messages;
+    StringSink message_sink(messages);
+
+    stx::ExecPipe ep;
+    if (mapped)
+        ep.set_input_mapped(in_fd, 0, st.st_size);
+    else
+        ep.set_input_file(in_path.c_str());
+    ep.add_execp(&gpgargs);
+    ep.add_stderr_output(&message_sink);
+    ep.set_output_file(part_path.c_str(), 0600);
+
+    bool ok;
+    try {
+        ep.run();
+
+        ok = ep.all_return_codes_zero();
+        if (!ok) {
+            std::ostringstream oss;
+            oss << "gpg " << op_name(op) << " failed with exit code " << ep.get_return_code(0);
+            message = with_messages(oss.str(), messages);
+        }
+    }
+    catch (std::runtime_error &e) {
+        ok = false;
+        message = e.what();
+    }
+
+    if (in_fd >= 0) close(in_fd);
+
+    record_stats(op, &ep, queue_time, !ok);
+    return ok;
+}
+
+std::string CryptoChromeCore::with_messages(const std::string& what,
+                                            const std::string& messages)
+{
+    std::string::size_type end = messages.find_last_not_of('\n');
+    if (end == std::string::npos)
+        return what;
+    return what + ":\n" + messages.substr(0, end + 1);
+}
+
+void CryptoChromeCore::record_stats(Operation op, const stx::ExecPipe* ep, double queue_time,
+                                    bool failed)
+{
+    MutexLock lock(m_stats_lock);
+    OpStats& os = m_stats[op_name(op)];
+
+    os.calls += 1;
+    if (failed) os.failures += 1;
+    os.queue_time += queue_time;
+
+    if (!ep) return;    // cancelled before gpg was started
+
+    const stx::ExecPipe::Stats& ps = ep->stats();
+
+    os.wall_time += ps.wall_time;
+    for (unsigned int i = 0; i < ps.stages.size(); ++i) {
+        os.spawn_time += ps.stages[i].spawn_time;
+        os.user_time += ps.stages[i].user_time;
+        os.sys_time += ps.stages[i].sys_time;
+    }
+    if (!ps.stages.empty() && ps.stages.back().first_byte_time >= 0)
+        os.first_byte_time += ps.stages.back().first_byte_time;
+
+    os.bytes_in += ps.bytes_in;
+    os.bytes_out += ps.bytes_out;
+    os.select_calls += ps.select_calls;
+    os.read_calls += ps.read_calls;
+    os.write_calls += ps.write_calls;
+    if (os.peak_buffer < ps.peak_buffer)
+        os.peak_buffer = ps.peak_buffer;
+}
+
+CryptoChromeCore::StatsMap CryptoChromeCore::stats()
+{
+    MutexLock lock(m_stats_lock);
+    return m_stats;
+}
+
+void CryptoChromeCore::reset_stats()
+{
+    MutexLock lock(m_stats_lock);
+    m_stats.clear();
+}
+
+// Configuration
+std::string CryptoChromeCore::gpg_version()
+{
+    std::string output;
+    run(OP_VERSION, std::string(), std::string(), output);
+    return output;
+}
+
+std::string CryptoChromeCore::set_gpg_path(const std::string& path)
+{
+    {
+        MutexLock lock(m_profile_lock);
+        {
+            MutexLock config_lock(m_config_lock);
+            m_gpgpath = path;
+        }
+        update_templates();
+    }
+
+    return gpg_version();
+}
+
+void CryptoChromeCore::update_templates()
+{
+    std::vector<std::string> options[num_operations];
+    for (unsigned int i = 0; i < num_operations; ++i) {
+        if (!m_op_profiles[i].empty())
+            options[i] = m_profiles[m_op_profiles[i]];
+    }
+
+    // the argument vectors are rebuilt here instead of for every call
+    ArgTemplates* templates = build_templates(get_gpg(), options);
+    std::string program = templates->args[OP_VERSION][0];
+    ArgTemplates* old;
+    {
+        MutexLock lock(m_config_lock);
+        old = m_templates;
+        m_templates = templates;
+    }
+    release_templates(old);
+
+    m_agent.set_gpg(program);
+}
+
+/// Options a profile may contain. None of them lets gpg ask questions,
+/// write its output elsewhere or run other programs.
+struct ProfileOption
+{
+    const char* name;
+    enum { FLAG, VALUE, PATH } arg;
+    const char* const* values;  // accepted values of VALUE, NULL-terminated
+};
+
+static const char* const s_trust_models[] = {
+    "pgp", "classic", "direct", "always", "auto", "tofu", "tofu+pgp", NULL
+};
+static const char* const s_cipher_algos[] = {
+    "AES", "AES192", "AES256", "TWOFISH", "CAMELLIA128", "CAMELLIA192", "CAMELLIA256",
+    "3DES", "CAST5", "BLOWFISH", NULL
+};
+static const char* const s_digest_algos[] = {
+    "SHA256", "SHA384", "SHA512", "SHA224", "SHA1", "RIPEMD160", NULL
+};
+
+static const ProfileOption s_profile_options[] = {
+    { "--batch",                  ProfileOption::FLAG,  NULL },
+    { "--always-trust",           ProfileOption::FLAG,  NULL },
+    { "--trust-model",            ProfileOption::VALUE, s_trust_models },
+    { "--no-auto-check-trustdb",  ProfileOption::FLAG,  NULL },
+    { "--no-default-keyring",     ProfileOption::FLAG,  NULL },
+    { "--keyring",                ProfileOption::PATH,  NULL },
+    { "--primary-keyring",        ProfileOption::PATH,  NULL },
+    { "--cipher-algo",            ProfileOption::VALUE, s_cipher_algos },
+    { "--digest-algo",            ProfileOption::VALUE, s_digest_algos },
+    { "--no-random-seed-file",    ProfileOption::FLAG,  NULL },
+    { "--no-symkey-cache",        ProfileOption::FLAG,  NULL },
+    { "--no-greeting",            ProfileOption::FLAG,  NULL },
+    { "--no-permission-warning",  ProfileOption::FLAG,  NULL },
+    { "--no-emit-version",        ProfileOption::FLAG,  NULL },
+    { "--no-comments",            ProfileOption::FLAG,  NULL },
+    { "--throw-keyids",           ProfileOption::FLAG,  NULL },
+};
+
+bool CryptoChromeCore::check_options(const std::vector<std::string>& options,
+                                     std::vector<std::string>& args, std::string& message)
+{
+    static const unsigned int num_options = sizeof(s_profile_options) / sizeof(s_profile_options[0]);
+
+    args.clear();
+    for (unsigned int i = 0; i < options.size(); ++i)
+    {
+        std::string name = options[i], value;
+        std::string::size_type eq = name.find('=');
+        if (eq != std::string::npos) {
+            value = name.substr(eq + 1);
+            name.erase(eq);
+        }
+
+        const ProfileOption* option = NULL;
+        for (unsigned int o = 0; o < num_options && !option; ++o) {
+            if (name == s_profile_options[o].name)
+                option = &s_profile_options[o];
+        }
+        if (!option) {
+            message = "Option " + name + " is not allowed in a profile";
+            return false;
+        }
+
+        args.push_back(name);
+        if (option->arg == ProfileOption::FLAG) {
+            if (eq != std::string::npos) {
+                message = "Option " + name + " takes no value";
+                return false;
+            }
+            continue;
+        }
+
+        if (eq == std::string::npos) {
+            if (i + 1 == options.size()) {
+                message = "Option " + name + " needs a value";
+                return false;
+            }
+            value = options[++i];
+        }
+
+        bool valid = !value.empty();
+        for (std::string::size_type c = 0; c < value.size() && valid; ++c)
+            valid = !iscntrl(static_cast<unsigned char>(value[c]));
+
+        if (valid && option->values) {
+            valid = false;
+            for (const char* const* v = option->values; *v && !valid; ++v)
+                valid = (strcasecmp(value.c_str(), *v) == 0);
+        }
+        if (!valid) {
+            message = "Invalid value for " + name + ": " + value;
+            return false;
+        }
+
+        args.push_back(value);
+    }
+
+    return true;
+}
+
+/// Profile names are also used as JSON keys and in messages.
+static bool valid_profile_name(const std::string& name)
+{
+    if (name.empty() || name.size() > 64)
+        return false;
+
+    for (std::string::size_type i = 0; i < name.size(); ++i) {
+        if (!isalnum(static_cast<unsigned char>(name[i])) && name[i] != '-' && name[i] != '_')
+            return false;
+    }
+    return true;
+}
+
+bool CryptoChromeCore::set_profile(const std::string& name,
+                                   const std::vector<std::string>& options,
+                                   std::string& message)
+{
+    if (!valid_profile_name(name)) {
+        message = "Invalid profile name \"" + name + "\"";
+        return false;
+    }
+
+    std::vector<std::string> args;
+    if (!check_options(options, args, message))
+        return false;
+
+    {
+        MutexLock lock(m_profile_lock);
+        m_profiles[name].swap(args);
+        update_templates();
+    }
+    clear_cache();
+
+    message.clear();
+    return true;
+}
+
+bool CryptoChromeCore::remove_profile(const std::string& name, std::string& message)
+{
+    {
+        MutexLock lock(m_profile_lock);
+        if (m_profiles.erase(name) == 0) {
+            message = "Unknown profile \"" + name + "\"";
+            return false;
+        }
+
+        for (unsigned int i = 0; i < num_operations; ++i) {
+            if (m_op_profiles[i] == name)
+                m_op_profiles[i].clear();
+        }
+        update_templates();
+    }
+    clear_cache();
+
+    message.clear();
+    return true;
+}
+
+bool CryptoChromeCore::use_profile(Operation op, const std::string& name, std::string& message)
+{
+    if (op == OP_ENCRYPT_CONTAINER || op == OP_DECRYPT_CONTAINER) {
+        message = "Containers use the profiles of encrypt_file and decrypt_file";
+        return false;
+    }
+
+    {
+        MutexLock lock(m_profile_lock);
+        if (!name.empty() && m_profiles.find(name) == m_profiles.end()) {
+            message = "Unknown profile \"" + name + "\"";
+            return false;
+        }
+
+        m_op_profiles[op] = name;
+        update_templates();
+    }
+    clear_cache();
+
+    message.clear();
+    return true;
+}
+
+void CryptoChromeCore::profiles(ProfileMap& profiles,
+                                std::map<std::string, std::string>& operations) const
+{
+    MutexLock lock(m_profile_lock);
+
+    profiles = m_profiles;
+    operations.clear();
+    for (unsigned int i = 0; i < num_operations; ++i) {
+        if (!m_op_profiles[i].empty())
+            operations[op_name(static_cast<Operation>(i))] = m_op_profiles[i];
+    }
+}
+
+bool CryptoChromeCore::decrypt_armored(const std::string& crypt_txt, std::string& output,
+                                       JobScheduler::Priority prio, std::string* diagnostics)
+{
+    if (diagnostics)
+        diagnostics->clear();
+
+    std::vector<PgpArmor::Block> blocks;
+    PgpArmor::split(crypt_txt, blocks);
+
+    if (blocks.empty()) {
+        output = "No PGP armored data found";
+        return false;
+    }
+
+    // malformed blocks are dropped before spawning anything, the input is
+    // only rejected if none is left. The decoded packets of encrypted
+    // messages identify them in the result cache.
+    std::vector<std::string> keys(blocks.size());
+    std::string error;
+    unsigned int valid = 0;
+
+    for (unsigned int i = 0; i < blocks.size(); ++i) {
+        std::string block_error;
+        if (!PgpArmor::check(crypt_txt, blocks[i], block_error, &keys[valid])) {
+            if (error.empty())
+                error.swap(block_error);
+            continue;
+        }
+        if (blocks[i].type != "MESSAGE")
+            keys[valid].clear();
+        blocks[valid++] = blocks[i];
+    }
+
+    if (valid == 0) {
+        output.swap(error);
+        return false;
+    }
+    blocks.resize(valid);
+    keys.resize(valid);
+
+    std::vector<Result> results(blocks.size());
+    std::vector<const std::string*> parts;
+    std::vector<unsigned int> todo;
+
+    // blocks are only copied out if the input holds more than the armor
+    // and surrounding whitespace
+    std::vector<std::string> copies;
+    copies.reserve(blocks.size());
+    unsigned int hits = 0;
+
+    for (unsigned int i = 0; i < blocks.size(); ++i)
+    {
+        if (!keys[i].empty() &&
+            m_cache.lookup(keys[i], results[i].output, results[i].diagnostics)) {
+            results[i].ok = true;
+            ++hits;
+            continue;
+        }
+
+        todo.push_back(i);
+        if (crypt_txt.find_first_not_of(" \t\r\n") == blocks[i].begin &&
+            crypt_txt.find_first_not_of(" \t\r\n", blocks[i].end) == std::string::npos)
+        {
+            parts.push_back(&crypt_txt);
+        }
+        else {
+            copies.push_back(crypt_txt.substr(blocks[i].begin, blocks[i].end - blocks[i].begin));
+            parts.push_back(&copies.back());
+        }
+    }
+
+    if (hits > 0) {
+        MutexLock lock(m_stats_lock);
+        m_stats[op_name(OP_DECRYPT)].cache_hits += hits;
+    }
+
+    // the remaining blocks are decrypted in parallel
+    if (!parts.empty())
+    {
+        std::vector<Result> decrypted;
+        parallel_decrypt(parts, decrypted, prio, false);
+
+        for (unsigned int j = 0; j < todo.size(); ++j)
+        {
+            Result& r = results[todo[j]];
+            r.ok = decrypted[j].ok;
+            r.output.swap(decrypted[j].output);
+            r.diagnostics.swap(decrypted[j].diagnostics);
+
+            // prefetched plaintexts are kept for the explicit decrypt
+            if (prio == JobScheduler::PREFETCH && r.ok && !keys[todo[j]].empty())
+                m_cache.insert(keys[todo[j]], r.output, r.diagnostics);
+        }
+    }
+
+    // without a place for them, the messages follow each plaintext
+    if (!diagnostics) {
+        for (unsigned int i = 0; i < results.size(); ++i) {
+            if (results[i].ok)
+                results[i].output += results[i].diagnostics;
+        }
+    }
+
+    if (results.size() == 1) {
+        output.swap(results[0].output);
+        if (diagnostics)
+            diagnostics->swap(results[0].diagnostics);
+        return results[0].ok;
+    }
+
+    std::string::size_type total = 0;
+    for (unsigned int i = 0; i < results.size(); ++i)
+        total += results[i].output.size() + 1;
+
+    output.clear();
+    output.reserve(total);
+    bool ok = true;
+
+    for (unsigned int i = 0; i < results.size(); ++i)
+    {
+        if (!output.empty() && output[output.size()-1] != '\n')
+            output += '\n';
+        output += results[i].output;
+        if (diagnostics)
+            *diagnostics += results[i].diagnostics;
+        ok = ok && results[i].ok;
+    }
+
+    return ok;
+}
+
+void* CryptoChromeCore::parallel_decrypt_main(void* arg)
+{
+    ParallelDecrypt* pd = static_cast<ParallelDecrypt*>(arg);
+
+    while (true)
+    {
+        unsigned int i;
+        {
+            MutexLock lock(pd->lock);
+            if (pd->next >= pd->inputs->size()) break;
+            i = pd->next++;
+        }
+
+        const std::string& input = *(*pd->inputs)[i];
+        Result& result = (*pd->results)[i];
+
+        if (pd->prio == JobScheduler::PREFETCH && pd->core->stopping()) {
+            result.ok = false;
+            result.output = "Cancelled";
+            continue;
+        }
+
+        if (pd->armored)
+            result.ok = pd->core->decrypt_armored(input, result.output, pd->prio,
+                                                  &result.diagnostics);
+        else
+            result.ok = pd->core->run(OP_DECRYPT, std::string(), input, result.output, pd->prio,
+                                      Compression(), &result.diagnostics);
+    }
+
+    return NULL;
+}
+
+void CryptoChromeCore::parallel_decrypt(const std::vector<const std::string*>& inputs,
+                                        std::vector<Result>& results,
+                                        JobScheduler::Priority prio, bool armored)
+{
+    results.resize(inputs.size());
+
+    ParallelDecrypt pd;
+    pd.core = this;
+    pd.inputs = &inputs;
+    pd.results = &results;
+    pd.prio = prio;
+    pd.armored = armored;
+    pd.next = 0;
+
+    // more threads than admitted runs would only wait in the scheduler
+    unsigned int threads = std::min<unsigned int>(inputs.size(), m_scheduler.limit(prio));
+
+    std::vector<pthread_t> tids;
+    for (unsigned int i = 1; i < threads; ++i)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, &parallel_decrypt_main, &pd) != 0)
+            break;      // the remaining threads take over its share
+        tids.push_back(tid);
+    }
+
+    // the calling thread works as well
+    parallel_decrypt_main(&pd);
+
+    for (unsigned int i = 0; i < tids.size(); ++i)
+        pthread_join(tids[i], NULL);
+}
+
+// Text Processing
+
+// the plaintext is followed by gpg's messages, e.g. the signature status
+std::string CryptoChromeCore::decrypt(const std::string& crypt_txt)
+{
+    std::string output;
+    decrypt_armored(crypt_txt, output);
+    return output;
+}
+
+// the armored results are pasted into messages, so gpg's messages are only
+// returned in place of them on errors
+std::string CryptoChromeCore::encrypt(const std::string& recipient, const std::string& clear_txt,
+                                      const Compression& compression)
+{
+    std::string output, diagnostics;
+    run(OP_ENCRYPT, recipient, clear_txt, output, JobScheduler::INTERACTIVE, compression,
+        &diagnostics);
+    return output;
+}
+
+std::string CryptoChromeCore::clearsign(const std::string& clear_txt)
+{
+    std::string output, diagnostics;
+    run(OP_CLEARSIGN, std::string(), clear_txt, output, JobScheduler::INTERACTIVE,
+        Compression(), &diagnostics);
+    return output;
+}
+
+std::string CryptoChromeCore::encrypt_sign(const std::string& recipient,
+                                           const std::string& clear_txt,
+                                           const Compression& compression)
+{
+    std::string output, diagnostics;
+    run(OP_ENCRYPT_SIGN, recipient, clear_txt, output, JobScheduler::INTERACTIVE, compression,
+        &diagnostics);
+    return output;
+}
+
+void CryptoChromeCore::decrypt_batch(const std::vector<std::string>& blocks,
+                                     std::vector<Result>& results,
+                                     JobScheduler::Priority prio)
+{
+    std::vector<const std::string*> inputs(blocks.size());
+    for (unsigned int i = 0; i < blocks.size(); ++i)
+        inputs[i] = &blocks[i];
+
+    parallel_decrypt(inputs, results, prio, true);
+}
+
+void* CryptoChromeCore::prefetch_main(void* arg)
+{
+    PrefetchJob* job = static_cast<PrefetchJob*>(arg);
+    CryptoChromeCore* core = job->core;
+
+    std::vector<Result> results;
+    core->decrypt_batch(job->blocks, results, JobScheduler::PREFETCH);
+    delete job;
+
+    MutexLock lock(core->m_prefetch_lock);
+    --core->m_prefetch_running;
+    core->m_prefetch_cond.broadcast();
+
+    return NULL;
+}
+
+void CryptoChromeCore::prefetch(const std::vector<std::string>& blocks)
+{
+    if (blocks.empty()) return;
+
+    PrefetchJob* job = new PrefetchJob;
+    job->core = this;
+    job->blocks = blocks;
+
+    MutexLock lock(m_prefetch_lock);
+    if (m_stopping) {
+        delete job;
+        return;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, &prefetch_main, job) == 0)
+        ++m_prefetch_running;
+    else
+        delete job;     // prefetching is only an optimization
+
+    pthread_attr_destroy(&attr);
+}
+
+void CryptoChromeCore::clear_cache()
+{
+    m_cache.clear();
+    m_session_keys.clear();
+}
@@ -0,0 +1,414 @@
+/**********************************************************\
+
+  CryptoChromeCore.h
+
+  Host-independent gpg logic of CryptoChrome. CryptoChromeAPI wraps
+  this class for the browser, the tools in tools/ drive it directly.
+
+\**********************************************************/
+
+#ifndef H_CryptoChromeCore
+#define H_CryptoChromeCore
+
+#include <string>
+#include <map>
+#include <vector>
+
+#include "GpgAgent.h"
+#include "JobScheduler.h"
+#include "ResultCache.h"
+#include "ThreadUtil.h"
+
+namespace stx { class ExecPipe; }
+
+class CryptoChromeCore
+{
+public:
+    /// Operations which run gpg.
+    enum Operation
+    {
+        OP_VERSION,
+        OP_DECRYPT,
+        OP_ENCRYPT,
+        OP_CLEARSIGN,
+        OP_ENCRYPT_SIGN,
+
+        // operations on files, see run_file()
+        OP_ENCRYPT_FILE,
+        OP_DECRYPT_FILE,
+        OP_SIGN_FILE,
+        OP_ENCRYPT_CONTAINER,
+        OP_DECRYPT_CONTAINER
+    };
+
+    static const unsigned int num_operations = OP_DECRYPT_CONTAINER + 1;
+
+    /// Check whether op works on files instead of strings.
+    static bool is_file_op(Operation op);
+
+    /// Return the name of an operation as used in stats() and by the tools.
+    static const char* op_name(Operation op);
+
+    /// Parse an operation name. Returns false if name is unknown.
+    static bool parse_op(const std::string& name, Operation& op);
+
+    /// Compression gpg applies before encrypting. By default gpg compresses
+    /// with its preferred algorithm unless the input looks like compressed
+    /// or encrypted data, which would only cost time.
+    struct Compression
+    {
+        std::string algo;   // passed as --compress-algo, empty for gpg's choice
+        int level;          // passed as -z, -1 for gpg's default
+        bool automatic;     // skip compression for incompressible input
+
+        Compression() : level(-1), automatic(true) {}
+
+        bool operator==(const Compression& c) const
+        {
+            return algo == c.algo && level == c.level && automatic == c.automatic;
+        }
+
+        /// Parse "auto", "none", a level 0-9, an algorithm (zip, zlib,
+        /// bzip2) or "algorithm:level". Returns false on invalid specs.
+        static bool parse(const std::string& spec, Compression& c);
+    };
+
+    CryptoChromeCore();
+    ~CryptoChromeCore();
+
+    // Configuration
+    std::string gpg_version();
+    std::string set_gpg_path(const std::string& path);
+    std::string get_gpg() const;
+
+    /// Named sets of extra gpg options, which are passed after the built-in
+    /// options of the operations they are applied to, e.g. to tune gpg for
+    /// throughput with --trust-model direct or a small dedicated keyring.
+    typedef std::map<std::string, std::vector<std::string> > ProfileMap;
+
+    /// Define or replace the profile name. Only options which neither make
+    /// gpg interactive nor move its output or messages are accepted, as
+    /// "--option value" or "--option=value". Returns false and sets
+    /// message on errors.
+    bool set_profile(const std::string& name, const std::vector<std::string>& options,
+                     std::string& message);
+
+    /// Delete the profile name, the operations using it run without one.
+    bool remove_profile(const std::string& name, std::string& message);
+
+    /// Apply the profile name to op, or none if name is empty. The
+    /// containers use the profiles of encrypt_file and decrypt_file, and
+    /// that of clearsign for their manifest.
+    /// Cached plaintexts and session keys are dropped whenever profiles
+    /// change, as they may have been found with another keyring.
+    bool use_profile(Operation op, const std::string& name, std::string& message);
+
+    /// The profiles and the profile applied to each operation by name.
+    void profiles(ProfileMap& profiles, std::map<std::string, std::string>& operations) const;
+
+    // Text Processing
+    std::string decrypt(const std::string& crypt_txt);
+    std::string encrypt(const std::string& recipient, const std::string& clear_txt,
+                        const Compression& compression = Compression());
+    std::string clearsign(const std::string& clear_txt);
+    std::string encrypt_sign(const std::string& recipient, const std::string& clear_txt,
+                             const Compression& compression = Compression());
+
+    /// Run operation op on input and store gpg's output or the error message
+    /// in output. gpg's messages are stored in diagnostics if it is given,
+    /// otherwise they follow a successful output. The recipient and
+    /// compression are ignored by operations which do not encrypt. Returns
+    /// false if gpg could not be run or failed. Safe to call
+    /// from several threads at once; a call identical to one already in
+    /// flight waits for that gpg process and shares its result instead of
+    /// starting another. gpg is only started once the scheduler admits the
+    /// run in its priority class.
+    bool run(Operation op, const std::string& recipient, const std::string& input,
+             std::string& output,
+             JobScheduler::Priority prio = JobScheduler::INTERACTIVE,
+             const Compression& compression = Compression(),
+             std::string* diagnostics = NULL);
+
+    /// Run a file operation with in_path connected directly to gpg's stdin
+    /// and gpg's stdout writing out_path, so the data is never copied
+    /// through this process. encrypt_file writes a binary OpenPGP message
+    /// for all recipients, decrypt_file its plaintext and sign_file a
+    /// detached binary signature. The output appears under out_path only
+    /// if gpg succeeds. encrypt_container and decrypt_container split the
+    /// file into chunks processed by parallel gpg runs, see
+    /// ChunkedContainer. Returns false and sets message on errors.
+    bool run_file(Operation op, const std::vector<std::string>& recipients,
+                  const std::string& in_path, const std::string& out_path,
+                  std::string& message,
+                  JobScheduler::Priority prio = JobScheduler::INTERACTIVE,
+                  const Compression& compression = Compression());
+
+    /// Check the armor of crypt_txt and decrypt each block it contains, in
+    /// parallel if there are several. Malformed or truncated blocks are
+    /// skipped, input without a valid one is rejected without running gpg.
+    /// Returns false on errors and handles diagnostics like run().
+    bool decrypt_armored(const std::string& crypt_txt, std::string& output,
+                         JobScheduler::Priority prio = JobScheduler::INTERACTIVE,
+                         std::string* diagnostics = NULL);
+
+    /// Outcome of one operation of a batch.
+    struct Result
+    {
+        bool ok;
+        std::string output;
+        std::string diagnostics;    // gpg's messages
+    };
+
+    /// Decrypt several independent blocks, e.g. all messages found on a
+    /// page, with a single call. The blocks are decrypted in parallel, as
+    /// far as the scheduler's limit for prio allows. results[i] belongs to
+    /// blocks[i].
+    void decrypt_batch(const std::vector<std::string>& blocks, std::vector<Result>& results,
+                       JobScheduler::Priority prio = JobScheduler::BULK);
+
+    /// Start decrypting blocks in the background in the prefetch class and
+    /// keep the plaintexts in the result cache, where a later decrypt of
+    /// the same message finds them. Returns at once.
+    void prefetch(const std::vector<std::string>& blocks);
+
+    /// Drop all cached plaintexts and session keys.
+    void clear_cache();
+
+    /// Scheduler deciding which waiting gpg runs may start.
+    JobScheduler& scheduler() { return m_scheduler; }
+
+    /// The gpg-agent session, checked before operations using secret keys.
+    GpgAgent& agent() { return m_agent; }
+
+    /// Aggregated ExecPipe counters of all gpg runs of one operation.
+    struct OpStats
+    {
+        double calls, failures, coalesced, cache_hits, session_key_hits;
+        double queue_time, wall_time, spawn_time, first_byte_time, user_time, sys_time;
+        double bytes_in, bytes_out;
+        double select_calls, read_calls, write_calls;
+        double peak_buffer;
+
+        OpStats();
+    };
+
+    typedef std::map<std::string, OpStats> StatsMap;
+
+    /// Performance counters aggregated per operation since the last reset.
+    StatsMap stats();
+    void reset_stats();
+
+private:
+    friend class ChunkedContainer;
+    friend struct GpgPipe;
+
+    mutable Mutex m_config_lock;
+    std::string m_gpgpath;
+
+    /// gpg's argument vectors of all operations, built once per gpg path.
+    /// Every run holds a reference until its gpg is started, so
+    /// set_gpg_path() can replace them at any time. The encrypting
+    /// operations end with a "--recipient" slot filled in per call.
+    struct ArgTemplates
+    {
+        std::vector<std::string> args[num_operations];
+        unsigned long serial;   // tells copies of different templates apart
+        unsigned int refs;      // guarded by m_config_lock
+    };
+
+    ArgTemplates* m_templates;
+
+    /// Reference to the templates current at construction.
+    class TemplateRef
+    {
+    public:
+        explicit TemplateRef(const CryptoChromeCore& core);
+        ~TemplateRef();
+
+        const std::vector<std::string>& args(Operation op) const { return m_templates->args[op]; }
+        unsigned long serial() const { return m_templates->serial; }
+
+    private:
+        const CryptoChromeCore& m_core;
+        ArgTemplates* m_templates;
+
+        TemplateRef(const TemplateRef&);
+        TemplateRef& operator=(const TemplateRef&);
+    };
+
+    /// Arguments of a gpg run copied from a template. A thread keeps its
+    /// vector between runs, so a run with the same template only patches
+    /// the arguments behind it instead of copying the whole vector.
+    struct ArgVector
+    {
+        std::vector<std::string> args;
+        unsigned long serial;   // of the templates args was copied from, 0 for none
+        Operation op;
+
+        ArgVector() : serial(0), op(OP_VERSION) {}
+
+        /// Make args the template of op, followed by nothing. The recipient
+        /// slot may still hold the last run's value.
+        void copy(const TemplateRef& templates, Operation op);
+    };
+
+    /// Build the templates with the profile options of each operation.
+    static ArgTemplates* build_templates(const std::string& gpg,
+                                         const std::vector<std::string>* options);
+    void release_templates(ArgTemplates* templates) const;
+
+    /// Guards the profiles and serializes rebuilding the templates.
+    mutable Mutex m_profile_lock;
+    ProfileMap m_profiles;
+    std::string m_op_profiles[num_operations];  // empty for none
+
+    /// Replace the templates by ones built from the current gpg path and
+    /// profiles. Called with m_profile_lock held.
+    void update_templates();
+
+    /// Check the options of a profile and return them with each option and
+    /// value as separate arguments.
+    static bool check_options(const std::vector<std::string>& options,
+                              std::vector<std::string>& args, std::string& message);
+
+    /// A gpg run which identical concurrent calls can join.
+    struct Flight
+    {
+        Operation op;
+        const std::string* recipient;
+        const std::string* input;
+        const Compression* compression;
+        JobScheduler::Ticket* ticket;
+
+        bool done, ok;
+        const std::string* output;  // valid until all waiters have left
+        const std::string* diagnostics;
+        unsigned int waiters;
+        CondVar cond;
+    };
+
+    /// runs in flight, keyed by a hash of operation, recipient and input
+    typedef std::multimap<unsigned long long, Flight*> FlightMap;
+
+    Mutex m_flight_lock;
+    FlightMap m_flights;
+
+    Mutex m_stats_lock;
+    StatsMap m_stats;
+
+    JobScheduler m_scheduler;
+
+    GpgAgent m_agent;
+
+    /// plaintexts of prefetched messages
+    ResultCache m_cache;
+
+    /// session keys of decrypted messages by SHA-256 of the ciphertext
+    ResultCache m_session_keys;
+
+    /// detached prefetch threads, waited for on destruction
+    Mutex m_prefetch_lock;
+    CondVar m_prefetch_cond;
+    unsigned int m_prefetch_running;
+    bool m_stopping;
+
+    struct PrefetchJob
+    {
+        CryptoChromeCore* core;
+        std::vector<std::string> blocks;
+    };
+
+    static void* prefetch_main(void* arg);
+    bool stopping();
+
+    /// State shared by the threads of parallel_decrypt().
+    struct ParallelDecrypt
+    {
+        CryptoChromeCore* core;
+        const std::vector<const std::string*>* inputs;
+        std::vector<Result>* results;
+        JobScheduler::Priority prio;
+        bool armored;
+
+        Mutex lock;
+        unsigned int next;
+    };
+
+    /// Decrypt inputs with up to the scheduler's limit of threads. Inputs
+    /// are checked with decrypt_armored() if armored is set, otherwise
+    /// passed to gpg as they are.
+    void parallel_decrypt(const std::vector<const std::string*>& inputs,
+                          std::vector<Result>& results,
+                          JobScheduler::Priority prio, bool armored);
+    static void* parallel_decrypt_main(void* arg);
+
+    static unsigned long long flight_key(Operation op, const std::string& recipient,
+                                         const std::string& input);
+
+    /// Make sure the agent runs before an operation which needs a secret
+    /// key. If it cannot be started, gpg reports the error itself.
+    void ensure_agent(Operation op);
+
+    /// Join an identical run in flight or start one, see run().
+    bool run_shared(Operation op, const std::string& recipient, const std::string& input,
+                    const Compression& compression, std::string& output,
+                    std::string& diagnostics, JobScheduler::Priority prio);
+
+    /// Spawn gpg for one admitted operation, without coalescing. gpg's
+    /// stdout goes to output and its stderr to diagnostics; on failure
+    /// output is the error message.
+    bool execute(Operation op, const std::string& recipient, const std::string& input,
+                 const Compression& compression, std::string& output,
+                 std::string& diagnostics, double queue_time);
+
+    /// Decrypt with the session key cached for input if there is one, so
+    /// gpg skips the public key operation, otherwise capture the key.
+    bool execute_decrypt(const std::string& input, std::string& output,
+                         std::string& diagnostics, double queue_time);
+
+    /// Run gpg to decrypt input with session_key if it is not empty, else
+    /// store the session key gpg used in session_key.
+    bool run_decrypt(const std::string& input, secure_string& session_key, bool reuse,
+                     std::string& output, std::string& diagnostics, double queue_time);
+
+    /// Run a single gpg for a file operation, writing to part_path.
+    bool execute_file(Operation op, const std::vector<std::string>& recipients,
+                      const std::string& in_path, const std::string& part_path,
+                      const Compression& compression, std::string& message,
+                      JobScheduler::Priority prio);
+
+    /// Return the arguments of op: the template itself, or a copy in
+    /// storage with the recipients and compression options filled in.
+    static const std::vector<std::string>& build_args(const TemplateRef& templates, Operation op,
+                                                      const std::string* recipients,
+                                                      unsigned int num_recipients,
+                                                      const Compression& compression,
+                                                      ArgVector& storage);
+
+    static const std::vector<std::string>& build_args(const TemplateRef& templates, Operation op,
+                                                      const std::vector<std::string>& recipients,
+                                                      const Compression& compression,
+                                                      ArgVector& storage)
+    {
+        return build_args(templates, op, recipients.empty() ? NULL : &recipients[0],
+                          recipients.size(), compression, storage);
+    }
+
+    /// Guess from the byte distribution whether data is already compressed
+    /// or encrypted.
+    static bool incompressible(const char* data, unsigned long len);
+
+    /// Check samples spread over the file at fd like incompressible().
+    static bool incompressible_file(int fd);
+
+    /// Resolve automatic compression to gpg options: no compression if the
+    /// input looks incompressible, gpg's default otherwise.
+    static Compression resolve(const Compression& compression, bool incompressible_input);
+
+    /// what, followed by gpg's messages if there are any.
+    static std::string with_messages(const std::string& what, const std::string& messages);
+
+    void record_stats(Operation op, const stx::ExecPipe* ep, double queue_time, bool failed);
+};
+
+#endif // H_CryptoChromeCore
@@ -0,0 +1,509 @@
+/**********************************************************\
+
+  GpgAgent.cpp
+
+\**********************************************************/
+
+#include "stx-execpipe.h"
+#include <algorithm>
+#include <stdexcept>
+
+#include <sstream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "GpgAgent.h"
+
+const double GpgAgent::check_interval = 5.0;
+
+static double timestamp()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/// Feeds a secure_string to a tool without copying it to the heap.
+class SecureStringSource : public stx::PipeSource
+{
+private:
+    const secure_string& m_input;
+    std::string::size_type m_pos;
+
+public:
+    explicit SecureStringSource(const secure_string& input)
+        : m_input(input), m_pos(0)
+    {
+    }
+
+    virtual bool poll()
+    {
+        if (m_pos >= m_input.size()) return false;
+
+        unsigned int len = std::min<std::string::size_type>(m_input.size() - m_pos, 64 * 1024);
+        write(m_input.data() + m_pos, len);
+        m_pos += len;
+        return true;
+    }
+};
+
+/// Undo the percent escaping of Assuan data lines.
+static std::string unescape(const std::string& line)
+{
+    std::string out;
+    for (std::string::size_type i = 0; i < line.size(); ++i)
+    {
+        if (line[i] == '%' && i + 2 < line.size()) {
+            out += static_cast<char>(strtol(line.substr(i + 1, 2).c_str(), NULL, 16));
+            i += 2;
+        }
+        else {
+            out += line[i];
+        }
+    }
+    return out;
+}
+
+GpgAgent::GpgAgent()
+    : m_pid(0), m_restarts(0), m_last_check(0), m_ttl_changed(false),
+      m_interval(0), m_thread_running(false), m_stopping(false)
+{
+}
+
+GpgAgent::~GpgAgent()
+{
+    bool running;
+    {
+        MutexLock lock(m_keepalive_lock);
+        m_stopping = true;
+        running = m_thread_running;
+        m_keepalive_cond.signal();
+    }
+    if (running)
+        pthread_join(m_thread, NULL);
+
+    // passphrases are preset without expiry, so they must not outlive us
+    clear_passphrases();
+
+    std::string message;
+    restore_cache_ttl(message);
+}
+
+void GpgAgent::set_gpg(const std::string& gpg)
+{
+    MutexLock lock(m_lock);
+    m_gpg = gpg;
+
+    std::string::size_type slash = gpg.rfind('/');
+    m_tool_dir = (slash == std::string::npos) ? std::string() : gpg.substr(0, slash + 1);
+    m_last_check = 0;
+}
+
+bool GpgAgent::run_tool(const std::string& program, const char* const* args,
+                        const secure_string& input, std::string& output,
+                        std::string& message) const
+{
+    std::vector<std::string> argv;
+    argv.push_back(program);
+    for (; *args; ++args)
+        argv.push_back(*args);
+
+    SecureStringSource source(input);
+
+    stx::ExecPipe ep;
+    ep.set_input_source(&source);
+    ep.add_execp(&argv);
+    ep.set_output_string(&output);
+
+    try {
+        ep.run();
+    }
+    catch (std::runtime_error &e) {
+        message = e.what();
+        return false;
+    }
+
+    if (!ep.all_return_codes_zero()) {
+        std::ostringstream oss;
+        oss << program << " failed with exit code " << ep.get_return_code(0);
+        message = oss.str();
+        return false;
+    }
+    return true;
+}
+
+bool GpgAgent::command(const secure_string& commands, bool autostart, std::string& data,
+                       std::string& message) const
+{
+    static const char* const no_autostart[] = { "--no-autostart", NULL };
+    static const char* const none[] = { NULL };
+
+    std::string output;
+    if (!run_tool(tool("gpg-connect-agent"), autostart ? none : no_autostart,
+                  commands, output, message))
+        return false;
+
+    // each command is answered by data lines and a final OK or ERR
+    unsigned int replies = 0;
+    std::istringstream iss(output);
+    std::string line;
+    while (std::getline(iss, line))
+    {
+        if (line.compare(0, 2, "D ") == 0) {
+            data += unescape(line.substr(2));
+            data += '\n';
+        }
+        else if (line == "OK" || line.compare(0, 3, "OK ") == 0) {
+            ++replies;
+        }
+        else if (line.compare(0, 4, "ERR ") == 0) {
+            // "ERR code description"
+            std::string::size_type space = line.find(' ', 4);
+            message = "gpg-agent: " + (space == std::string::npos ? line : line.substr(space + 1));
+            return false;
+        }
+    }
+
+    if (replies == 0) {
+        message = "No gpg-agent running";
+        return false;
+    }
+    return true;
+}
+
+bool GpgAgent::check(bool start, std::string& message)
+{
+    static const secure_string getinfo_pid("GETINFO pid\n");
+    static const char* const launch[] = { "--launch", "gpg-agent", NULL };
+
+    std::string data;
+    if (!command(getinfo_pid, false, data, message))
+    {
+        m_last_check = 0;
+        if (!start)
+            return false;
+
+        std::string output;
+        if (!run_tool(tool("gpgconf"), launch, secure_string(), output, message) ||
+            !command(getinfo_pid, false, data, message))
+            return false;
+    }
+
+    long pid = atol(data.c_str());
+    if (pid != m_pid)
+    {
+        // a new agent has an empty cache
+        if (m_pid != 0)
+            ++m_restarts;
+        m_pid = pid;
+
+        if (!m_presets.empty() && !apply_presets(m_presets, message)) {
+            m_pid = 0;
+            return false;
+        }
+    }
+
+    m_last_check = timestamp();
+    message.clear();
+    return true;
+}
+
+bool GpgAgent::ensure(std::string& message)
+{
+    MutexLock lock(m_lock);
+
+    if (m_last_check > 0 && timestamp() - m_last_check < check_interval)
+        return true;
+
+    return check(true, message);
+}
+
+void* GpgAgent::keepalive_main(void* arg)
+{
+    GpgAgent* agent = static_cast<GpgAgent*>(arg);
+
+    agent->m_keepalive_lock.lock();
+    while (!agent->m_stopping)
+    {
+        if (agent->m_interval == 0) {
+            agent->m_keepalive_cond.wait(agent->m_keepalive_lock);
+            continue;
+        }
+
+        // woken early when the interval changes or on shutdown
+        if (agent->m_keepalive_cond.timed_wait(agent->m_keepalive_lock, agent->m_interval))
+            continue;
+
+        agent->m_keepalive_lock.unlock();
+        {
+            MutexLock lock(agent->m_lock);
+            std::string message;
+            agent->check(true, message);
+        }
+        agent->m_keepalive_lock.lock();
+    }
+    agent->m_keepalive_lock.unlock();
+
+    return NULL;
+}
+
+void GpgAgent::set_keepalive(unsigned int interval)
+{
+    MutexLock lock(m_keepalive_lock);
+
+    m_interval = interval;
+    if (interval > 0 && !m_thread_running)
+        m_thread_running = (pthread_create(&m_thread, NULL, keepalive_main, this) == 0);
+
+    m_keepalive_cond.signal();
+}
+
+unsigned int GpgAgent::keepalive() const
+{
+    MutexLock lock(m_keepalive_lock);
+    return m_interval;
+}
+
+/// Split the line of option name in gpgconf's --list-options output:
+/// name:flags:level:description:type:alt-type:argname:default:argdef:value
+static bool option_fields(const std::string& options, const std::string& name,
+                          std::vector<std::string>& fields)
+{
+    std::istringstream iss(options);
+    std::string line;
+    while (std::getline(iss, line))
+    {
+        if (line.compare(0, name.size() + 1, name + ":") != 0)
+            continue;
+
+        std::string::size_type pos = 0, colon;
+        while ((colon = line.find(':', pos)) != std::string::npos) {
+            fields.push_back(line.substr(pos, colon - pos));
+            pos = colon + 1;
+        }
+        fields.push_back(line.substr(pos));
+        return true;
+    }
+    return false;
+}
+
+long GpgAgent::read_option(const std::string& options, const std::string& name) const
+{
+    std::vector<std::string> fields;
+    if (!option_fields(options, name, fields))
+        return -1;
+
+    if (fields.size() > 9 && !fields[9].empty())
+        return atol(fields[9].c_str());
+    if (fields.size() > 7 && !fields[7].empty())
+        return atol(fields[7].c_str());
+    return -1;
+}
+
+GpgAgent::Status GpgAgent::status()
+{
+    static const secure_string getinfo_version("GETINFO version\n");
+    static const char* const list_options[] = { "--list-options", "gpg-agent", NULL };
+
+    MutexLock lock(m_lock);
+
+    Status st;
+    std::string message, data, options;
+
+    st.running = check(false, message);
+    st.pid = st.running ? m_pid : 0;
+    if (st.running && command(getinfo_version, false, data, message))
+        st.version = data.substr(0, data.find('\n'));
+
+    if (run_tool(tool("gpgconf"), list_options, secure_string(), options, message)) {
+        st.default_cache_ttl = read_option(options, "default-cache-ttl");
+        st.max_cache_ttl = read_option(options, "max-cache-ttl");
+    }
+    else {
+        st.default_cache_ttl = st.max_cache_ttl = -1;
+    }
+
+    st.presets = m_presets.size();
+    st.restarts = m_restarts;
+    st.last_check = m_last_check > 0 ? timestamp() - m_last_check : -1;
+    return st;
+}
+
+bool GpgAgent::change_options(const std::string& lines, std::string& message) const
+{
+    static const char* const args[] = {
+        "--runtime", "--change-options", "gpg-agent", NULL
+    };
+
+    std::string output;
+    return run_tool(tool("gpgconf"), args, secure_string(lines.c_str()), output, message);
+}
+
+bool GpgAgent::set_cache_ttl(long default_ttl, long max_ttl, bool persist, std::string& message)
+{
+    static const char* const list_options[] = { "--list-options", "gpg-agent", NULL };
+
+    if (default_ttl < 0 || max_ttl < default_ttl) {
+        message = "Invalid cache TTL, expected 0 <= default <= max";
+        return false;
+    }
+
+    MutexLock lock(m_lock);
+
+    // the entries found before the first change are the ones to restore
+    if (!persist && !m_ttl_changed)
+    {
+        std::string options;
+        std::vector<std::string> default_fields, max_fields;
+        if (!run_tool(tool("gpgconf"), list_options, secure_string(), options, message))
+            return false;
+        if (!option_fields(options, "default-cache-ttl", default_fields) ||
+            !option_fields(options, "max-cache-ttl", max_fields)) {
+            message = "gpgconf does not list the cache TTL of gpg-agent";
+            return false;
+        }
+
+        m_saved_default_ttl = default_fields.size() > 9 ? default_fields[9] : std::string();
+        m_saved_max_ttl = max_fields.size() > 9 ? max_fields[9] : std::string();
+    }
+
+    // name:flags:value, flags 0 sets the value
+    std::ostringstream oss;
+    oss << "default-cache-ttl:0:" << default_ttl << "\n"
+        << "max-cache-ttl:0:" << max_ttl << "\n";
+
+    if (!change_options(oss.str(), message))
+        return false;
+
+    m_ttl_changed = !persist;
+    return true;
+}
+
+bool GpgAgent::restore_cache_ttl(std::string& message)
+{
+    MutexLock lock(m_lock);
+    if (!m_ttl_changed)
+        return true;
+
+    // flags 16 removes an entry which was not set before
+    std::string lines =
+        (m_saved_default_ttl.empty() ? std::string("default-cache-ttl:16:\n")
+                                     : "default-cache-ttl:0:" + m_saved_default_ttl + "\n") +
+        (m_saved_max_ttl.empty() ? std::string("max-cache-ttl:16:\n")
+                                 : "max-cache-ttl:0:" + m_saved_max_ttl + "\n");
+
+    if (!change_options(lines, message))
+        return false;
+
+    m_ttl_changed = false;
+    return true;
+}
+
+bool GpgAgent::keygrips(const std::string& key, std::vector<std::string>& grips,
+                        std::string& message) const
+{
+    const char* const args[] = {
+        "--batch", "--with-colons", "--with-keygrip", "--list-secret-keys", "--",
+        key.c_str(), NULL
+    };
+
+    std::string output;
+    if (!run_tool(m_gpg, args, secure_string(), output, message)) {
+        message = "No secret key for " + key;
+        return false;
+    }
+
+    // grp:::::::::KEYGRIP: follows each key and subkey
+    std::istringstream iss(output);
+    std::string line;
+    while (std::getline(iss, line))
+    {
+        if (line.compare(0, 4, "grp:") != 0)
+            continue;
+
+        std::string::size_type pos = 0;
+        for (unsigned int i = 0; i < 9 && pos != std::string::npos; ++i)
+            pos = line.find(':', pos + 1);
+        if (pos == std::string::npos)
+            continue;
+
+        std::string grip = line.substr(pos + 1, line.find(':', pos + 1) - pos - 1);
+        if (!grip.empty())
+            grips.push_back(grip);
+    }
+
+    if (grips.empty()) {
+        message = "No secret key for " + key;
+        return false;
+    }
+    return true;
+}
+
+bool GpgAgent::apply_presets(const PresetMap& presets, std::string& message) const
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    // PRESET_PASSPHRASE keygrip timeout hexstring, -1 never expires
+    secure_string commands;
+    for (PresetMap::const_iterator i = presets.begin(); i != presets.end(); ++i)
+    {
+        commands += "PRESET_PASSPHRASE ";
+        commands += i->first.c_str();
+        commands += " -1 ";
+        for (secure_string::const_iterator c = i->second.begin(); c != i->second.end(); ++c) {
+            commands += hex[static_cast<unsigned char>(*c) >> 4];
+            commands += hex[static_cast<unsigned char>(*c) & 15];
+        }
+        commands += '\n';
+    }
+
+    std::string data;
+    return command(commands, false, data, message);
+}
+
+bool GpgAgent::preset_passphrase(const std::string& key, const secure_string& passphrase,
+                                 std::string& message)
+{
+    MutexLock lock(m_lock);
+
+    std::vector<std::string> grips;
+    if (!keygrips(key, grips, message) || !check(true, message))
+        return false;
+
+    PresetMap presets;
+    for (unsigned int i = 0; i < grips.size(); ++i)
+        presets[grips[i]] = passphrase;
+
+    if (!apply_presets(presets, message))
+        return false;
+
+    for (PresetMap::const_iterator i = presets.begin(); i != presets.end(); ++i)
+        m_presets[i->first] = i->second;
+
+    return true;
+}
+
+void GpgAgent::clear_passphrases()
+{
+    MutexLock lock(m_lock);
+
+    if (m_presets.empty())
+        return;
+
+    secure_string commands;
+    for (PresetMap::const_iterator i = m_presets.begin(); i != m_presets.end(); ++i)
+    {
+        commands += "CLEAR_PASSPHRASE --mode=normal ";
+        commands += i->first.c_str();
+        commands += '\n';
+    }
+
+    // an agent which is gone has forgotten them anyway
+    std::string data, message;
+    command(commands, false, data, message);
+
+    m_presets.clear();
+}
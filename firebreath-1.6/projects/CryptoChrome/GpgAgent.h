@@ -0,0 +1,148 @@
+/**********************************************************\
+
+  GpgAgent.h
+
+  The gpg-agent session of CryptoChrome. The operations which need a
+  secret key make sure an agent is running before they start gpg, so
+  a missing agent is started once instead of by each gpg run, and an
+  optional keepalive checks it in the background. Passphrases preset
+  for the session stay in the agent's cache and are preset again if
+  the agent was restarted in between.
+
+  The agent is driven by gpg-connect-agent and gpgconf from the
+  directory of the configured gpg. Commands are passed on their stdin,
+  so passphrases never appear in a command line.
+
+\**********************************************************/
+
+#ifndef H_GpgAgent
+#define H_GpgAgent
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SecureMemory.h"
+#include "ThreadUtil.h"
+
+class GpgAgent
+{
+public:
+    GpgAgent();
+
+    /// Stops the keepalive, removes the preset passphrases from the agent
+    /// and restores the cache TTL.
+    ~GpgAgent();
+
+    /// Use the tools next to gpg, the resolved path of the gpg program.
+    void set_gpg(const std::string& gpg);
+
+    /// Make sure an agent is running, starting one if there is none. If
+    /// it is not the agent seen before, the session's passphrases are
+    /// preset again. Returns at once if the agent answered within the
+    /// last few seconds. Returns false and sets message on errors.
+    bool ensure(std::string& message);
+
+    /// Check the agent every interval seconds in the background, 0 to stop.
+    void set_keepalive(unsigned int interval);
+    unsigned int keepalive() const;
+
+    struct Status
+    {
+        bool running;
+        long pid;
+        std::string version;
+        long default_cache_ttl, max_cache_ttl;  // seconds, -1 if unknown
+        unsigned int presets;                   // keys with a preset passphrase
+        unsigned int restarts;                  // agent changes seen
+        double last_check;                      // seconds since the last answer, -1 if none
+    };
+
+    /// Query the agent without starting one.
+    Status status();
+
+    /// Set how long the agent caches passphrases after their last use and
+    /// at most. gpgconf applies them to the running agent by rewriting
+    /// gpg-agent.conf, so unless persist is set the previous entries are
+    /// put back by restore_cache_ttl() or at the end of the session.
+    bool set_cache_ttl(long default_ttl, long max_ttl, bool persist, std::string& message);
+
+    /// Put back the gpg-agent.conf entries replaced by set_cache_ttl().
+    /// Returns true if there is nothing to restore.
+    bool restore_cache_ttl(std::string& message);
+
+    /// Preset the passphrase of all subkeys of key, which may be any name
+    /// gpg accepts, until clear_passphrases() or the end of the session.
+    /// The agent must run with allow-preset-passphrase.
+    bool preset_passphrase(const std::string& key, const secure_string& passphrase,
+                           std::string& message);
+
+    /// Remove the session's passphrases from the agent and forget them.
+    void clear_passphrases();
+
+private:
+    /// seconds for which a successful check is trusted
+    static const double check_interval;
+
+    mutable Mutex m_lock;
+    std::string m_gpg, m_tool_dir;
+
+    long m_pid;                 // agent seen by the last check, 0 if none
+    unsigned int m_restarts;
+    double m_last_check;
+
+    /// preset passphrases by keygrip
+    typedef std::map<std::string, secure_string> PresetMap;
+    PresetMap m_presets;
+
+    /// gpg-agent.conf values of default-cache-ttl and max-cache-ttl before
+    /// the session changed them, empty if unset
+    bool m_ttl_changed;
+    std::string m_saved_default_ttl, m_saved_max_ttl;
+
+    // keepalive thread, started on first use and guarded by m_keepalive_lock
+    mutable Mutex m_keepalive_lock;
+    CondVar m_keepalive_cond;
+    unsigned int m_interval;
+    bool m_thread_running, m_stopping;
+    pthread_t m_thread;
+
+    static void* keepalive_main(void* arg);
+
+    /// Ask the agent for its pid and apply the presets if it changed.
+    /// Called with m_lock held.
+    bool check(bool start, std::string& message);
+
+    /// Send Assuan commands to the agent and return the data lines of the
+    /// replies. Fails with the first ERR line. Called with m_lock held.
+    bool command(const secure_string& commands, bool autostart, std::string& data,
+                 std::string& message) const;
+
+    /// Path of one of gpg's tools.
+    std::string tool(const char* name) const { return m_tool_dir + name; }
+
+    /// Run program with the NULL terminated args, input on stdin, and
+    /// collect its stdout.
+    bool run_tool(const std::string& program, const char* const* args,
+                  const secure_string& input, std::string& output,
+                  std::string& message) const;
+
+    /// Preset passphrases in the agent, called with m_lock held.
+    bool apply_presets(const PresetMap& presets, std::string& message) const;
+
+    /// Keygrips of the secret subkeys of key.
+    bool keygrips(const std::string& key, std::vector<std::string>& grips,
+                  std::string& message) const;
+
+    /// Read the current value of a gpg-agent option with gpgconf.
+    long read_option(const std::string& options, const std::string& name) const;
+
+    /// Change gpg-agent options with gpgconf, one name:flags:value line
+    /// each. Called with m_lock held.
+    bool change_options(const std::string& lines, std::string& message) const;
+
+    GpgAgent(const GpgAgent&);
+    GpgAgent& operator=(const GpgAgent&);
+};
+
+#endif // H_GpgAgent
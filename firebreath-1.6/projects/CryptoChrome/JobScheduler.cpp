@@ -0,0 +1,166 @@
+/**********************************************************\
+
+  JobScheduler.cpp
+
+\**********************************************************/
+
+#include "JobScheduler.h"
+
+#include <algorithm>
+
+#include <unistd.h>
+
+static const char* const s_priority_names[] = {
+    "interactive", "prefetch", "bulk"
+};
+
+const char* JobScheduler::priority_name(Priority prio)
+{
+    return s_priority_names[prio];
+}
+
+bool JobScheduler::parse_priority(const std::string& name, Priority& prio)
+{
+    for (unsigned int i = 0; i < num_priorities; ++i) {
+        if (name == s_priority_names[i]) {
+            prio = static_cast<Priority>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+JobScheduler::JobScheduler(unsigned int slots)
+    : m_slots(slots), m_running_total(0)
+{
+    if (m_slots == 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        m_slots = static_cast<unsigned int>(std::max(4L, std::min(16L, ncpu)));
+    }
+
+    // background classes together leave at least a quarter of the slots
+    // free for interactive requests
+    m_limit[INTERACTIVE] = m_slots;
+    m_limit[PREFETCH] = std::max(1U, m_slots / 4);
+    m_limit[BULK] = std::max(1U, m_slots / 2);
+
+    for (unsigned int i = 0; i < num_priorities; ++i)
+        m_running[i] = 0;
+}
+
+void JobScheduler::set_limit(Priority prio, unsigned int limit)
+{
+    MutexLock lock(m_lock);
+    m_limit[prio] = std::max(1U, std::min(m_slots, limit));
+    m_cond.broadcast();
+}
+
+unsigned int JobScheduler::limit(Priority prio) const
+{
+    MutexLock lock(m_lock);
+    return m_limit[prio];
+}
+
+bool JobScheduler::admissible(const Ticket* ticket) const
+{
+    Priority prio = ticket->m_prio;
+
+    if (m_running_total >= m_slots || m_running[prio] >= m_limit[prio])
+        return false;
+
+    // first come, first served within a class
+    if (m_waiting[prio].front() != ticket)
+        return false;
+
+    // a more urgent class which could run takes the slot
+    for (unsigned int u = 0; u < static_cast<unsigned int>(prio); ++u) {
+        if (!m_waiting[u].empty() && m_running[u] < m_limit[u])
+            return false;
+    }
+
+    return true;
+}
+
+void JobScheduler::promote(Ticket& ticket, Priority prio)
+{
+    MutexLock lock(m_lock);
+
+    if (ticket.m_state != Ticket::WAITING || prio >= ticket.m_prio)
+        return;
+
+    m_waiting[ticket.m_prio].remove(&ticket);
+    ticket.m_prio = prio;
+    m_waiting[prio].push_back(&ticket);
+
+    m_cond.broadcast();
+}
+
+unsigned int JobScheduler::cancel_queued(Priority prio)
+{
+    MutexLock lock(m_lock);
+
+    unsigned int n = m_waiting[prio].size();
+
+    for (std::list<Ticket*>::iterator it = m_waiting[prio].begin();
+         it != m_waiting[prio].end(); ++it)
+        (*it)->m_state = Ticket::CANCELLED;
+
+    m_waiting[prio].clear();
+    m_cond.broadcast();
+
+    return n;
+}
+
+JobScheduler::Ticket::Ticket(JobScheduler& scheduler, Priority prio)
+    : m_scheduler(scheduler), m_prio(prio), m_state(NEW)
+{
+}
+
+JobScheduler::Ticket::~Ticket()
+{
+    JobScheduler& s = m_scheduler;
+    MutexLock lock(s.m_lock);
+
+    if (m_state == WAITING)
+    {
+        s.m_waiting[m_prio].remove(this);
+        s.m_cond.broadcast();
+    }
+    else if (m_state == ADMITTED)
+    {
+        --s.m_running[m_prio];
+        --s.m_running_total;
+        s.m_cond.broadcast();
+    }
+}
+
+bool JobScheduler::Ticket::acquire()
+{
+    JobScheduler& s = m_scheduler;
+    MutexLock lock(s.m_lock);
+
+    if (m_state == NEW) {
+        m_state = WAITING;
+        s.m_waiting[m_prio].push_back(this);
+    }
+
+    while (m_state == WAITING && !s.admissible(this))
+        s.m_cond.wait(s.m_lock);
+
+    if (m_state == CANCELLED)
+        return false;
+
+    if (m_state == WAITING)
+    {
+        s.m_waiting[m_prio].pop_front();
+        m_state = ADMITTED;
+        ++s.m_running[m_prio];
+        ++s.m_running_total;
+
+        // the next ticket of this class may be admissible as well
+        s.m_cond.broadcast();
+    }
+
+    return true;
+}
@@ -0,0 +1,106 @@
+/**********************************************************\
+
+  JobScheduler.h
+
+  Admission control for gpg runs. Each run first takes a Ticket in a
+  priority class and waits until the scheduler admits it. At most
+  slots() runs are admitted at once, each class has its own limit
+  below that, and a waiting ticket is only admitted when no more
+  urgent class could use the free slot. Interactive requests thus
+  overtake queued background work, and background classes never
+  occupy every slot.
+
+  The scheduler does not own threads: callers block in acquire() and
+  then do the work on their own thread.
+
+\**********************************************************/
+
+#ifndef H_JobScheduler
+#define H_JobScheduler
+
+#include <list>
+#include <string>
+
+#include "ThreadUtil.h"
+
+class JobScheduler
+{
+public:
+    /// Priority classes, most urgent first.
+    enum Priority
+    {
+        INTERACTIVE,    // the user waits for the result
+        PREFETCH,       // speculative work the user will probably need
+        BULK            // background work on many items
+    };
+
+    static const unsigned int num_priorities = 3;
+
+    static const char* priority_name(Priority prio);
+    static bool parse_priority(const std::string& name, Priority& prio);
+
+    /// Create a scheduler with the given number of slots, or one based on
+    /// the number of processors if slots is 0.
+    explicit JobScheduler(unsigned int slots = 0);
+
+    unsigned int slots() const { return m_slots; }
+
+    /// Change the number of runs of one class admitted at once.
+    void set_limit(Priority prio, unsigned int limit);
+    unsigned int limit(Priority prio) const;
+
+    /// Admission of one run. Leaving the scope releases the slot or
+    /// withdraws the waiting ticket.
+    class Ticket
+    {
+    public:
+        Ticket(JobScheduler& scheduler, Priority prio);
+        ~Ticket();
+
+        /// Wait until admitted. Returns false if the ticket was cancelled
+        /// while waiting.
+        bool acquire();
+
+        Priority priority() const { return m_prio; }
+
+    private:
+        friend class JobScheduler;
+
+        enum State { NEW, WAITING, ADMITTED, CANCELLED };
+
+        JobScheduler& m_scheduler;
+        Priority m_prio;
+        State m_state;
+
+        Ticket(const Ticket&);
+        Ticket& operator=(const Ticket&);
+    };
+
+    /// Move a waiting ticket to a more urgent class, e.g. when an
+    /// interactive request joins a queued bulk run. No effect on tickets
+    /// which are already admitted or in a more urgent class.
+    void promote(Ticket& ticket, Priority prio);
+
+    /// Cancel all waiting tickets of a class. Returns their number.
+    unsigned int cancel_queued(Priority prio);
+
+private:
+    mutable Mutex m_lock;
+    CondVar m_cond;
+
+    unsigned int m_slots, m_running_total;
+    unsigned int m_limit[num_priorities];
+    unsigned int m_running[num_priorities];
+
+    /// waiting tickets per class in arrival order
+    std::list<Ticket*> m_waiting[num_priorities];
+
+    /// Check whether a waiting ticket can be admitted now. Called with
+    /// m_lock held.
+    bool admissible(const Ticket* ticket) const;
+
+    JobScheduler(const JobScheduler&);
+    JobScheduler& operator=(const JobScheduler&);
+};
+
+#endif // H_JobScheduler
@@ -0,0 +1,58 @@
+/**********************************************************\
+
+  PgpArmor.h
+
+  Fast checks of ASCII armored OpenPGP data (RFC 4880, section 6),
+  done before any input is handed to gpg. Finds BEGIN/END boundaries,
+  decodes the radix-64 body and verifies its CRC24 checksum, so that
+  malformed or truncated input is rejected without spawning a process
+  and concatenated blocks can be processed separately.
+
+\**********************************************************/
+
+#ifndef H_PgpArmor
+#define H_PgpArmor
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+
+class PgpArmor
+{
+public:
+    /// Position of one armored block inside a text.
+    struct Block
+    {
+        /// offset of the BEGIN line
+        std::string::size_type begin;
+
+        /// offset just behind the END line, or npos if the block is truncated
+        std::string::size_type end;
+
+        /// armor type, e.g. "MESSAGE" or "SIGNED MESSAGE"
+        std::string type;
+    };
+
+    /// Find all armored blocks in text. BEGIN and END lines must start a
+    /// line. A clearsigned message ends with its signature's END line.
+    static void split(const std::string& text, std::vector<Block>& blocks);
+
+    /// Check the structure, radix-64 body and checksum of a block found by
+    /// split(). Returns false and sets error if the block is malformed.
+    /// The decoded body is stored in data if given.
+    static bool check(const std::string& text, const Block& block, std::string& error,
+                      std::string* data = NULL);
+
+    /// Decode radix-64 data. Whitespace is skipped. Returns false on invalid
+    /// characters or padding.
+    static bool base64_decode(const char* data, std::string::size_type len, std::string& out);
+
+    /// Update an OpenPGP CRC24 over len bytes. Start with crc24_init.
+    static unsigned long crc24(unsigned long crc, const unsigned char* data,
+                               std::string::size_type len);
+
+    static const unsigned long crc24_init = 0xb704ceUL;
+};
+
+#endif // H_PgpArmor
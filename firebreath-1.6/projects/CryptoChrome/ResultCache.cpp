@@ -0,0 +1,151 @@
+/**********************************************************\
+
+  ResultCache.cpp
+
+\**********************************************************/
+
+#include "ResultCache.h"
+
+#include <sys/time.h>
+
+static double timestamp()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+ResultCache::ResultCache(unsigned int max_entries, unsigned long max_bytes, double ttl)
+    : m_bytes(0), m_max_entries(max_entries), m_max_bytes(max_bytes), m_ttl(ttl)
+{
+}
+
+ResultCache::~ResultCache()
+{
+    clear();
+}
+
+void ResultCache::erase(EntryMap::iterator it)
+{
+    m_bytes -= it->first.size() + it->second.result.size() + it->second.detail.size();
+
+    m_use.erase(it->second.use);
+    m_entries.erase(it);
+}
+
+void ResultCache::insert(const std::string& key, const std::string& result)
+{
+    insert(key, result.data(), result.size());
+}
+
+void ResultCache::insert(const std::string& key, const secure_string& result)
+{
+    insert(key, result.data(), result.size());
+}
+
+void ResultCache::insert(const std::string& key, const std::string& result,
+                         const std::string& detail)
+{
+    insert(key, result.data(), result.size(), detail.data(), detail.size());
+}
+
+void ResultCache::insert(const std::string& key, const char* data, unsigned long len,
+                         const char* detail, unsigned long detail_len)
+{
+    unsigned long bytes = key.size() + len + detail_len;
+    if (bytes > m_max_bytes) return;
+
+    MutexLock lock(m_lock);
+
+    EntryMap::iterator it = m_entries.find(key);
+    if (it != m_entries.end())
+        erase(it);
+
+    while (!m_use.empty() &&
+           (m_entries.size() >= m_max_entries || m_bytes + bytes > m_max_bytes))
+        erase(m_use.front());
+
+    it = m_entries.insert(std::make_pair(key, Entry())).first;
+    it->second.result.assign(data, len);
+    it->second.detail.assign(detail ? detail : "", detail_len);
+    it->second.expires = timestamp() + m_ttl;
+    it->second.use = m_use.insert(m_use.end(), it);
+
+    m_bytes += bytes;
+}
+
+ResultCache::EntryMap::iterator ResultCache::find(const std::string& key)
+{
+    EntryMap::iterator it = m_entries.find(key);
+    if (it == m_entries.end())
+        return it;
+
+    if (it->second.expires < timestamp()) {
+        erase(it);
+        return m_entries.end();
+    }
+
+    // move to the most recently used end
+    m_use.splice(m_use.end(), m_use, it->second.use);
+    return it;
+}
+
+bool ResultCache::lookup(const std::string& key, std::string& result)
+{
+    MutexLock lock(m_lock);
+
+    EntryMap::iterator it = find(key);
+    if (it == m_entries.end())
+        return false;
+
+    result.assign(it->second.result.data(), it->second.result.size());
+    return true;
+}
+
+bool ResultCache::lookup(const std::string& key, std::string& result, std::string& detail)
+{
+    MutexLock lock(m_lock);
+
+    EntryMap::iterator it = find(key);
+    if (it == m_entries.end())
+        return false;
+
+    result.assign(it->second.result.data(), it->second.result.size());
+    detail.assign(it->second.detail.data(), it->second.detail.size());
+    return true;
+}
+
+bool ResultCache::lookup(const std::string& key, secure_string& result)
+{
+    MutexLock lock(m_lock);
+
+    EntryMap::iterator it = find(key);
+    if (it == m_entries.end())
+        return false;
+
+    result = it->second.result;
+    return true;
+}
+
+void ResultCache::erase(const std::string& key)
+{
+    MutexLock lock(m_lock);
+
+    EntryMap::iterator it = m_entries.find(key);
+    if (it != m_entries.end())
+        erase(it);
+}
+
+void ResultCache::clear()
+{
+    MutexLock lock(m_lock);
+
+    while (!m_use.empty())
+        erase(m_use.front());
+}
+
+unsigned int ResultCache::size() const
+{
+    MutexLock lock(m_lock);
+    return m_entries.size();
+}
@@ -0,0 +1,89 @@
+/**********************************************************\
+
+  ResultCache.h
+
+  Bounded cache of secrets by message: decrypted plaintexts, filled by
+  prefetching so that an explicit decrypt of the same message returns
+  without running gpg, and the session keys of decrypted messages.
+  Entries expire after a fixed time and the least recently used ones
+  are dropped when the size limits are reached. Results are kept in
+  secure memory, which is wiped when they leave the cache.
+
+\**********************************************************/
+
+#ifndef H_ResultCache
+#define H_ResultCache
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "SecureMemory.h"
+#include "ThreadUtil.h"
+
+class ResultCache
+{
+public:
+    /// Create a cache holding at most max_entries results with a total of
+    /// max_bytes, each for at most ttl seconds.
+    ResultCache(unsigned int max_entries = 256, unsigned long max_bytes = 16 << 20,
+                double ttl = 600);
+    ~ResultCache();
+
+    /// Store the result for key, replacing an older one. detail is kept
+    /// along with it, e.g. gpg's messages about a plaintext.
+    void insert(const std::string& key, const std::string& result);
+    void insert(const std::string& key, const secure_string& result);
+    void insert(const std::string& key, const std::string& result, const std::string& detail);
+
+    /// Copy the result for key to result. Returns false if there is none.
+    bool lookup(const std::string& key, std::string& result);
+    bool lookup(const std::string& key, secure_string& result);
+    bool lookup(const std::string& key, std::string& result, std::string& detail);
+
+    /// Drop the entry for key, if any.
+    void erase(const std::string& key);
+
+    /// Drop and wipe all entries.
+    void clear();
+
+    unsigned int size() const;
+
+private:
+    struct Entry;
+
+    typedef std::map<std::string, Entry> EntryMap;
+
+    /// map entries in order of use, least recent first
+    typedef std::list<EntryMap::iterator> UseList;
+
+    struct Entry
+    {
+        secure_string result, detail;
+        double expires;
+        UseList::iterator use;
+    };
+
+    mutable Mutex m_lock;
+    EntryMap m_entries;
+    UseList m_use;
+    unsigned long m_bytes;
+
+    unsigned int m_max_entries;
+    unsigned long m_max_bytes;
+    double m_ttl;
+
+    /// Remove one entry. Called with m_lock held.
+    void erase(EntryMap::iterator it);
+
+    void insert(const std::string& key, const char* data, unsigned long len,
+                const char* detail = NULL, unsigned long detail_len = 0);
+
+    /// Find the live entry for key and mark it used. Called with m_lock held.
+    EntryMap::iterator find(const std::string& key);
+
+    ResultCache(const ResultCache&);
+    ResultCache& operator=(const ResultCache&);
+};
+
+#endif // H_ResultCache
@@ -0,0 +1,152 @@
+/**********************************************************\
+
+  SecureMemory.cpp
+
+\**********************************************************/
+
+#include "SecureMemory.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+void secure_wipe(void* p, size_t len)
+{
+#if defined(__GNUC__)
+    memset(p, 0, len);
+    // the memory counts as read afterwards, so the memset stays
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+#else
+    volatile char* v = static_cast<volatile char*>(p);
+    while (len--) *v++ = 0;
+#endif
+}
+
+SecureArena& SecureArena::instance()
+{
+    // never destroyed: blocks may still be released by static destructors
+    static SecureArena* arena = new SecureArena;
+    return *arena;
+}
+
+SecureArena::SecureArena()
+    : m_slab(NULL), m_slab_left(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+unsigned int SecureArena::size_class(size_t len)
+{
+    unsigned int k = min_shift;
+    while ((size_t(1) << k) < len)
+        ++k;
+    return k;
+}
+
+void* SecureArena::map(size_t len)
+{
+    void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    // without the privilege, mlock() is limited by RLIMIT_MEMLOCK; the
+    // memory is still usable and kept out of core dumps
+    if (mlock(p, len) != 0)
+        ++m_stats.lock_failures;
+#ifdef MADV_DONTDUMP
+    madvise(p, len, MADV_DONTDUMP);
+#endif
+
+    m_stats.mapped += len;
+    return p;
+}
+
+void* SecureArena::allocate(size_t len)
+{
+    unsigned int k = size_class(len);
+    size_t size = size_t(1) << k;
+
+    if (k >= num_classes - 1)
+        throw std::bad_alloc();
+
+    MutexLock lock(m_lock);
+    void* p;
+
+    if (!m_free[k].empty())
+    {
+        p = m_free[k].back();
+        m_free[k].pop_back();
+        if (k > slab_shift)
+            m_stats.pooled -= size;
+    }
+    else if (k <= slab_shift)
+    {
+        if (m_slab_left < size)
+        {
+            // hand the rest of the slab to the free lists before starting
+            // a new one; all block sizes divide the slab size
+            for (unsigned int j = slab_shift; j >= min_shift; --j) {
+                while (m_slab_left >= (size_t(1) << j)) {
+                    m_free[j].push_back(m_slab);
+                    m_slab += size_t(1) << j;
+                    m_slab_left -= size_t(1) << j;
+                }
+            }
+
+            m_slab = static_cast<char*>(map(slab_size));
+            if (!m_slab) {
+                m_slab_left = 0;
+                throw std::bad_alloc();
+            }
+            m_slab_left = slab_size;
+        }
+
+        p = m_slab;
+        m_slab += size;
+        m_slab_left -= size;
+    }
+    else
+    {
+        p = map(size);
+        if (!p)
+            throw std::bad_alloc();
+    }
+
+    m_stats.in_use += size;
+    return p;
+}
+
+void SecureArena::deallocate(void* p, size_t len)
+{
+    if (!p) return;
+
+    secure_wipe(p, len);
+
+    unsigned int k = size_class(len);
+    size_t size = size_t(1) << k;
+
+    MutexLock lock(m_lock);
+    m_stats.in_use -= size;
+
+    if (k > slab_shift)
+    {
+        if (m_stats.pooled + size > max_pooled) {
+            munlock(p, size);
+            munmap(p, size);
+            m_stats.mapped -= size;
+            return;
+        }
+        m_stats.pooled += size;
+    }
+
+    m_free[k].push_back(p);
+}
+
+SecureArena::Stats SecureArena::stats()
+{
+    MutexLock lock(m_lock);
+    return m_stats;
+}
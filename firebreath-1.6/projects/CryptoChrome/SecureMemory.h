@@ -0,0 +1,131 @@
+/**********************************************************\
+
+  SecureMemory.h
+
+  Memory for plaintexts. Blocks come from a process-wide arena of
+  mappings which are locked into RAM (so they are never swapped out)
+  and excluded from core dumps. Every block is wiped when it is given
+  back, and then kept in a free list by size class, so steady traffic
+  allocates without mmap() or mlock() calls.
+
+  secure_string is a std::basic_string in this memory. Its growth
+  copies are wiped like any released block, unlike the stale copies a
+  std::string leaves on the heap.
+
+\**********************************************************/
+
+#ifndef H_SecureMemory
+#define H_SecureMemory
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+
+#include "ThreadUtil.h"
+
+/// Overwrite len bytes at p in a way the compiler cannot drop.
+void secure_wipe(void* p, size_t len);
+
+class SecureArena
+{
+public:
+    /// The arena shared by all secure allocations of the process.
+    static SecureArena& instance();
+
+    /// Return a block of at least len bytes. Throws std::bad_alloc.
+    void* allocate(size_t len);
+
+    /// Wipe the first len bytes of a block from allocate(len) and return it
+    /// to the pool.
+    void deallocate(void* p, size_t len);
+
+    struct Stats
+    {
+        size_t mapped;          // bytes mapped by the arena
+        size_t in_use;          // bytes of the blocks handed out
+        size_t pooled;          // bytes of large blocks waiting for reuse
+        size_t lock_failures;   // mappings mlock() refused, e.g. by RLIMIT_MEMLOCK
+    };
+
+    Stats stats();
+
+private:
+    /// smallest block and the largest one cut from shared slabs
+    static const unsigned int min_shift = 6, slab_shift = 16;
+
+    /// slabs are mapped in these units
+    static const size_t slab_size = 1 << 20;
+
+    /// larger blocks have their own mapping; at most this many bytes of
+    /// them are kept for reuse
+    static const size_t max_pooled = 64 << 20;
+
+    static const unsigned int num_classes = sizeof(size_t) * 8;
+
+    Mutex m_lock;
+    std::vector<void*> m_free[num_classes];
+
+    char* m_slab;           // unused rest of the current slab
+    size_t m_slab_left;
+
+    Stats m_stats;
+
+    SecureArena();
+
+    /// Map, lock and mark len bytes as not dumpable. Returns NULL on errors.
+    void* map(size_t len);
+
+    static unsigned int size_class(size_t len);
+
+    SecureArena(const SecureArena&);
+    SecureArena& operator=(const SecureArena&);
+};
+
+/// Standard allocator drawing from the SecureArena.
+template <typename T>
+class secure_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U> struct rebind { typedef secure_allocator<U> other; };
+
+    secure_allocator() {}
+    template <typename U> secure_allocator(const secure_allocator<U>&) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void* = 0)
+    {
+        return static_cast<pointer>(SecureArena::instance().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        SecureArena::instance().deallocate(p, n * sizeof(T));
+    }
+
+    size_type max_size() const { return size_type(-1) / sizeof(T); }
+
+    void construct(pointer p, const T& value) { new (p) T(value); }
+    void destroy(pointer p) { p->~T(); }
+};
+
+template <typename T, typename U>
+inline bool operator==(const secure_allocator<T>&, const secure_allocator<U>&) { return true; }
+
+template <typename T, typename U>
+inline bool operator!=(const secure_allocator<T>&, const secure_allocator<U>&) { return false; }
+
+typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > secure_string;
+
+#endif // H_SecureMemory
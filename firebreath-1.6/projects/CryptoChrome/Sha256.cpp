@@ -0,0 +1,154 @@
+/**********************************************************\
+
+  Sha256.cpp
+
+\**********************************************************/
+
+#include "Sha256.h"
+
+#include <string.h>
+
+namespace {
+
+const unsigned int k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline unsigned int rotr(unsigned int x, unsigned int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+} // namespace
+
+Sha256::Sha256()
+{
+    reset();
+}
+
+void Sha256::reset()
+{
+    static const unsigned int init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(m_state, init, sizeof(m_state));
+    m_length = 0;
+    m_used = 0;
+}
+
+void Sha256::transform(const unsigned char* block)
+{
+    unsigned int w[64];
+
+    for (unsigned int i = 0; i < 16; ++i)
+        w[i] = (block[4*i] << 24) | (block[4*i+1] << 16) | (block[4*i+2] << 8) | block[4*i+3];
+
+    for (unsigned int i = 16; i < 64; ++i)
+    {
+        unsigned int s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        unsigned int s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    unsigned int a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    unsigned int e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+    for (unsigned int i = 0; i < 64; ++i)
+    {
+        unsigned int S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        unsigned int ch = (e & f) ^ (~e & g);
+        unsigned int t1 = h + S1 + ch + k[i] + w[i];
+        unsigned int S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        unsigned int maj = (a & b) ^ (a & c) ^ (b & c);
+        unsigned int t2 = S0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+void Sha256::update(const void* data, unsigned long len)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    m_length += len;
+
+    if (m_used > 0)
+    {
+        unsigned int n = 64 - m_used;
+        if (n > len) n = len;
+
+        memcpy(m_block + m_used, p, n);
+        m_used += n;
+        p += n;
+        len -= n;
+
+        if (m_used < 64) return;
+
+        transform(m_block);
+        m_used = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+        transform(p);
+
+    memcpy(m_block, p, len);
+    m_used = len;
+}
+
+std::string Sha256::digest()
+{
+    unsigned long long bits = m_length * 8;
+
+    unsigned char pad[72];
+    unsigned int padlen = (m_used < 56) ? 56 - m_used : 120 - m_used;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (unsigned int i = 0; i < 8; ++i)
+        pad[padlen + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+
+    update(pad, padlen + 8);
+
+    std::string out(32, '\0');
+    for (unsigned int i = 0; i < 8; ++i)
+    {
+        out[4*i] = static_cast<char>(m_state[i] >> 24);
+        out[4*i+1] = static_cast<char>(m_state[i] >> 16);
+        out[4*i+2] = static_cast<char>(m_state[i] >> 8);
+        out[4*i+3] = static_cast<char>(m_state[i]);
+    }
+    return out;
+}
+
+std::string Sha256::to_hex(const std::string& digest)
+{
+    static const char* hexdigits = "0123456789abcdef";
+
+    std::string out;
+    for (std::string::size_type i = 0; i < digest.size(); ++i)
+    {
+        unsigned char c = digest[i];
+        out += hexdigits[c >> 4];
+        out += hexdigits[c & 15];
+    }
+    return out;
+}
+
+std::string Sha256::hex(const std::string& data)
+{
+    Sha256 h;
+    h.update(data.data(), data.size());
+    return to_hex(h.digest());
+}
@@ -0,0 +1,44 @@
+/**********************************************************\
+
+  Sha256.h
+
+  SHA-256 (FIPS 180-4), used to bind the chunks of a container to its
+  signed manifest.
+
+\**********************************************************/
+
+#ifndef H_Sha256
+#define H_Sha256
+
+#include <string>
+
+class Sha256
+{
+public:
+    Sha256();
+
+    /// Add len bytes to the hashed message.
+    void update(const void* data, unsigned long len);
+
+    /// Finish the hash and return the 32-byte digest. The object must be
+    /// reset() before it can be used again.
+    std::string digest();
+
+    void reset();
+
+    /// Return the hex digest of data.
+    static std::string hex(const std::string& data);
+
+    /// Format a binary digest as lower-case hex.
+    static std::string to_hex(const std::string& digest);
+
+private:
+    unsigned int m_state[8];
+    unsigned long long m_length;    // bytes hashed so far
+    unsigned char m_block[64];
+    unsigned int m_used;            // bytes in m_block
+
+    void transform(const unsigned char* block);
+};
+
+#endif // H_Sha256
@@ -0,0 +1,130 @@
+/**********************************************************\
+
+  ThreadUtil.h
+
+  Minimal pthread wrappers used by the host-independent parts of
+  CryptoChrome, which are built both into the plugin and into the
+  standalone tools.
+
+\**********************************************************/
+
+#ifndef H_ThreadUtil
+#define H_ThreadUtil
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/// Non-recursive mutex.
+class Mutex
+{
+public:
+    Mutex() { pthread_mutex_init(&m_mutex, NULL); }
+    ~Mutex() { pthread_mutex_destroy(&m_mutex); }
+
+    void lock() { pthread_mutex_lock(&m_mutex); }
+    void unlock() { pthread_mutex_unlock(&m_mutex); }
+
+private:
+    pthread_mutex_t m_mutex;
+
+    friend class CondVar;
+
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+};
+
+/// Holds a Mutex for the lifetime of the object.
+class MutexLock
+{
+public:
+    explicit MutexLock(Mutex& mutex) : m_mutex(mutex) { m_mutex.lock(); }
+    ~MutexLock() { m_mutex.unlock(); }
+
+private:
+    Mutex& m_mutex;
+
+    MutexLock(const MutexLock&);
+    MutexLock& operator=(const MutexLock&);
+};
+
+/// Condition variable bound to a Mutex on each wait().
+class CondVar
+{
+public:
+    CondVar() { pthread_cond_init(&m_cond, NULL); }
+    ~CondVar() { pthread_cond_destroy(&m_cond); }
+
+    void wait(Mutex& mutex) { pthread_cond_wait(&m_cond, &mutex.m_mutex); }
+
+    /// Wait at most seconds. Returns false on timeout.
+    bool timed_wait(Mutex& mutex, double seconds)
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+
+        double end = now.tv_sec + now.tv_usec * 1e-6 + seconds;
+        struct timespec ts;
+        ts.tv_sec = static_cast<time_t>(end);
+        ts.tv_nsec = static_cast<long>((end - ts.tv_sec) * 1e9);
+
+        return pthread_cond_timedwait(&m_cond, &mutex.m_mutex, &ts) != ETIMEDOUT;
+    }
+
+    void signal() { pthread_cond_signal(&m_cond); }
+    void broadcast() { pthread_cond_broadcast(&m_cond); }
+
+private:
+    pthread_cond_t m_cond;
+
+    CondVar(const CondVar&);
+    CondVar& operator=(const CondVar&);
+};
+
+/// Counter which several threads may change at once.
+class AtomicCounter
+{
+public:
+    explicit AtomicCounter(long value = 0) : m_value(value) {}
+
+    /// Add n and return the previous value.
+    long fetch_add(long n) { return __sync_fetch_and_add(&m_value, n); }
+
+    long value() { return __sync_fetch_and_add(&m_value, 0); }
+
+private:
+    long m_value;
+
+    AtomicCounter(const AtomicCounter&);
+    AtomicCounter& operator=(const AtomicCounter&);
+};
+
+/// One T for each thread, constructed by the thread's first get() and
+/// deleted when the thread exits.
+template <typename T>
+class ThreadLocal
+{
+public:
+    ThreadLocal() { pthread_key_create(&m_key, destroy); }
+    ~ThreadLocal() { pthread_key_delete(m_key); }
+
+    T& get()
+    {
+        T* p = static_cast<T*>(pthread_getspecific(m_key));
+        if (!p) {
+            p = new T;
+            pthread_setspecific(m_key, p);
+        }
+        return *p;
+    }
+
+private:
+    pthread_key_t m_key;
+
+    static void destroy(void* p) { delete static_cast<T*>(p); }
+
+    ThreadLocal(const ThreadLocal&);
+    ThreadLocal& operator=(const ThreadLocal&);
+};
+
+#endif // H_ThreadUtil
@@ -26,6 +26,7 @@
 #endif
 
 #include "stx-execpipe.h"
+#include "stx-ringbuffer.h"
 
 #include <stdexcept>
 #include <sstream>
@@ -37,19 +38,47 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <algorithm>
+
+/// Where the system has no O_CLOEXEC, pipes are marked close-on-exec after
+/// creating them, and files are only closed by the forked stages.
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/// Highest debug level compiled into the library. Log statements above this
+/// level are removed by the compiler regardless of set_debug_level(), so the
+/// select() loop pays nothing for them. Release builds keep only errors.
+#ifndef STX_EXECPIPE_MAX_DEBUG_LEVEL
+#ifdef NDEBUG
+#define STX_EXECPIPE_MAX_DEBUG_LEVEL 0
+#else
+#define STX_EXECPIPE_MAX_DEBUG_LEVEL 3
+#endif
+#endif
 
+/// True if messages of the given level are compiled in and currently enabled.
+#define LOG_ENABLED(level)                               \
+    ((level) <= STX_EXECPIPE_MAX_DEBUG_LEVEL && m_debug_level >= (level))
+
+/// The message is only formatted after the level check passed.
 #define LOG_OUTPUT(msg, level)                           \
     do {                                                 \
-        if (m_debug_level >= level) {                    \
+        if (LOG_ENABLED(level)) {                        \
             std::ostringstream oss;                      \
             oss << msg;                                  \
-            if (m_debug_output)                          \
-                m_debug_output(oss.str().c_str());       \
-            else                                         \
-                std::cout << oss.str() << std::endl;     \
+            debug_line(oss.str());                       \
         }                                                \
     } while (0)
 
@@ -60,194 +89,56 @@
 
 namespace stx {
 
-#ifndef _STX_RINGBUFFER_H_
-#define _STX_RINGBUFFER_H_
-
-/// namespace containing RingBuffer utility class
-namespace {
+/// Serializes the debug output of all pipes and their worker threads, and
+/// guards changes of the output function.
+static pthread_mutex_t g_debug_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/**
- * RingBuffer is a byte-oriented, pipe memory buffer which uses the underlying
- * space in a circular fashion.
- * 
- * The input stream is write()en into the buffer as blocks of bytes, while the
- * buffer is reallocated with exponential growth as needed.
- *
- * The first unread byte can be accessed using bottom(). The number of unread
- * bytes at the ring buffers bottom position is queried by bottomsize(). This
- * may not match the total number of unread bytes as returned by size(). After
- * processing the bytes at bottom(), the unread cursor may be moved using
- * advance().
- *
- * The ring buffer has the following two states.
- * <pre>
- * +------------------------------------------------------------------+
- * | unused     |                 data   |               unused       |
- * +------------+------------------------+----------------------------+
- *              ^                        ^
- *              m_bottom                 m_bottom+m_size
- * </pre>
- *
- * or 
- *
- * <pre>
- * +------------------------------------------------------------------+
- * | more data  |                 unused               | data         |
- * +------------+--------------------------------------+--------------+
- *              ^                                      ^
- *              m_bottom+m_size                        m_bottom
- * </pre>
- *
- * The size of the whole buffer is m_buffsize.
- */
-class RingBuffer
+/// Create a pipe with both ends close-on-exec. A stage gets its ends by
+/// dup2(), which clears the flag, while the children of pipes run
+/// concurrently by other threads must not inherit them: a stage waiting for
+/// eof on its stdin would wait for them to exit. pipe2() sets the flag
+/// atomically, before any other thread can fork().
+static int cloexec_pipe(int pipefd[2])
 {
-private:
-    /// pointer to allocated memory buffer
-    char*		m_data;
-
-    /// number of bytes allocated in m_data
-    unsigned int	m_buffsize;
-
-    /// number of unread bytes in ring buffer
-    unsigned int	m_size;
-
-    /// bottom pointer of unread area
-    unsigned int 	m_bottom;
-
-public:
-    /// Construct an empty ring buffer.
-    inline RingBuffer()
-	: m_data(NULL),
-	  m_buffsize(0), m_size(0), m_bottom(0)
-    {
-    }
-
-    /// Free the possibly used memory space.
-    inline ~RingBuffer()
-    {
-	if (m_data) free(m_data);
-    }
-    
-    /// Return the current number of unread bytes.
-    inline unsigned int size() const
-    {
-	return m_size;
-    }
-
-    /// Return the current number of allocated bytes.
-    inline unsigned int buffsize() const
-    {
-	return m_buffsize;
-    }
-
-    /// Reset the ring buffer to empty.
-    inline void clear()
-    {
-	m_size = m_bottom = 0;
-    }
-
-    /**
-     * Return a pointer to the first unread element. Be warned that the buffer
-     * may not be linear, thus bottom()+size() might not be valid. You have to
-     * use bottomsize().
-     */
-    inline char* bottom() const
-    {
-	return m_data + m_bottom;
-    }
-
-    /// Return the number of bytes available at the bottom() place.
-    inline unsigned int bottomsize() const
-    {
-	return (m_bottom + m_size > m_buffsize)
-	    ? (m_buffsize - m_bottom)
-	    : (m_size);
-    }
-
-    /**
-     * Advance the internal read pointer n bytes, thus marking that amount of
-     * data as read.
-     */
-    inline void advance(unsigned int n)
+#if defined(__linux__) && O_CLOEXEC
+    return pipe2(pipefd, O_CLOEXEC);
+#else
+    if (pipe(pipefd) != 0)
+	return -1;
+
+    if (fcntl(pipefd[0], F_SETFD, FD_CLOEXEC) != 0 ||
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC) != 0)
     {
-	assert(m_size >= n);
-	m_bottom += n;
-	m_size -= n;
-	if (m_bottom >= m_buffsize) m_bottom -= m_buffsize;
+	int err = errno;
+	close(pipefd[0]);
+	close(pipefd[1]);
+	errno = err;
+	return -1;
     }
+    return 0;
+#endif
+}
 
-    /**
-     * Write len bytes into the ring buffer at the top position, the buffer
-     * will grow if necessary.
-     */
-    void write(const void *src, unsigned int len)
+/// Move fd above the standard descriptors 0 to 2, keeping it close-on-exec,
+/// and close the original. Returns the new descriptor or -1 with errno set.
+static int cloexec_above_stdio(int fd)
+{
+#ifdef F_DUPFD_CLOEXEC
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+#else
+    int moved = fcntl(fd, F_DUPFD, STDERR_FILENO + 1);
+    if (moved >= 0 && fcntl(moved, F_SETFD, FD_CLOEXEC) != 0)
     {
-	if (len == 0) return;
-
-	if (m_buffsize < m_size + len)
-	{
-	    // won't fit, we have to grow the buffer, we'll grow the buffer to
-	    // twice the size.
-
-	    unsigned int newbuffsize = m_buffsize;
-	    while (newbuffsize < m_size + len)
-	    {
-		if (newbuffsize == 0) newbuffsize = 1024;
-		else newbuffsize = newbuffsize * 2;
-	    }
-
-	    m_data = static_cast<char*>(realloc(m_data, newbuffsize));
-
-	    if (m_bottom + m_size > m_buffsize)
-	    {
-		// copy the ringbuffer's tail to the new buffer end, use memcpy
-		// here because there cannot be any overlapping area.
-
-		unsigned int taillen = m_buffsize - m_bottom;
-
-		memcpy(m_data + newbuffsize - taillen,
-		       m_data + m_bottom, taillen);
-
-		m_bottom = newbuffsize - taillen;
-	    }
-
-	    m_buffsize = newbuffsize;
-	}
-
-	// block now fits into the buffer somehow
-
-	// check if the new memory fits into the middle space
-	if (m_bottom + m_size > m_buffsize)
-	{
-	    memcpy(m_data + m_bottom + m_size - m_buffsize, src, len);
-	    m_size += len;
-	}
-	else 
-	{
-	    // first fill up the buffer's tail, which has tailfit bytes room
-	    unsigned int tailfit = m_buffsize - (m_bottom + m_size);
-
-	    if (tailfit >= len)
-	    {
-		memcpy(m_data + m_bottom + m_size, src, len);
-		m_size += len;
-	    }
-	    else
-	    {
-		// doesn't fit into the tail alone, we have to break it up
-		memcpy(m_data + m_bottom + m_size, src, tailfit);
-		memcpy(m_data, reinterpret_cast<const char*>(src) + tailfit,
-		       len - tailfit);
-		m_size += len;
-	    }
-	}
+	int err = errno;
+	close(moved);
+	errno = err;
+	moved = -1;
     }
-};
-
-} // namespace <anonymous>
-
-#endif // _STX_RINGBUFFER_H_
+#endif
+    if (moved >= 0)
+	close(fd);
+    return moved;
+}
 
 /**
  * \brief Main library implementation (internal object)
@@ -259,7 +150,8 @@ class ExecPipeImpl
 {
 private:
 
-    /// reference counter
+    /// reference counter, changed atomically as copies of the ExecPipe may
+    /// be released by different threads.
     unsigned int	m_refs;
 
 private:
@@ -269,9 +161,23 @@ private:
     /// currently set debug level
     enum ExecPipe::DebugLevel	m_debug_level;
 
-    /// current debug line output function
+    /// current debug line output function, guarded by g_debug_lock
     void		(*m_debug_output)(const char* line);
 
+    /// Pass one debug line to the output function or stdout. Not used by
+    /// forked children, see child_error().
+    void debug_line(const std::string& line)
+    {
+	pthread_mutex_lock(&g_debug_lock);
+
+	if (m_debug_output)
+	    m_debug_output(line.c_str());
+	else
+	    std::cout << line << std::endl;
+
+	pthread_mutex_unlock(&g_debug_lock);
+    }
+
 public:
 
     /// Change the current debug level. The default is DL_ERROR.
@@ -281,10 +187,13 @@ public:
     }
 
     /// Change output function for debug messages. If set to NULL (the default)
-    /// the debug lines are printed to stdout.
+    /// the debug lines are printed to stdout. Lines already being written by
+    /// another thread still go to the previous function.
     void set_debug_output(void (*output)(const char *line))
     {
+	pthread_mutex_lock(&g_debug_lock);
 	m_debug_output = output;
+	pthread_mutex_unlock(&g_debug_lock);
     }
 
 private:
@@ -296,7 +205,8 @@ private:
 	ST_FD,		///< redirection to existing fd
 	ST_FILE,	///< redirection to file path
 	ST_STRING,	///< input/output directed by/to string
-	ST_OBJECT	///< input/output attached to program object
+	ST_OBJECT,	///< input/output attached to program object
+	ST_MAPPED	///< input written from a mapped file range
     };
 
     /// describes the currently set input stream type
@@ -324,6 +234,30 @@ private:
     /// for ST_OBJECT the input stream ring buffer
     RingBuffer		m_input_rbuffer;
 
+    /// for ST_MAPPED the input file, the position of the next byte to write
+    /// and the end of the range.
+    int			m_input_map_fd;
+    off_t		m_input_map_pos, m_input_map_end;
+
+    /// for ST_MAPPED the start of the range still to be dropped from the
+    /// page cache.
+    off_t		m_input_map_dropped;
+
+    /// for ST_MAPPED the currently mapped window of the input file, NULL if
+    /// none, and its file offset.
+    char*		m_input_window;
+    size_t		m_input_window_len;
+    off_t		m_input_window_offset;
+
+    /// for ST_MAPPED whether vmsplice() works on the input pipe, otherwise
+    /// the mapping is passed to write().
+    bool		m_input_splice;
+
+    /// size of the mapped windows of ST_MAPPED input. Much larger than a
+    /// pipe, so the pages of the window before the current one have been
+    /// read by the first stage.
+    static const size_t	map_window = 8 << 20;
+
     // *** Output Stream ***
 
     /// describes the currently set input stream type
@@ -357,7 +291,9 @@ private:
 	/// List of program and arguments copied from simple add_exec() calls.
 	std::vector<std::string>	args;
 
-	/// Character pointer to program path called
+	/// Character pointer to program path called, NULL for argsp's first
+	/// entry, which is only looked up in run() as the vector may still
+	/// change until then.
 	const char*			prog;
 
 	/// Pointer to user list of program and arguments.
@@ -366,9 +302,27 @@ private:
 	/// Pointer to environment list supplied by user.
 	const std::vector<std::string>* envp;
 
+	/// NULL-terminated argument and environment arrays for exec(), filled
+	/// before fork() so the child does not touch the heap.
+	std::vector<const char*>	cargs;
+	std::vector<const char*>	cenv;
+
 	/// Pipe stage function object.
 	PipeFunction*			func;
 
+	/// Run the function object in its own worker thread instead of inside
+	/// the select() loop.
+	bool				threaded;
+
+	/// Worker thread running a threaded function stage.
+	pthread_t			thread;
+
+	/// Set while the worker thread was started and not yet joined.
+	bool				thread_started;
+
+	/// Error message of an exception thrown inside the worker thread.
+	std::string			thread_error;
+
 	/// Output stream buffer for function object.
 	RingBuffer			outbuffer;
 
@@ -389,11 +343,21 @@ private:
 	/// File descriptor for child stdout. This is dup2()-ed to STDOUT.
 	int	stdout_fd;
 
+	/// Time of the fork() call relative to the start of run().
+	double	start_time;
+
+	/// Number of read() calls issued by a threaded stage's worker.
+	unsigned long	thread_reads;
+
+	/// Number of write() calls issued by a threaded stage's worker.
+	unsigned long	thread_writes;
+
 	/// Constructor reseting all variables.
 	Stage()
-	    : prog(NULL), argsp(NULL), envp(NULL), func(NULL),
-	      withpath(false), pid(0), retstatus(0),
-	      stdin_fd(-1), stdout_fd(-1)
+	    : prog(NULL), argsp(NULL), envp(NULL), func(NULL), threaded(false),
+	      thread_started(false), withpath(false), pid(0), retstatus(0),
+	      stdin_fd(-1), stdout_fd(-1),
+	      start_time(0), thread_reads(0), thread_writes(0)
 	{
 	}
     };
@@ -404,9 +368,69 @@ private:
     /// list of pipe stages.
     stagelist_type	m_stages;
 
+    /**
+     * Extra pipe between the parent and one exec stage, in addition to its
+     * stdin and stdout.
+     */
+    struct ExtraFd
+    {
+	/// Index of the stage inheriting child_fd.
+	unsigned int	stage;
+
+	/// End kept by the parent, -1 once closed.
+	int		parent_fd;
+
+	/// End inherited by the stage, -1 once closed.
+	int		child_fd;
+
+	/// Descriptor the stage gets child_fd as, e.g. its stderr, or -1 to
+	/// keep the number.
+	int		target_fd;
+
+	/// Receives the stage's output, NULL for input pipes.
+	PipeSink*	sink;
+
+	/// Data written to an input pipe and the current position.
+	const char*	data;
+	unsigned int	datalen, datapos;
+    };
+
+    /// list of extra pipes of all stages.
+    std::vector<ExtraFd>	m_extra_fds;
+
     /// general buffer used for read() and write() calls.
     char		m_buffer[4096];
 
+    // *** Performance Counters ***
+
+    /// counters and timings of the last run()
+    ExecPipe::Stats	m_stats;
+
+    /// timestamp at the start of run()
+    double		m_run_start;
+
+    /// Return a timestamp in seconds.
+    static double timestamp()
+    {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+    }
+
+    /// Return the seconds elapsed since the start of run().
+    double elapsed() const
+    {
+	return timestamp() - m_run_start;
+    }
+
+    /// Record the time the first output byte of a stage was seen, called only
+    /// by the party reading or writing that stage's output.
+    void mark_first_byte(unsigned int st)
+    {
+	if (m_stats.stages[st].first_byte_time < 0)
+	    m_stats.stages[st].first_byte_time = elapsed();
+    }
+
 public:
 
     /// Create a new pipe implementation with zero reference counter.
@@ -416,15 +440,89 @@ public:
 	  m_debug_output(NULL),
 	  m_input(ST_NONE),
 	  m_input_fd(-1),
+	  m_input_window(NULL),
 	  m_output(ST_NONE),
-	  m_output_fd(-1)
+	  m_output_fd(-1),
+	  m_run_start(0)
+    {
+    }
+
+    /// The read buffer held the last block of data passed through.
+    ~ExecPipeImpl()
+    {
+	secure_wipe(m_buffer, sizeof(m_buffer));
+
+	unmap_input();
+
+	for (unsigned int i = 0; i < m_extra_fds.size(); ++i)
+	{
+	    if (m_extra_fds[i].parent_fd >= 0)
+		close(m_extra_fds[i].parent_fd);
+	    if (m_extra_fds[i].child_fd >= 0)
+		close(m_extra_fds[i].child_fd);
+	}
+    }
+
+    /**
+     * Forget the streams and extra pipes bound for the last run(), keeping
+     * the stages and all allocated buffers. Buffers which held data of the
+     * last run are wiped.
+     */
+    void reset()
+    {
+	// run() leaves no descriptors open, except when it was not called.
+	// Those set with set_input_fd() and set_output_fd() belong to the caller.
+	if (m_input_fd >= 0 && m_input != ST_FD)
+	    close(m_input_fd);
+	if (m_output_fd >= 0 && m_output != ST_FD)
+	    close(m_output_fd);
+
+	for (unsigned int i = 0; i < m_stages.size(); ++i)
+	    close_stage_fds(i);
+
+	unmap_input();
+
+	m_input = ST_NONE;
+	m_input_fd = -1;
+	m_input_rbuffer.wipe();
+
+	m_output = ST_NONE;
+	m_output_fd = -1;
+
+	for (unsigned int i = 0; i < m_stages.size(); ++i)
+	{
+	    Stage& stage = m_stages[i];
+
+	    stage.pid = 0;
+	    stage.retstatus = 0;
+	    stage.start_time = 0;
+	    stage.thread_reads = stage.thread_writes = 0;
+	    stage.thread_error.clear();
+	    stage.outbuffer.wipe();
+	}
+
+	for (unsigned int i = 0; i < m_extra_fds.size(); ++i)
+	{
+	    if (m_extra_fds[i].parent_fd >= 0)
+		close(m_extra_fds[i].parent_fd);
+	    if (m_extra_fds[i].child_fd >= 0)
+		close(m_extra_fds[i].child_fd);
+	}
+	m_extra_fds.clear();
+
+	secure_wipe(m_buffer, sizeof(m_buffer));
+    }
+
+    /// Add a reference.
+    void acquire()
     {
+	__sync_add_and_fetch(&m_refs, 1);
     }
 
-    /// Return writable reference to counter.
-    unsigned int& refs()
+    /// Drop a reference, returns true if it was the last one.
+    bool release()
     {
-	return m_refs;
+	return __sync_sub_and_fetch(&m_refs, 1) == 0;
     }
 
     // *** Input Selectors ***
@@ -487,6 +585,25 @@ public:
 	source->m_impl = this;
     }
 
+    /**
+     * Assign length bytes at offset of an already opened file as input
+     * stream. The range is mapped a window at a time and passed to the first
+     * stage straight from the page cache with vmsplice() where available,
+     * and the pages passed are dropped from the page cache again. The fd is
+     * not closed, and the file must not shrink while the pipe runs.
+     */
+    void set_input_mapped(int fd, unsigned long long offset, unsigned long long length)
+    {
+	assert(m_input == ST_NONE);
+	if (m_input != ST_NONE) return;
+
+	m_input = ST_MAPPED;
+	m_input_map_fd = fd;
+	m_input_map_pos = m_input_map_dropped = offset;
+	m_input_map_end = offset + length;
+	m_input_splice = true;
+    }
+
     ///@}
     
     /**
@@ -635,7 +752,6 @@ public:
 	if (args->size() == 0) return;
 
 	struct Stage newstage;
-	newstage.prog = (*args)[0].c_str();
 	newstage.argsp = args;
 	m_stages.push_back(newstage);
     }
@@ -714,7 +830,6 @@ public:
 	if (args->size() == 0) return;
 
 	struct Stage newstage;
-	newstage.prog = (*args)[0].c_str();
 	newstage.argsp = args;
 	newstage.withpath = true;
 	m_stages.push_back(newstage);
@@ -745,10 +860,12 @@ public:
 
     /**
      * Add a function stage to the pipe. This function object will be called in
-     * the parent process with data passing through the stage. See PipeFunction
-     * for more information.
+     * the parent process with data passing through the stage. If threaded is
+     * true, the stage is run by a separate worker thread using blocking I/O on
+     * its pipes, otherwise it is called from the select() loop. See
+     * PipeFunction for more information.
      */
-    void add_function(PipeFunction* func)
+    void add_function(PipeFunction* func, bool threaded)
     {
 	assert(func);
 	if (!func) return;
@@ -758,9 +875,57 @@ public:
 
 	struct Stage newstage;
 	newstage.func = func;
+	newstage.threaded = threaded;
 	m_stages.push_back(newstage);
     }
 
+    /**
+     * Open an extra pipe between the parent and the exec stage added last,
+     * see ExecPipe::add_fd_output() and add_fd_input(). The stage receives
+     * its end as target_fd if it is not -1. Returns the stage's file
+     * descriptor.
+     */
+    int add_extra_fd(PipeSink* sink, const void* data, unsigned int datalen,
+		     int target_fd = -1)
+    {
+	if (m_stages.empty() || m_stages.back().func)
+	    throw(std::runtime_error("Extra file descriptors need an exec stage."));
+
+	int pipefd[2];
+
+	// the stage clears close-on-exec on its end after fork()
+	if (cloexec_pipe(pipefd) != 0)
+	    throw(std::runtime_error(std::string("Could not create an extra pipe: ") + strerror(errno)));
+
+	ExtraFd extra;
+	extra.stage = m_stages.size() - 1;
+	extra.parent_fd = sink ? pipefd[0] : pipefd[1];
+	extra.child_fd = sink ? pipefd[1] : pipefd[0];
+	extra.target_fd = target_fd;
+	extra.sink = sink;
+	extra.data = static_cast<const char*>(data);
+	extra.datalen = datalen;
+	extra.datapos = 0;
+
+	m_extra_fds.push_back(extra);
+
+	if (fcntl(extra.parent_fd, F_SETFL, O_NONBLOCK) != 0)
+	    throw(std::runtime_error(std::string("Could not set non-block mode on an extra pipe: ") + strerror(errno)));
+
+	// the stage keeps its end under the returned number, which must not
+	// be one of 0 to 2 if the host closed its stdio: the stage's stdin
+	// and stdout redirections would replace it.
+	if (target_fd < 0 && m_extra_fds.back().child_fd <= STDERR_FILENO)
+	{
+	    int moved = cloexec_above_stdio(m_extra_fds.back().child_fd);
+	    if (moved < 0)
+		throw(std::runtime_error(std::string("Could not move an extra pipe: ") + strerror(errno)));
+	    m_extra_fds.back().child_fd = moved;
+	}
+
+	return target_fd >= 0 ? target_fd : m_extra_fds.back().child_fd;
+    }
+
     ///@}
 
     /**
@@ -847,6 +1012,14 @@ public:
 	return true;
     }
 
+    /**
+     * Return performance counters and timings of the last run().
+     */
+    const ExecPipe::Stats& stats() const
+    {
+	return m_stats;
+    }
+
     ///@}
 
 protected:
@@ -855,6 +1028,7 @@ protected:
 
     /// Transform arguments and launch an exec stage using the correct exec()
     /// variant.
+    void	prepare_exec(Stage& stage);
     void	exec_stage(const Stage& stage);
 
     /// Print all arguments of exec() call.
@@ -862,12 +1036,113 @@ protected:
 
     /// Safe close() call and output error if fd was already closed.
     void	sclose(int fd);
+
+    /// Close the descriptors of a stage still held by the parent, except
+    /// those handed in by set_input_fd() and set_output_fd().
+    void	close_stage_fds(unsigned int st);
+
+    /// Set up and run the stages, the body of run().
+    void	run_pipe();
+
+    /// Clean up after run_pipe() threw: close the parent's descriptors, so
+    /// the stages see eof or a broken pipe, terminate and reap the children
+    /// and join the worker threads, which still use this object.
+    void	abort_run();
+
+    /// Return the ST_MAPPED input at m_input_map_pos and the number of bytes
+    /// mapped from there, mapping the next window if the position left the
+    /// current one.
+    const char*	map_input(size_t& len);
+
+    /// Pass mapped input to the input pipe like write().
+    ssize_t	write_mapped(const char* data, size_t len);
+
+    /// Unmap the current window of ST_MAPPED input.
+    void	unmap_input();
+
+    /// Drop the ST_MAPPED input before end from the page cache.
+    void	drop_input(off_t end);
+
+    /// Worker loop of a threaded function stage: blocking read() from the
+    /// stage's input, process() and write() of the stage's output buffer.
+    void	run_stage_thread(unsigned int st);
+
+    /// Write the complete output buffer of a threaded stage using blocking
+    /// write() calls.
+    void	flush_stage_thread(unsigned int st);
+
+    /// pthread entry point for threaded function stages.
+    static void* stage_thread_main(void* arg);
+
+    /// Argument block passed to stage_thread_main().
+    struct StageThreadArg
+    {
+	ExecPipeImpl*	impl;
+	unsigned int	stageid;
+    };
+
+    /// Argument blocks of all launched worker threads.
+    std::vector<StageThreadArg>	m_thread_args;
+
+    /// Sorted descriptors kept open by the exec stage being launched.
+    std::vector<int>		m_keep_fds;
 };
 
 // --- ExecPipeImpl ----------------------------------------------------- //
 
+/// Write "msg: arg (errno N)" to the stderr of a forked child, using only
+/// write(), as the child must not allocate or take locks held by other
+/// threads of the parent at fork().
+static void child_error(const char* msg, const char* arg)
+{
+    char num[16];
+    char* p = num + sizeof(num);
+    *--p = 0;
+    *--p = ')';
+    for (int e = errno; p > num + 8 && (e > 0 || *p == ')'); e /= 10)
+	*--p = '0' + e % 10;
+
+    const char* parts[] = { msg, arg ? ": " : "", arg ? arg : "", " (errno ", p, "\n" };
+    for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+	if (write(STDERR_FILENO, parts[i], strlen(parts[i])) < 0)
+	    return;
+}
+
+/// Close the descriptors from lo up to hi in a forked child, which may only
+/// make system calls. close_range() takes the same time however many
+/// descriptors the host process holds; without it, each possible descriptor
+/// below open_max is closed.
+static void close_fds(unsigned int lo, unsigned int hi, long open_max)
+{
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, lo, hi, 0) == 0)
+	return;
+#endif
+    for (unsigned long fd = lo; fd <= hi && fd < (unsigned long)open_max; ++fd)
+	close(fd);
+}
+
+/// In a forked child, move fd, which is to become target, above all kept
+/// descriptors if it is one of 0 to 2 but not target itself. The copy is
+/// closed with the others after the redirections, and the original is
+/// closed on exec like all pipes.
+static bool move_low_fd(int& fd, int target, int above)
+{
+    if (fd < 0 || fd > STDERR_FILENO || fd == target)
+	return true;
+
+    int moved = fcntl(fd, F_DUPFD, above);
+    if (moved < 0)
+	return false;
+
+    fd = moved;
+    return true;
+}
+
 void ExecPipeImpl::print_exec(const std::vector<std::string>& args)
 {
+    if (!LOG_ENABLED(ExecPipe::DL_INFO)) return;
+
     std::ostringstream oss;
     oss << "Exec()";
     for (unsigned ai = 0; ai < args.size(); ++ai)
@@ -877,44 +1152,52 @@ void ExecPipeImpl::print_exec(const std::vector<std::string>& args)
     LOG_INFO(oss.str());
 }
 
-void ExecPipeImpl::exec_stage(const Stage& stage)
+void ExecPipeImpl::prepare_exec(Stage& stage)
 {
     // select arguments vector
     const std::vector<std::string>& args = stage.argsp ? *stage.argsp : stage.args;
 
     // create const char*[] of prog and arguments for syscall.
 
-    const char* cargs[args.size()+1];
+    stage.cargs.resize(args.size() + 1);
 
     for (unsigned ai = 0; ai < args.size(); ++ai)
     {
-	cargs[ai] = args[ai].c_str();
+	stage.cargs[ai] = args[ai].c_str();
     }
-    cargs[ args.size() ] = NULL;
+    stage.cargs[ args.size() ] = NULL;
 
-    if (!stage.envp)
-    {
-	if (stage.withpath)
-	    execvp(stage.prog, (char* const*)cargs);
-	else
-	    execv(stage.prog, (char* const*)cargs);
-    }
-    else
+    if (stage.envp)
     {
 	// create envp const char*[] for syscall.
 
-	const char* cenv[args.size()+1];
+	stage.cenv.resize(stage.envp->size() + 1);
 
 	for (unsigned ei = 0; ei < stage.envp->size(); ++ei)
-	{	
-	    cenv[ei] = (*stage.envp)[ei].c_str();
+	{
+	    stage.cenv[ei] = (*stage.envp)[ei].c_str();
 	}
-	cenv[ stage.envp->size() ] = NULL;
+	stage.cenv[ stage.envp->size() ] = NULL;
+    }
+}
+
+void ExecPipeImpl::exec_stage(const Stage& stage)
+{
+    const char* prog = stage.prog ? stage.prog : stage.cargs[0];
 
-	execve(stage.prog, (char* const*)cargs, (char* const*)cenv);
+    if (!stage.envp)
+    {
+	if (stage.withpath)
+	    execvp(prog, (char* const*)&stage.cargs[0]);
+	else
+	    execv(prog, (char* const*)&stage.cargs[0]);
+    }
+    else
+    {
+	execve(prog, (char* const*)&stage.cargs[0], (char* const*)&stage.cenv[0]);
     }
 
-    LOG_ERROR("Error executing child process: " << strerror(errno));
+    child_error("Error executing child process", prog);
 }
 
 void ExecPipeImpl::sclose(int fd)
@@ -926,46 +1209,347 @@ void ExecPipeImpl::sclose(int fd)
     }
 }
 
-// --- ExecPipeImpl::run() ---------------------------------------------- //
-
-void ExecPipeImpl::run()
+const char* ExecPipeImpl::map_input(size_t& len)
 {
-    if (m_stages.size() == 0)
-	throw(std::runtime_error("No stages to in exec pipe."));
-
-    // *** Phase 1: prepare all file descriptors ************************* //
-
-    // set up input stream accordingly
-    switch(m_input)
+    if (!m_input_window ||
+	m_input_map_pos >= m_input_window_offset + (off_t)m_input_window_len)
     {
-    case ST_NONE:
-	// no file change of file descriptor after fork.
-	m_stages[0].stdin_fd = -1;
-	break;
+	// the window before the one just written has been read by now
+	if (m_input_window)
+	{
+	    drop_input(m_input_window_offset);
+	    unmap_input();
+	}
 
-    case ST_STRING:
-    case ST_OBJECT: {
-	// create input pipe for strings and function objects.
-	int pipefd[2];
+	off_t start = m_input_map_pos & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t wlen = std::min<off_t>(map_window, m_input_map_end - start);
 
-	if (pipe(pipefd) != 0)
-	    throw(std::runtime_error(std::string("Could not create an input pipe: ") + strerror(errno)));
+	void* p = mmap(NULL, wlen, PROT_READ, MAP_SHARED, m_input_map_fd, start);
+	if (p == MAP_FAILED)
+	    throw(std::runtime_error(std::string("Could not map input file: ") + strerror(errno)));
 
-	if (fcntl(pipefd[1], F_SETFL, O_NONBLOCK) != 0)
-	    throw(std::runtime_error(std::string("Could not set non-block mode on input pipe: ") + strerror(errno)));
+	madvise(p, wlen, MADV_SEQUENTIAL);
 
-	m_input_fd = pipefd[1];
-	m_stages[0].stdin_fd = pipefd[0];
-	break;
+	m_input_window = static_cast<char*>(p);
+	m_input_window_len = wlen;
+	m_input_window_offset = start;
     }
-    case ST_FILE: {
-	// open input file
 
-	int infd = open(m_input_file, O_RDONLY);
-	if (infd < 0)
-	    throw(std::runtime_error(std::string("Could not open input file: ") + strerror(errno)));
+    len = std::min<off_t>(m_input_window_offset + m_input_window_len, m_input_map_end)
+	- m_input_map_pos;
+    return m_input_window + (m_input_map_pos - m_input_window_offset);
+}
 
-	m_stages[0].stdin_fd = infd;
+ssize_t ExecPipeImpl::write_mapped(const char* data, size_t len)
+{
+#if defined(__linux__) && defined(SPLICE_F_NONBLOCK)
+    if (m_input_splice)
+    {
+	// the pipe references the page cache pages instead of a copy. They
+	// stay valid after munmap() until the first stage has read them.
+	struct iovec iov;
+	iov.iov_base = const_cast<char*>(data);
+	iov.iov_len = len;
+
+	ssize_t wb = vmsplice(m_input_fd, &iov, 1, SPLICE_F_NONBLOCK);
+	if (wb >= 0 || (errno != EINVAL && errno != ENOSYS))
+	    return wb;
+
+	LOG_INFO("vmsplice() not supported, writing mapped input");
+	m_input_splice = false;
+    }
+#endif
+    return write(m_input_fd, data, len);
+}
+
+void ExecPipeImpl::unmap_input()
+{
+    if (!m_input_window) return;
+
+    munmap(m_input_window, m_input_window_len);
+    m_input_window = NULL;
+}
+
+void ExecPipeImpl::drop_input(off_t end)
+{
+    if (end <= m_input_map_dropped) return;
+
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(m_input_map_fd, m_input_map_dropped, end - m_input_map_dropped,
+		  POSIX_FADV_DONTNEED);
+#endif
+    m_input_map_dropped = end;
+}
+
+void* ExecPipeImpl::stage_thread_main(void* arg)
+{
+    StageThreadArg* sta = static_cast<StageThreadArg*>(arg);
+    sta->impl->run_stage_thread(sta->stageid);
+    return NULL;
+}
+
+void ExecPipeImpl::flush_stage_thread(unsigned int st)
+{
+    Stage& stage = m_stages[st];
+
+    if (stage.stdout_fd < 0) return;
+
+    while (stage.outbuffer.size() > 0)
+    {
+	ssize_t wb = write(stage.stdout_fd,
+			   stage.outbuffer.bottom(),
+			   stage.outbuffer.bottomsize());
+
+	++stage.thread_writes;
+
+	LOG_TRACE("Write on threaded stage fd: " << wb);
+
+	if (wb < 0)
+	{
+	    if (errno == EINTR) continue;
+
+	    throw(std::runtime_error(std::string("Error writing to threaded stage output: ") + strerror(errno)));
+	}
+
+	stage.outbuffer.advance(wb);
+	m_stats.stages[st].bytes_out += wb;
+
+	if (st+1 < m_stages.size() && !m_stages[st+1].func)
+	    mark_first_byte(st);
+    }
+}
+
+void ExecPipeImpl::run_stage_thread(unsigned int st)
+{
+    Stage& stage = m_stages[st];
+
+    char buffer[sizeof(m_buffer)];
+
+    try
+    {
+	while (stage.stdin_fd >= 0)
+	{
+	    ssize_t rb = read(stage.stdin_fd, buffer, sizeof(buffer));
+
+	    ++stage.thread_reads;
+
+	    LOG_TRACE("Read on threaded stage fd: " << rb);
+
+	    if (rb < 0)
+	    {
+		if (errno == EINTR) continue;
+
+		throw(std::runtime_error(std::string("Error reading from threaded stage input: ") + strerror(errno)));
+	    }
+	    else if (rb == 0)
+	    {
+		LOG_INFO("Closing threaded stage input file descriptor");
+
+		stage.func->eof();
+
+		sclose(stage.stdin_fd);
+		stage.stdin_fd = -1;
+	    }
+	    else
+	    {
+		m_stats.stages[st].bytes_in += rb;
+		if (st > 0) mark_first_byte(st-1);
+
+		stage.func->process(buffer, rb);
+	    }
+
+	    flush_stage_thread(st);
+	}
+    }
+    catch (std::exception& e)
+    {
+	LOG_ERROR("Error in threaded function stage: " << e.what());
+	stage.thread_error = e.what();
+    }
+
+    secure_wipe(buffer, sizeof(buffer));
+
+    // closing both ends signals eof or a broken pipe to the neighbours.
+
+    if (stage.stdin_fd >= 0) {
+	sclose(stage.stdin_fd);
+	stage.stdin_fd = -1;
+    }
+
+    if (stage.stdout_fd >= 0) {
+	LOG_INFO("Closing threaded stage output file descriptor");
+
+	sclose(stage.stdout_fd);
+	stage.stdout_fd = -1;
+    }
+}
+
+// --- ExecPipeImpl::run() ---------------------------------------------- //
+
+void ExecPipeImpl::run()
+{
+    try
+    {
+	run_pipe();
+    }
+    catch (...)
+    {
+	abort_run();
+	throw;
+    }
+}
+
+void ExecPipeImpl::close_stage_fds(unsigned int st)
+{
+    Stage& stage = m_stages[st];
+
+    if (stage.stdin_fd >= 0 && !(st == 0 && m_input == ST_FD))
+	close(stage.stdin_fd);
+
+    if (stage.stdout_fd >= 0 && !(st + 1 == m_stages.size() && m_output == ST_FD))
+	close(stage.stdout_fd);
+
+    stage.stdin_fd = stage.stdout_fd = -1;
+}
+
+void ExecPipeImpl::abort_run()
+{
+    if (m_input_fd >= 0 && m_input != ST_FD) {
+	close(m_input_fd);
+	m_input_fd = -1;
+    }
+    if (m_output_fd >= 0 && m_output != ST_FD) {
+	close(m_output_fd);
+	m_output_fd = -1;
+    }
+
+    for (unsigned int i = 0; i < m_extra_fds.size(); ++i)
+    {
+	if (m_extra_fds[i].parent_fd >= 0) {
+	    close(m_extra_fds[i].parent_fd);
+	    m_extra_fds[i].parent_fd = -1;
+	}
+	if (m_extra_fds[i].child_fd >= 0) {
+	    close(m_extra_fds[i].child_fd);
+	    m_extra_fds[i].child_fd = -1;
+	}
+    }
+
+    // a running worker thread closes its own descriptors
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (!m_stages[i].thread_started)
+	    close_stage_fds(i);
+    }
+
+    // the output of the children is discarded, so they need not finish
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (!m_stages[i].func && m_stages[i].pid > 0)
+	    kill(m_stages[i].pid, SIGTERM);
+    }
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (!m_stages[i].thread_started) continue;
+
+	pthread_join(m_stages[i].thread, NULL);
+	m_stages[i].thread_started = false;
+    }
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (m_stages[i].func || m_stages[i].pid <= 0) continue;
+
+	int status;
+	while (waitpid(m_stages[i].pid, &status, 0) < 0 && errno == EINTR) { }
+
+	m_stages[i].retstatus = status;
+	m_stages[i].pid = 0;
+    }
+}
+
+void ExecPipeImpl::run_pipe()
+{
+    if (m_stages.size() == 0)
+	throw(std::runtime_error("No stages to in exec pipe."));
+
+    m_run_start = timestamp();
+
+    // keep the per-stage counters' allocation when the pipe is run again
+    std::vector<ExecPipe::StageStats> stages;
+    stages.swap(m_stats.stages);
+    m_stats = ExecPipe::Stats();
+    stages.assign(m_stages.size(), ExecPipe::StageStats());
+    m_stats.stages.swap(stages);
+
+    // *** Phase 1: prepare all file descriptors ************************* //
+
+    // set up input stream accordingly
+    switch(m_input)
+    {
+    case ST_NONE:
+	// no file change of file descriptor after fork.
+	m_stages[0].stdin_fd = -1;
+	break;
+
+    case ST_STRING:
+    case ST_OBJECT:
+    case ST_MAPPED: {
+	// create input pipe for strings, function objects and mapped files.
+	int pipefd[2];
+
+	if (m_input == ST_MAPPED)
+	{
+	    // mapping beyond the end of the file would raise SIGBUS on access
+	    struct stat st;
+	    if (fstat(m_input_map_fd, &st) != 0)
+		throw(std::runtime_error(std::string("Could not stat input file: ") + strerror(errno)));
+	    if (m_input_map_end > st.st_size || m_input_map_pos > m_input_map_end)
+		throw(std::runtime_error("Input range exceeds the input file."));
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	    posix_fadvise(m_input_map_fd, m_input_map_pos, m_input_map_end - m_input_map_pos,
+			  POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+
+	if (cloexec_pipe(pipefd) != 0)
+	    throw(std::runtime_error(std::string("Could not create an input pipe: ") + strerror(errno)));
+
+	if (fcntl(pipefd[1], F_SETFL, O_NONBLOCK) != 0)
+	    throw(std::runtime_error(std::string("Could not set non-block mode on input pipe: ") + strerror(errno)));
+
+#ifdef F_SETPIPE_SZ
+	// fewer, larger vmsplice() calls; the system limit may refuse it
+	if (m_input == ST_MAPPED)
+	    fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20);
+#endif
+
+	m_input_fd = pipefd[1];
+	m_stages[0].stdin_fd = pipefd[0];
+
+	// a function stage reading the input pipe is served by the select() loop
+	if (m_stages[0].func && !m_stages[0].threaded)
+	{
+	    if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) != 0)
+		throw(std::runtime_error(std::string("Could not set non-block mode on input pipe: ") + strerror(errno)));
+	}
+	break;
+    }
+    case ST_FILE: {
+	// open input file
+
+	int infd = open(m_input_file, O_RDONLY | O_CLOEXEC);
+	if (infd < 0)
+	    throw(std::runtime_error(std::string("Could not open input file: ") + strerror(errno)));
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	// the child shares the open file and with it the larger read-ahead
+	posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	m_stages[0].stdin_fd = infd;
 	break;
     }
     case ST_FD:
@@ -980,18 +1564,18 @@ void ExecPipeImpl::run()
     {
 	int pipefd[2];
 
-	if (pipe(pipefd) != 0)
+	if (cloexec_pipe(pipefd) != 0)
 	    throw(std::runtime_error(std::string("Could not create a stage pipe: ") + strerror(errno)));
 
 	m_stages[i].stdout_fd = pipefd[1];
 	m_stages[i+1].stdin_fd = pipefd[0];
 
-	if (m_stages[i].func)
+	if (m_stages[i].func && !m_stages[i].threaded)
 	{
 	    if (fcntl(m_stages[i].stdout_fd, F_SETFL, O_NONBLOCK) != 0)
 		throw(std::runtime_error(std::string("Could not set non-block mode on a stage pipe: ") + strerror(errno)));
 	}
-	if (m_stages[i+1].func)
+	if (m_stages[i+1].func && !m_stages[i+1].threaded)
 	{
 	    if (fcntl(m_stages[i+1].stdin_fd, F_SETFL, O_NONBLOCK) != 0)
 		throw(std::runtime_error(std::string("Could not set non-block mode on a stage pipe: ") + strerror(errno)));
@@ -1011,7 +1595,7 @@ void ExecPipeImpl::run()
 	// create output pipe for strings and objects.
 	int pipefd[2];
 
-	if (pipe(pipefd) != 0)
+	if (cloexec_pipe(pipefd) != 0)
 	    throw(std::runtime_error(std::string("Could not create an output pipe: ") + strerror(errno)));
 
 	if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) != 0)
@@ -1019,12 +1603,19 @@ void ExecPipeImpl::run()
 
 	m_stages.back().stdout_fd = pipefd[1];
 	m_output_fd = pipefd[0];
+
+	// a function stage writing the output pipe is served by the select() loop
+	if (m_stages.back().func && !m_stages.back().threaded)
+	{
+	    if (fcntl(pipefd[1], F_SETFL, O_NONBLOCK) != 0)
+		throw(std::runtime_error(std::string("Could not set non-block mode on output pipe: ") + strerror(errno)));
+	}
 	break;
     }
     case ST_FILE: {
 	// create or truncate output file
 
-	int outfd = open(m_output_file, O_WRONLY | O_CREAT | O_TRUNC, m_output_file_mode);
+	int outfd = open(m_output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, m_output_file_mode);
 	if (outfd < 0)
 	    throw(std::runtime_error(std::string("Could not open output file: ") + strerror(errno)));
 
@@ -1036,83 +1627,187 @@ void ExecPipeImpl::run()
 	m_stages.back().stdout_fd = m_output_fd;
 	m_output_fd = -1;
 	break;
+
+    case ST_MAPPED:
+	// input only
+	assert(0);
+	break;
     }
 
     // *** Phase 2: launch child processes ******************************* //
 
+    // bound for closing descriptors where close_range() is missing
+    long open_max = sysconf(_SC_OPEN_MAX);
+    if (open_max < 0) open_max = 1024;
+
     for (unsigned int i = 0; i < m_stages.size(); ++i)
     {
 	if (m_stages[i].func) continue;
 
-	print_exec(m_stages[i].args);
+	print_exec(m_stages[i].argsp ? *m_stages[i].argsp : m_stages[i].args);
+	prepare_exec(m_stages[i]);
+
+	// descriptors the stage keeps, the child closes all others, including
+	// those the host process opened without close-on-exec.
+	m_keep_fds.clear();
+	for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd)
+	    m_keep_fds.push_back(fd);
+
+	for (unsigned int j = 0; j < m_extra_fds.size(); ++j)
+	{
+	    if (m_extra_fds[j].stage != i) continue;
+	    m_keep_fds.push_back(m_extra_fds[j].target_fd >= 0
+				 ? m_extra_fds[j].target_fd : m_extra_fds[j].child_fd);
+	}
+	std::sort(m_keep_fds.begin(), m_keep_fds.end());
+
+	m_stages[i].start_time = elapsed();
 
 	pid_t child = fork();
+	if (child < 0)
+	    throw(std::runtime_error(std::string("Could not fork a child process: ") + strerror(errno)));
+
 	if (child == 0)
 	{
-	    // inside child process
+	    // inside child process. It was forked from a possibly
+	    // multi-threaded parent, so only system calls are safe until exec.
+
+	    // pipes take the numbers 0 to 2 if the host closed its stdio. One
+	    // that is to become another number would be overwritten by the
+	    // redirection to its own, so it is moved out of the way first.
+	    // Extra pipes without a target were moved by add_extra_fd().
+	    int above = m_keep_fds.back() + 1;
+	    bool moved = move_low_fd(m_stages[i].stdin_fd, STDIN_FILENO, above) &&
+		move_low_fd(m_stages[i].stdout_fd, STDOUT_FILENO, above);
+
+	    for (unsigned int j = 0; moved && j < m_extra_fds.size(); ++j)
+	    {
+		ExtraFd& extra = m_extra_fds[j];
+		if (extra.stage == i && extra.target_fd >= 0)
+		    moved = move_low_fd(extra.child_fd, extra.target_fd, above);
+	    }
+
+	    if (!moved) {
+		child_error("Could not move file descriptor", NULL);
+		_exit(255);
+	    }
 
-	    // move assigned file descriptors and close all others
-	    if (m_input_fd >= 0)
-		sclose(m_input_fd);
+	    // dup2 file descriptors assigned for this stage as stdin and stdout.
+	    // dup2() clears close-on-exec on the copy, but does nothing if both
+	    // are equal.
 
-	    for (unsigned int j = 0; j < m_stages.size(); ++j)
+	    if (m_stages[i].stdin_fd >= 0)
 	    {
-		if (i == j)
-		{
-		    // dup2 file descriptors assigned for this stage as stdin and stdout
+		int r = (m_stages[i].stdin_fd != STDIN_FILENO)
+		    ? dup2(m_stages[i].stdin_fd, STDIN_FILENO)
+		    : fcntl(STDIN_FILENO, F_SETFD, 0);
 
-		    if (m_stages[i].stdin_fd >= 0)
-		    {
-			if (dup2(m_stages[i].stdin_fd, STDIN_FILENO) == -1) {
-			    LOG_ERROR("Could not redirect file descriptor: " << strerror(errno));
-			    exit(255);
-			}
-		    }
+		if (r == -1) {
+		    child_error("Could not redirect file descriptor", NULL);
+		    _exit(255);
+		}
+	    }
 
-		    if (m_stages[i].stdout_fd >= 0)
-		    {
-			if (dup2(m_stages[i].stdout_fd, STDOUT_FILENO) == -1) {
-			    LOG_ERROR("Could not redirect file descriptor: " << strerror(errno));
-			    exit(255);
-			}
-		    }
+	    if (m_stages[i].stdout_fd >= 0)
+	    {
+		int r = (m_stages[i].stdout_fd != STDOUT_FILENO)
+		    ? dup2(m_stages[i].stdout_fd, STDOUT_FILENO)
+		    : fcntl(STDOUT_FILENO, F_SETFD, 0);
+
+		if (r == -1) {
+		    child_error("Could not redirect file descriptor", NULL);
+		    _exit(255);
 		}
-		else
-		{
-		    // close file descriptors of other stages
+	    }
 
-		    if (m_stages[j].stdin_fd >= 0)
-			sclose(m_stages[j].stdin_fd);
+	    // keep this stage's extra pipes open across exec
+	    for (unsigned int j = 0; j < m_extra_fds.size(); ++j)
+	    {
+		const ExtraFd& extra = m_extra_fds[j];
+		if (extra.stage != i) continue;
+
+		int r = (extra.target_fd >= 0 && extra.target_fd != extra.child_fd)
+		    ? dup2(extra.child_fd, extra.target_fd)
+		    : fcntl(extra.child_fd, F_SETFD, 0);
 
-		    if (m_stages[j].stdout_fd >= 0)
-			sclose(m_stages[j].stdout_fd);
+		if (r == -1)
+		{
+		    child_error("Could not pass extra file descriptor", NULL);
+		    _exit(255);
 		}
 	    }
 
-	    if (m_output_fd >= 0)
-		sclose(m_output_fd);
+	    // close everything else, i.e. the other stages' pipes, the
+	    // originals of the descriptors moved above and the host's files
+	    unsigned int lo = 0;
+	    for (unsigned int k = 0; k < m_keep_fds.size(); ++k)
+	    {
+		unsigned int fd = m_keep_fds[k];
+		if (fd > lo)
+		    close_fds(lo, fd - 1, open_max);
+		if (fd + 1 > lo)
+		    lo = fd + 1;
+	    }
+	    close_fds(lo, ~0U, open_max);
 
 	    // run program
 	    exec_stage(m_stages[i]);
 
-	    exit(255);
+	    // _exit() skips the atexit handlers and stdio buffers of the parent
+	    _exit(255);
 	}
 
 	m_stages[i].pid = child;
+	m_stats.stages[i].spawn_time = elapsed() - m_stages[i].start_time;
     }
 
     // parent process: close all unneeded file descriptors of exec stages.
 
-    for (stagelist_type::const_iterator st = m_stages.begin();
+    for (stagelist_type::iterator st = m_stages.begin();
 	 st != m_stages.end(); ++st)
     {
 	if (st->func) continue;
 
-	if (st->stdin_fd >= 0)
+	if (st->stdin_fd >= 0) {
 	    sclose(st->stdin_fd);
+	    st->stdin_fd = -1;
+	}
 
-	if (st->stdout_fd >= 0)
+	if (st->stdout_fd >= 0) {
 	    sclose(st->stdout_fd);
+	    st->stdout_fd = -1;
+	}
+    }
+
+    for (unsigned int i = 0; i < m_extra_fds.size(); ++i)
+    {
+	if (m_extra_fds[i].child_fd >= 0) {
+	    sclose(m_extra_fds[i].child_fd);
+	    m_extra_fds[i].child_fd = -1;
+	}
+    }
+
+    // start worker threads after all fork() calls, so no child is forked from
+    // a multi-threaded parent by this pipe.
+
+    m_thread_args.clear();
+    m_thread_args.reserve(m_stages.size());
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	if (!m_stages[i].func || !m_stages[i].threaded) continue;
+
+	StageThreadArg sta = { this, i };
+	m_thread_args.push_back(sta);
+
+	int r = pthread_create(&m_stages[i].thread, NULL,
+			       &ExecPipeImpl::stage_thread_main, &m_thread_args.back());
+	if (r != 0)
+	    throw(std::runtime_error(std::string("Could not create stage thread: ") + strerror(r)));
+
+	m_stages[i].thread_started = true;
+
+	LOG_INFO("Started worker thread for function stage " << i);
     }
 
     // *** Phase 3: run select() loop and process data ******************* //
@@ -1138,7 +1833,7 @@ void ExecPipeImpl::run()
 		    sclose(m_input_fd);
 		    m_input_fd = -1;
 
-		    LOG_INFO("Closing input file descriptor: " << strerror(errno));
+		    LOG_INFO("Closing input file descriptor");
 		}
 		else
 		{
@@ -1159,7 +1854,7 @@ void ExecPipeImpl::run()
 
 	for (unsigned int i = 0; i < m_stages.size(); ++i)
 	{
-	    if (!m_stages[i].func) continue;
+	    if (!m_stages[i].func || m_stages[i].threaded) continue;
 
 	    if (m_stages[i].stdin_fd >= 0)
 	    {
@@ -1196,16 +1891,43 @@ void ExecPipeImpl::run()
 	    LOG_DEBUG("Select on output file descriptor");
 	}
 
+	for (unsigned int i = 0; i < m_extra_fds.size(); ++i)
+	{
+	    ExtraFd& extra = m_extra_fds[i];
+	    if (extra.parent_fd < 0) continue;
+
+	    if (extra.sink)
+	    {
+		FD_SET(extra.parent_fd, &read_fds);
+	    }
+	    else if (extra.datapos < extra.datalen)
+	    {
+		FD_SET(extra.parent_fd, &write_fds);
+	    }
+	    else
+	    {
+		sclose(extra.parent_fd);
+		extra.parent_fd = -1;
+		continue;
+	    }
+
+	    if (max_fds < extra.parent_fd) max_fds = extra.parent_fd;
+
+	    LOG_DEBUG("Select on extra file descriptor");
+	}
+
 	// issue select() call
 
 	if (max_fds < 0)
 	    break;
 
 	int retval = select(max_fds+1, &read_fds, &write_fds, NULL, NULL);
+	++m_stats.select_calls;
+
 	if (retval < 0)
 	    throw(std::runtime_error(std::string("Error during select() on file descriptors: ") + strerror(errno)));
 
-	LOG_TRACE("select() on " << retval << " file descriptors: " << strerror(errno));
+	LOG_TRACE("select() on " << retval << " file descriptors");
 
 	// handle file descriptors marked by select() in both sets
 
@@ -1216,16 +1938,24 @@ void ExecPipeImpl::run()
 		// write string data to first stdin file descriptor.
 
 		assert(m_input_string);
-		assert(m_input_string_pos < m_input_string->size());
+		ssize_t wb = 0;
 
-		ssize_t wb;
+		if (m_input_string_pos >= m_input_string->size())
+		{
+		    // empty input string: only signal eof to the first stage.
+		    sclose(m_input_fd);
+		    m_input_fd = -1;
 
-		do
+		    LOG_INFO("Closing input file descriptor");
+		}
+		else do
 		{
 		    wb = write(m_input_fd,
 			       m_input_string->data() + m_input_string_pos,
 			       m_input_string->size() - m_input_string_pos);
 
+		    ++m_stats.write_calls;
+
 		    LOG_TRACE("Write on input fd: " << wb);
 
 		    if (wb < 0)
@@ -1240,19 +1970,20 @@ void ExecPipeImpl::run()
 			    sclose(m_input_fd);
 			    m_input_fd = -1;
 
-			    LOG_INFO("Closing input file descriptor: " << strerror(errno));
+			    LOG_INFO("Closing input file descriptor");
 			}
 		    }
 		    else if (wb > 0)
 		    {
 			m_input_string_pos += wb;
+			m_stats.stages[0].bytes_in += wb;
 
 			if (m_input_string_pos >= m_input_string->size())
 			{
 			    sclose(m_input_fd);
 			    m_input_fd = -1;
 
-			    LOG_INFO("Closing input file descriptor: " << strerror(errno));
+			    LOG_INFO("Closing input file descriptor");
 			    break;
 			}
 		    }
@@ -1271,6 +2002,8 @@ void ExecPipeImpl::run()
 			       m_input_rbuffer.bottom(),
 			       m_input_rbuffer.bottomsize());
 
+		    ++m_stats.write_calls;
+
 		    LOG_TRACE("Write on input fd: " << wb);
 
 		    if (wb < 0)
@@ -1285,15 +2018,60 @@ void ExecPipeImpl::run()
 			    sclose(m_input_fd);
 			    m_input_fd = -1;
 
-			    LOG_INFO("Closing input file descriptor: " << strerror(errno));
+			    LOG_INFO("Closing input file descriptor");
 			}
 		    }
 		    else if (wb > 0)
 		    {
 			m_input_rbuffer.advance(wb);
+			m_stats.stages[0].bytes_in += wb;
 		    }
 		} while (wb > 0);
 	    }
+	    else if (m_input == ST_MAPPED)
+	    {
+		// pass the mapped file range to the first stdin file descriptor.
+
+		while (m_input_map_pos < m_input_map_end)
+		{
+		    size_t len;
+		    const char* data = map_input(len);
+
+		    ssize_t wb = write_mapped(data, len);
+
+		    ++m_stats.write_calls;
+
+		    LOG_TRACE("Write on input fd: " << wb);
+
+		    if (wb < 0)
+		    {
+			if (errno != EAGAIN && errno != EINTR)
+			{
+			    LOG_INFO("Error writing to input file descriptor: " << strerror(errno));
+
+			    sclose(m_input_fd);
+			    m_input_fd = -1;
+
+			    LOG_INFO("Closing input file descriptor");
+			}
+			break;
+		    }
+
+		    m_input_map_pos += wb;
+		    m_stats.stages[0].bytes_in += wb;
+		}
+
+		if (m_input_fd >= 0 && m_input_map_pos >= m_input_map_end)
+		{
+		    sclose(m_input_fd);
+		    m_input_fd = -1;
+
+		    LOG_INFO("Closing input file descriptor");
+		}
+
+		if (m_input_fd < 0)
+		    unmap_input();
+	    }
 	}
 
 	if (m_output_fd >= 0 && FD_ISSET(m_output_fd, &read_fds))
@@ -1309,6 +2087,8 @@ void ExecPipeImpl::run()
 		rb = read(m_output_fd, 
 			  m_buffer, sizeof(m_buffer));
 
+		++m_stats.read_calls;
+
 		LOG_TRACE("Read on output fd: " << rb);
 
 		if (rb <= 0)
@@ -1317,7 +2097,7 @@ void ExecPipeImpl::run()
 		    {
 			// zero read indicates eof
 
-			LOG_INFO("Closing output file descriptor: " << strerror(errno));
+			LOG_INFO("Closing output file descriptor");
 
 			if (m_output == ST_OBJECT)
 			{
@@ -1338,6 +2118,9 @@ void ExecPipeImpl::run()
 		}
 		else
 		{
+		    m_stats.stages.back().bytes_out += rb;
+		    mark_first_byte(m_stages.size()-1);
+
 		    if (m_output == ST_STRING)
 		    {
 			assert(m_output_string);
@@ -1352,9 +2135,72 @@ void ExecPipeImpl::run()
 	    } while (rb > 0);
 	}
 	    
+	for (unsigned int i = 0; i < m_extra_fds.size(); ++i)
+	{
+	    ExtraFd& extra = m_extra_fds[i];
+
+	    if (extra.parent_fd >= 0 && extra.sink && FD_ISSET(extra.parent_fd, &read_fds))
+	    {
+		ssize_t rb;
+
+		do
+		{
+		    errno = 0;
+
+		    rb = read(extra.parent_fd, m_buffer, sizeof(m_buffer));
+
+		    ++m_stats.read_calls;
+
+		    LOG_TRACE("Read on extra fd: " << rb);
+
+		    if (rb < 0 && (errno == EAGAIN || errno == EINTR))
+		    {
+		    }
+		    else if (rb <= 0)
+		    {
+			if (rb < 0) {
+			    LOG_ERROR("Error reading from extra file descriptor: " << strerror(errno));
+			}
+
+			LOG_INFO("Closing extra file descriptor");
+
+			extra.sink->eof();
+
+			sclose(extra.parent_fd);
+			extra.parent_fd = -1;
+		    }
+		    else
+		    {
+			extra.sink->process(m_buffer, rb);
+		    }
+		} while (rb > 0);
+	    }
+	    else if (extra.parent_fd >= 0 && !extra.sink && FD_ISSET(extra.parent_fd, &write_fds))
+	    {
+		ssize_t wb = write(extra.parent_fd, extra.data + extra.datapos,
+				   extra.datalen - extra.datapos);
+
+		++m_stats.write_calls;
+
+		LOG_TRACE("Write on extra fd: " << wb);
+
+		if (wb > 0)
+		{
+		    extra.datapos += wb;
+		}
+		else if (wb < 0 && errno != EAGAIN && errno != EINTR)
+		{
+		    LOG_INFO("Error writing to extra file descriptor: " << strerror(errno));
+
+		    sclose(extra.parent_fd);
+		    extra.parent_fd = -1;
+		}
+	    }
+	}
+
 	for (unsigned int i = 0; i < m_stages.size(); ++i)
 	{
-	    if (!m_stages[i].func) continue;
+	    if (!m_stages[i].func || m_stages[i].threaded) continue;
 
 	    if (m_stages[i].stdin_fd >= 0 && FD_ISSET(m_stages[i].stdin_fd, &read_fds))
 	    {
@@ -1367,6 +2213,8 @@ void ExecPipeImpl::run()
 		    rb = read(m_stages[i].stdin_fd, 
 			      m_buffer, sizeof(m_buffer));
 
+		    ++m_stats.read_calls;
+
 		    LOG_TRACE("Read on stage fd: " << rb);
 
 		    if (rb <= 0)
@@ -1375,7 +2223,7 @@ void ExecPipeImpl::run()
 			{
 			    // zero read indicates eof
 
-			    LOG_INFO("Closing stage input file descriptor: " << strerror(errno));
+			    LOG_INFO("Closing stage input file descriptor");
 
 			    m_stages[i].func->eof();
 
@@ -1392,6 +2240,9 @@ void ExecPipeImpl::run()
 		    }
 		    else
 		    {
+			m_stats.stages[i].bytes_in += rb;
+			if (i > 0) mark_first_byte(i-1);
+
 			m_stages[i].func->process(m_buffer, rb);
 		    }
 		} while (rb > 0);
@@ -1405,6 +2256,8 @@ void ExecPipeImpl::run()
 				       m_stages[i].outbuffer.bottom(),
 				       m_stages[i].outbuffer.bottomsize());
 
+		    ++m_stats.write_calls;
+
 		    LOG_TRACE("Write on stage fd: " << wb);
 
 		    if (wb < 0)
@@ -1421,12 +2274,16 @@ void ExecPipeImpl::run()
 		    else if (wb > 0)
 		    {
 			m_stages[i].outbuffer.advance(wb);
+			m_stats.stages[i].bytes_out += wb;
+
+			if (i+1 < m_stages.size() && !m_stages[i+1].func)
+			    mark_first_byte(i);
 		    }
 		}
 
 		if (m_stages[i].stdin_fd < 0 && !m_stages[i].outbuffer.size())
 		{
-		    LOG_INFO("Closing stage output file descriptor: " << strerror(errno));
+		    LOG_INFO("Closing stage output file descriptor");
 
 		    sclose(m_stages[i].stdout_fd);
 		    m_stages[i].stdout_fd = -1;
@@ -1435,60 +2292,102 @@ void ExecPipeImpl::run()
 	}
     }
 
-    // *** Phase 4: call wait() for all children processes *************** //
+    // *** Phase 4: join worker threads and wait() for all children ******* //
 
-    unsigned int donepid = 0;
+    std::string thread_error;
 
     for (unsigned int i = 0; i < m_stages.size(); ++i)
     {
-	if (!m_stages[i].func) continue;
-	++donepid;
+	if (!m_stages[i].func || !m_stages[i].threaded) continue;
+
+	pthread_join(m_stages[i].thread, NULL);
+	m_stages[i].thread_started = false;
+
+	if (thread_error.empty())
+	    thread_error = m_stages[i].thread_error;
     }
 
-    while (donepid != m_stages.size())
+    // reap only our own children with wait4(), which also returns their
+    // resource usage. Waiting for any pid would steal children of other
+    // pipes or of the host process.
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
     {
+	if (m_stages[i].func) continue;
+
 	int status;
-	int p = wait(&status);
+	struct rusage ru;
+	pid_t p;
+
+	do {
+	    p = wait4(m_stages[i].pid, &status, 0, &ru);
+	} while (p < 0 && errno == EINTR);
 
 	if (p < 0)
 	{
-	    LOG_ERROR("Error calling wait(): " << strerror(errno));
-	    break;
+	    LOG_ERROR("Error calling wait4(): " << strerror(errno));
+	    continue;
 	}
 
-	bool found = false;
+	m_stages[i].retstatus = status;
+	m_stages[i].pid = 0;
 
-	for (unsigned int i = 0; i < m_stages.size(); ++i)
+	ExecPipe::StageStats& ss = m_stats.stages[i];
+	ss.wall_time = elapsed() - m_stages[i].start_time;
+	ss.user_time = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+	ss.sys_time = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+
+	if (WIFEXITED(status))
 	{
-	    if (p == m_stages[i].pid)
-	    {
-		m_stages[i].retstatus = status;
+	    LOG_INFO("Finished exec() stage " << p << " with retcode " << WEXITSTATUS(status));
+	}
+	else if (WIFSIGNALED(status))
+	{
+	    LOG_INFO("Finished exec() stage " << p << " with signal " << WTERMSIG(status));
+	}
+	else
+	{
+	    LOG_ERROR("Error in wait4(): unknown return status for pid " << p);
+	}
+    }
 
-		if (WIFEXITED(status))
-		{
-		    LOG_INFO("Finished exec() stage " << p << " with retcode " << WEXITSTATUS(status));
-		}
-		else if (WIFSIGNALED(status))
-		{
-		    LOG_INFO("Finished exec() stage " << p << " with signal " << WTERMSIG(status));
-		}
-		else
-		{
-		    LOG_ERROR("Error in wait(): unknown return status for pid " << p);
-		}
+    // all children are gone, so the pages passed to them are no longer used
+    if (m_input == ST_MAPPED)
+	drop_input(m_input_map_pos);
 
-		++donepid;
-		found = true;
-		break;
-	    }
-	}
+    // *** Phase 5: collect performance counters ************************* //
+
+    for (unsigned int i = 0; i < m_stages.size(); ++i)
+    {
+	const Stage& stage = m_stages[i];
 
-	if (!found)
+	if (stage.func)
 	{
-	    LOG_ERROR("Error in wait(): syscall returned an unknown child pid.");
+	    // traffic of an exec stage is only seen through neighbouring
+	    // function stages.
+	    if (i > 0 && !m_stages[i-1].func)
+		m_stats.stages[i-1].bytes_out = m_stats.stages[i].bytes_in;
+	    if (i+1 < m_stages.size() && !m_stages[i+1].func)
+		m_stats.stages[i+1].bytes_in = m_stats.stages[i].bytes_out;
+
+	    m_stats.read_calls += stage.thread_reads;
+	    m_stats.write_calls += stage.thread_writes;
 	}
+
+	if (m_stats.peak_buffer < stage.outbuffer.buffsize())
+	    m_stats.peak_buffer = stage.outbuffer.buffsize();
     }
 
+    if (m_stats.peak_buffer < m_input_rbuffer.buffsize())
+	m_stats.peak_buffer = m_input_rbuffer.buffsize();
+
+    m_stats.bytes_in = m_stats.stages.front().bytes_in;
+    m_stats.bytes_out = m_stats.stages.back().bytes_out;
+    m_stats.wall_time = elapsed();
+
+    if (!thread_error.empty())
+	throw(std::runtime_error(std::string("Error in threaded function stage: ") + thread_error));
+
     LOG_INFO("Finished running pipe.");
 }
 
@@ -1497,30 +2396,33 @@ void ExecPipeImpl::run()
 ExecPipe::ExecPipe()
     : m_impl(new ExecPipeImpl)
 {
-    ++m_impl->refs();
+    m_impl->acquire();
 }
 
 ExecPipe::~ExecPipe()
 {
-    if (--m_impl->refs() == 0)
+    if (m_impl->release())
 	delete m_impl;
 }
 
 ExecPipe::ExecPipe(const ExecPipe& ep)
     : m_impl(ep.m_impl)
 {
-    ++m_impl->refs();
+    m_impl->acquire();
 }
 
 ExecPipe& ExecPipe::operator=(const ExecPipe& ep)
 {
     if (this != &ep)
     {
-	if (--m_impl->refs() == 0)
+	// acquire first, so assigning a copy of the same pipe keeps it alive
+	ExecPipeImpl* impl = ep.m_impl;
+	impl->acquire();
+
+	if (m_impl->release())
 	    delete m_impl;
 
-	m_impl = ep.m_impl;
-	++m_impl->refs();
+	m_impl = impl;
     }
     return *this;
 }
@@ -1554,6 +2456,11 @@ void ExecPipe::set_input_source(PipeSource* source)
 {
     return m_impl->set_input_source(source);
 }
+
+void ExecPipe::set_input_mapped(int fd, unsigned long long offset, unsigned long long length)
+{
+    return m_impl->set_input_mapped(fd, offset, length);
+}
    
 void ExecPipe::set_output_fd(int fd)
 {
@@ -1637,9 +2544,25 @@ void ExecPipe::add_exece(const char* path,
     return m_impl->add_exece(path, args, env);
 }
 
-void ExecPipe::add_function(PipeFunction* func)
+void ExecPipe::add_function(PipeFunction* func, bool threaded)
 {	
-    return m_impl->add_function(func);
+    return m_impl->add_function(func, threaded);
+}
+
+int ExecPipe::add_fd_output(PipeSink* sink)
+{
+    assert(sink);
+    return m_impl->add_extra_fd(sink, NULL, 0);
+}
+
+void ExecPipe::add_stderr_output(PipeSink* sink)
+{
+    m_impl->add_extra_fd(sink, NULL, 0, STDERR_FILENO);
+}
+
+int ExecPipe::add_fd_input(const void* data, unsigned int datalen)
+{
+    return m_impl->add_extra_fd(NULL, data, datalen);
 }
 
 ExecPipe& ExecPipe::run()
@@ -1648,6 +2571,11 @@ ExecPipe& ExecPipe::run()
     return *this;
 }
 
+void ExecPipe::reset()
+{
+    m_impl->reset();
+}
+
 int ExecPipe::get_return_status(unsigned int stageid) const
 {
     return m_impl->get_return_status(stageid);
@@ -1668,6 +2596,23 @@ bool ExecPipe::all_return_codes_zero() const
     return m_impl->all_return_codes_zero();
 }
 
+const ExecPipe::Stats& ExecPipe::stats() const
+{
+    return m_impl->stats();
+}
+
+ExecPipe::StageStats::StageStats()
+    : spawn_time(0), first_byte_time(-1), wall_time(0),
+      user_time(0), sys_time(0), bytes_in(0), bytes_out(0)
+{
+}
+
+ExecPipe::Stats::Stats()
+    : wall_time(0), select_calls(0), read_calls(0), write_calls(0),
+      peak_buffer(0), bytes_in(0), bytes_out(0)
+{
+}
+
 // --- PipeSource ------------------------------------------------------- //
 
 PipeSource::PipeSource()
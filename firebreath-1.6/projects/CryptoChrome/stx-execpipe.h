@@ -96,6 +96,12 @@ public:
  * stage via the inherited functions process() and also the eof()
  * signal. Usually process() will perform some action on the data and then
  * forward the resulting data block to the next pipe stage via write().
+ *
+ * A function stage added as threaded is run by its own worker thread, which
+ * reads and writes the stage's pipes with blocking calls. The kernel pipe
+ * buffers then serve as the queues between the worker and the rest of the
+ * pipe, so CPU-heavy process() functions do not stall the select() loop.
+ * process() and eof() are then called from the worker thread.
  */
 class PipeFunction : public PipeSink
 {
@@ -124,6 +130,13 @@ public:
  * counted pointer implementation, so you can easily copy and pass around
  * without duplicating the inside object. See the \ref index "main page" for
  * detailed information and examples.
+ *
+ * Different pipes may be set up and run by different threads at the same
+ * time. A single pipe, including all copies referring to it, must only be
+ * used by one thread at a time, except that copies may be created and
+ * destroyed in any thread, as the reference count is atomic, and that the
+ * debug output function may be changed while the pipe runs. Debug lines of
+ * all pipes are written one at a time.
  */
 class ExecPipe
 {
@@ -155,7 +168,9 @@ public:
 	DL_TRACE=3  ///< trace lists lots of info about read() and write() calls.
     };
 
-    /// Change the current debug level. The default is DL_ERROR.
+    /// Change the current debug level. The default is DL_ERROR. Levels above
+    /// STX_EXECPIPE_MAX_DEBUG_LEVEL (DL_ERROR if NDEBUG is defined, otherwise
+    /// DL_TRACE) are compiled out and produce no output.
     void set_debug_level(enum DebugLevel dl);
 
     /// Change output function for debug messages. If set to NULL (the default)
@@ -191,7 +206,16 @@ public:
      * stage.
      */
     void set_input_source(PipeSource* source);
-    
+
+    /**
+     * Assign length bytes at offset of an already opened file as input
+     * stream. The range is mapped a window at a time and passed to the first
+     * stage straight from the page cache with vmsplice() where available,
+     * and the pages passed are dropped from the page cache again. The fd is
+     * not closed, and the file must not shrink while the pipe runs.
+     */
+    void set_input_mapped(int fd, unsigned long long offset, unsigned long long length);
+
     ///@}
 
     // *** Output Selectors ***
@@ -315,10 +339,36 @@ public:
 
     /**
      * Add a function stage to the pipe. This function object will be called in
-     * the parent process with data passing through the stage. See PipeFunction
-     * for more information.
+     * the parent process with data passing through the stage. If threaded is
+     * true, the function object is called from a separate worker thread,
+     * otherwise from the select() loop in run(). See PipeFunction for more
+     * information.
      */
-    void add_function(PipeFunction* func);
+    void add_function(PipeFunction* func, bool threaded = false);
+
+    /**
+     * Open an extra pipe from the exec stage added last, which inherits its
+     * write end as the returned file descriptor, e.g. for gpg's
+     * --status-fd or --attribute-fd. Everything the stage writes to it is passed to sink. The
+     * descriptor is closed on exec in all other processes.
+     */
+    int add_fd_output(PipeSink* sink);
+
+    /**
+     * Capture the stderr of the exec stage added last into sink, instead of
+     * letting it write to the parent's stderr. It is read in the same select()
+     * loop as the data, so large diagnostics neither mix with nor stall the
+     * stage's output.
+     */
+    void add_stderr_output(PipeSink* sink);
+
+    /**
+     * Open an extra pipe to the exec stage added last, from which it reads
+     * datalen bytes of data at the returned file descriptor, e.g. for gpg's
+     * --override-session-key-fd. The data is not copied, so it must still
+     * exist when run() is called.
+     */
+    int add_fd_input(const void* data, unsigned int datalen);
 
     ///@}
 
@@ -326,13 +376,26 @@ public:
 
     /**
      * Run the configured pipe sequence and wait for all children processes to
-     * complete. Returns a reference to *this for chaining.
+     * complete. Returns a reference to *this for chaining. Each exec stage
+     * inherits only its stdin, stdout, stderr and extra pipes, all other
+     * descriptors of the process are closed before the exec().
      *
      * This function call should be wrapped into a try-catch block as it will
      * throw() if a system call fails.
      */
     ExecPipe& run();
 
+    /**
+     * Prepare the pipe for another run(). The input, output and extra pipes
+     * are unbound and must be set again, while the stages and all buffers
+     * are kept, so a pipe which is run repeatedly allocates nothing after
+     * its first run. Buffers are wiped of the last run's data. The argument
+     * vectors of add_exec(args) stages are only read by run(), so they may
+     * be changed in between. Descriptors the pipe opened are closed, while
+     * those given to set_input_fd() and set_output_fd() are left open.
+     */
+    void reset();
+
     // *** Inspection After Pipe Execution ***
 
     ///@{ \name Inspect Return Codes
@@ -361,6 +424,85 @@ public:
     bool all_return_codes_zero() const;
 
     ///@}
+
+    // *** Performance Counters ***
+
+    ///@{ \name Performance Counters
+
+    /**
+     * Timings and traffic of a single pipe stage. Times are in seconds and
+     * relative to the start of run(). Byte counts cover only data passing
+     * through the pipe object itself, i.e. input and output strings or objects
+     * and function stages, not file or fd redirections.
+     */
+    struct StageStats
+    {
+	/// time spent in fork() for an exec stage.
+	double		spawn_time;
+
+	/// time when the first output byte of the stage was seen, or -1 if
+	/// none was seen or the output is not observable.
+	double		first_byte_time;
+
+	/// time from fork() until the exec stage's child was reaped.
+	double		wall_time;
+
+	/// user CPU time of the exec stage's child as reported by wait4().
+	double		user_time;
+
+	/// system CPU time of the exec stage's child as reported by wait4().
+	double		sys_time;
+
+	/// number of bytes written into the stage.
+	unsigned long long bytes_in;
+
+	/// number of bytes read from the stage.
+	unsigned long long bytes_out;
+
+	/// Constructor clearing all counters.
+	StageStats();
+    };
+
+    /**
+     * Counters and timings of the whole pipe run.
+     */
+    struct Stats
+    {
+	/// total time spent in run().
+	double		wall_time;
+
+	/// number of select() calls of the event loop.
+	unsigned long	select_calls;
+
+	/// number of read() calls, including those of threaded stages.
+	unsigned long	read_calls;
+
+	/// number of write() calls, including those of threaded stages.
+	unsigned long	write_calls;
+
+	/// largest allocation of any internal ring buffer.
+	unsigned int	peak_buffer;
+
+	/// number of bytes written into the first stage.
+	unsigned long long bytes_in;
+
+	/// number of bytes read from the last stage.
+	unsigned long long bytes_out;
+
+	/// per-stage timings and traffic.
+	std::vector<StageStats> stages;
+
+	/// Constructor clearing all counters.
+	Stats();
+    };
+
+    /**
+     * Return performance counters and timings of the last run(). The
+     * reference is valid as long as the pipe exists.
+     */
+    const Stats& stats() const;
+
+    ///@}
 };
  
 } // namespace stx
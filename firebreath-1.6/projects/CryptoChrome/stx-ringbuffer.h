@@ -0,0 +1,237 @@
+// -*- mode: c++; fill-column: 79 -*-
+
+/*
+ * STX Execution Pipe Library v0.7.1
+ * Copyright (C) 2010 Timo Bingmann
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef _STX_RINGBUFFER_H_
+#define _STX_RINGBUFFER_H_
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SecureMemory.h"
+
+/// STX - Some Template Extensions namespace
+namespace stx {
+
+/**
+ * RingBuffer is a byte-oriented, pipe memory buffer which uses the underlying
+ * space in a circular fashion.
+ * 
+ * The input stream is write()en into the buffer as blocks of bytes, while the
+ * buffer is reallocated with exponential growth as needed.
+ *
+ * The first unread byte can be accessed using bottom(). The number of unread
+ * bytes at the ring buffers bottom position is queried by bottomsize(). This
+ * may not match the total number of unread bytes as returned by size(). After
+ * processing the bytes at bottom(), the unread cursor may be moved using
+ * advance().
+ *
+ * The ring buffer has the following two states.
+ * <pre>
+ * +------------------------------------------------------------------+
+ * | unused     |                 data   |               unused       |
+ * +------------+------------------------+----------------------------+
+ *              ^                        ^
+ *              m_bottom                 m_bottom+m_size
+ * </pre>
+ *
+ * or 
+ *
+ * <pre>
+ * +------------------------------------------------------------------+
+ * | more data  |                 unused               | data         |
+ * +------------+--------------------------------------+--------------+
+ *              ^                                      ^
+ *              m_bottom+m_size                        m_bottom
+ * </pre>
+ *
+ * The size of the whole buffer is m_buffsize.
+ *
+ * The buffer carries plaintext, so its memory comes from the SecureArena and
+ * is wiped whenever it is released, including the old buffer after growing.
+ */
+class RingBuffer
+{
+private:
+    /// pointer to allocated memory buffer
+    char*		m_data;
+
+    /// number of bytes allocated in m_data
+    unsigned int	m_buffsize;
+
+    /// number of unread bytes in ring buffer
+    unsigned int	m_size;
+
+    /// bottom pointer of unread area
+    unsigned int 	m_bottom;
+
+public:
+    /// Construct an empty ring buffer.
+    inline RingBuffer()
+	: m_data(NULL),
+	  m_buffsize(0), m_size(0), m_bottom(0)
+    {
+    }
+
+    /// Free the possibly used memory space.
+    inline ~RingBuffer()
+    {
+	if (m_data) SecureArena::instance().deallocate(m_data, m_buffsize);
+    }
+    
+    /// Return the current number of unread bytes.
+    inline unsigned int size() const
+    {
+	return m_size;
+    }
+
+    /// Return the current number of allocated bytes.
+    inline unsigned int buffsize() const
+    {
+	return m_buffsize;
+    }
+
+    /// Reset the ring buffer to empty.
+    inline void clear()
+    {
+	m_size = m_bottom = 0;
+    }
+
+    /// Reset the ring buffer to empty and wipe its memory, which is kept for
+    /// reuse.
+    inline void wipe()
+    {
+	if (m_data) secure_wipe(m_data, m_buffsize);
+	clear();
+    }
+
+    /**
+     * Return a pointer to the first unread element. Be warned that the buffer
+     * may not be linear, thus bottom()+size() might not be valid. You have to
+     * use bottomsize().
+     */
+    inline char* bottom() const
+    {
+	return m_data + m_bottom;
+    }
+
+    /// Return the number of bytes available at the bottom() place.
+    inline unsigned int bottomsize() const
+    {
+	return (m_bottom + m_size > m_buffsize)
+	    ? (m_buffsize - m_bottom)
+	    : (m_size);
+    }
+
+    /**
+     * Advance the internal read pointer n bytes, thus marking that amount of
+     * data as read.
+     */
+    inline void advance(unsigned int n)
+    {
+	assert(m_size >= n);
+	m_bottom += n;
+	m_size -= n;
+	if (m_bottom >= m_buffsize) m_bottom -= m_buffsize;
+    }
+
+    /**
+     * Write len bytes into the ring buffer at the top position, the buffer
+     * will grow if necessary.
+     */
+    void write(const void *src, unsigned int len)
+    {
+	if (len == 0) return;
+
+	if (m_buffsize < m_size + len)
+	{
+	    // won't fit, we have to grow the buffer, we'll grow the buffer to
+	    // twice the size.
+
+	    unsigned int newbuffsize = m_buffsize;
+	    while (newbuffsize < m_size + len)
+	    {
+		if (newbuffsize == 0) newbuffsize = 1024;
+		else newbuffsize = newbuffsize * 2;
+	    }
+
+	    // unlike realloc() this leaves no unwiped copy of the old contents
+	    char* newdata = static_cast<char*>(
+		SecureArena::instance().allocate(newbuffsize));
+
+	    if (m_bottom + m_size > m_buffsize)
+	    {
+		// copy the ringbuffer's head to the start and its tail to the
+		// new buffer end.
+
+		unsigned int taillen = m_buffsize - m_bottom;
+
+		memcpy(newdata, m_data, m_bottom + m_size - m_buffsize);
+		memcpy(newdata + newbuffsize - taillen,
+		       m_data + m_bottom, taillen);
+
+		m_bottom = newbuffsize - taillen;
+	    }
+	    else if (m_size > 0)
+	    {
+		memcpy(newdata + m_bottom, m_data + m_bottom, m_size);
+	    }
+
+	    if (m_data)
+		SecureArena::instance().deallocate(m_data, m_buffsize);
+
+	    m_data = newdata;
+	    m_buffsize = newbuffsize;
+	}
+
+	// block now fits into the buffer somehow
+
+	// check if the new memory fits into the middle space
+	if (m_bottom + m_size > m_buffsize)
+	{
+	    memcpy(m_data + m_bottom + m_size - m_buffsize, src, len);
+	    m_size += len;
+	}
+	else 
+	{
+	    // first fill up the buffer's tail, which has tailfit bytes room
+	    unsigned int tailfit = m_buffsize - (m_bottom + m_size);
+
+	    if (tailfit >= len)
+	    {
+		memcpy(m_data + m_bottom + m_size, src, len);
+		m_size += len;
+	    }
+	    else
+	    {
+		// doesn't fit into the tail alone, we have to break it up
+		memcpy(m_data + m_bottom + m_size, src, tailfit);
+		memcpy(m_data, reinterpret_cast<const char*>(src) + tailfit,
+		       len - tailfit);
+		m_size += len;
+	    }
+	}
+    }
+};
+
+} // namespace stx
+
+#endif // _STX_RINGBUFFER_H_
@@ -0,0 +1,452 @@
+/**********************************************************\
+
+  JsonValue.cpp
+
+\**********************************************************/
+
+#include "JsonValue.h"
+
+#include <algorithm>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Recursive descent parser over a complete JSON text.
+class JsonParser
+{
+public:
+    JsonParser(const std::string& text)
+        : m_text(text), m_pos(0)
+    {
+    }
+
+    bool parse(JsonValue& v, std::string& error)
+    {
+        bool ok = parse_value(v, 0);
+        skip_ws();
+
+        if (!ok || m_pos != m_text.size())
+        {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "Invalid JSON at offset %lu",
+                     static_cast<unsigned long>(m_pos));
+            error = buf;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const std::string& m_text;
+    std::string::size_type m_pos;
+
+    /// nesting limit to bound the recursion on hostile input
+    static const unsigned int max_depth = 64;
+
+    void skip_ws()
+    {
+        while (m_pos < m_text.size() &&
+               (m_text[m_pos] == ' ' || m_text[m_pos] == '\t' ||
+                m_text[m_pos] == '\n' || m_text[m_pos] == '\r'))
+            ++m_pos;
+    }
+
+    bool literal(const char* word)
+    {
+        std::string::size_type n = strlen(word);
+
+        if (m_text.compare(m_pos, n, word) != 0) return false;
+        m_pos += n;
+        return true;
+    }
+
+    bool parse_value(JsonValue& v, unsigned int depth)
+    {
+        skip_ws();
+        if (m_pos >= m_text.size() || depth > max_depth) return false;
+
+        switch (m_text[m_pos])
+        {
+        case '{':
+            return parse_object(v, depth);
+        case '[':
+            return parse_array(v, depth);
+        case '"':
+            v.m_type = JsonValue::STRING;
+            return parse_string(v.m_string);
+        case 't':
+            v = JsonValue(true);
+            return literal("true");
+        case 'f':
+            v = JsonValue(false);
+            return literal("false");
+        case 'n':
+            v = JsonValue();
+            return literal("null");
+        default:
+            return parse_number(v);
+        }
+    }
+
+    bool parse_object(JsonValue& v, unsigned int depth)
+    {
+        v = JsonValue::object();
+        ++m_pos;    // '{'
+
+        skip_ws();
+        if (m_pos < m_text.size() && m_text[m_pos] == '}') {
+            ++m_pos;
+            return true;
+        }
+
+        while (true)
+        {
+            std::string key;
+
+            skip_ws();
+            if (m_pos >= m_text.size() || m_text[m_pos] != '"' || !parse_string(key))
+                return false;
+
+            skip_ws();
+            if (m_pos >= m_text.size() || m_text[m_pos] != ':')
+                return false;
+            ++m_pos;
+
+            if (!parse_value(v.m_object[key], depth + 1))
+                return false;
+
+            skip_ws();
+            if (m_pos >= m_text.size()) return false;
+
+            if (m_text[m_pos] == ',') {
+                ++m_pos;
+            }
+            else if (m_text[m_pos] == '}') {
+                ++m_pos;
+                return true;
+            }
+            else {
+                return false;
+            }
+        }
+    }
+
+    bool parse_array(JsonValue& v, unsigned int depth)
+    {
+        v = JsonValue::array();
+        ++m_pos;    // '['
+
+        skip_ws();
+        if (m_pos < m_text.size() && m_text[m_pos] == ']') {
+            ++m_pos;
+            return true;
+        }
+
+        while (true)
+        {
+            v.m_array.push_back(JsonValue());
+            if (!parse_value(v.m_array.back(), depth + 1))
+                return false;
+
+            skip_ws();
+            if (m_pos >= m_text.size()) return false;
+
+            if (m_text[m_pos] == ',') {
+                ++m_pos;
+            }
+            else if (m_text[m_pos] == ']') {
+                ++m_pos;
+                return true;
+            }
+            else {
+                return false;
+            }
+        }
+    }
+
+    bool parse_hex4(unsigned long& cp)
+    {
+        if (m_pos + 4 > m_text.size()) return false;
+
+        cp = 0;
+        for (unsigned int i = 0; i < 4; ++i)
+        {
+            char c = m_text[m_pos++];
+            cp <<= 4;
+
+            if (c >= '0' && c <= '9') cp |= c - '0';
+            else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+
+    static void append_utf8(std::string& out, unsigned long cp)
+    {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        }
+        else if (cp < 0x800) {
+            out += static_cast<char>(0xc0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+        else if (cp < 0x10000) {
+            out += static_cast<char>(0xe0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+        else {
+            out += static_cast<char>(0xf0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+    }
+
+    bool parse_string(std::string& out)
+    {
+        ++m_pos;    // '"'
+
+        while (m_pos < m_text.size())
+        {
+            // copy runs of plain characters at once
+            std::string::size_type run = m_pos;
+            while (run < m_text.size() && m_text[run] != '"' && m_text[run] != '\\' &&
+                   static_cast<unsigned char>(m_text[run]) >= 0x20)
+                ++run;
+
+            out.append(m_text, m_pos, run - m_pos);
+            m_pos = run;
+
+            if (m_pos >= m_text.size()) return false;
+
+            char c = m_text[m_pos++];
+
+            if (c == '"') return true;
+            if (c != '\\') return false;    // unescaped control character
+            if (m_pos >= m_text.size()) return false;
+
+            switch (m_text[m_pos++])
+            {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u':
+            {
+                unsigned long cp;
+                if (!parse_hex4(cp)) return false;
+
+                if (cp >= 0xd800 && cp < 0xdc00)
+                {
+                    // high surrogate, must be followed by a low surrogate
+                    unsigned long lo;
+                    if (m_text.compare(m_pos, 2, "\\u") != 0) return false;
+                    m_pos += 2;
+                    if (!parse_hex4(lo) || lo < 0xdc00 || lo >= 0xe000) return false;
+
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                else if (cp >= 0xdc00 && cp < 0xe000) {
+                    return false;
+                }
+
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+    bool parse_number(JsonValue& v)
+    {
+        const char* begin = m_text.c_str() + m_pos;
+        const char* p = begin;
+
+        // check the JSON grammar, strtod accepts more
+        if (*p == '-') ++p;
+        if (*p < '0' || *p > '9') return false;
+        if (*p == '0') ++p;
+        else while (*p >= '0' && *p <= '9') ++p;
+        if (*p == '.') {
+            ++p;
+            if (*p < '0' || *p > '9') return false;
+            while (*p >= '0' && *p <= '9') ++p;
+        }
+        if (*p == 'e' || *p == 'E') {
+            ++p;
+            if (*p == '+' || *p == '-') ++p;
+            if (*p < '0' || *p > '9') return false;
+            while (*p >= '0' && *p <= '9') ++p;
+        }
+
+        v = JsonValue(strtod(begin, NULL));
+        m_pos += p - begin;
+        return true;
+    }
+};
+
+JsonValue JsonValue::array()
+{
+    JsonValue v;
+    v.m_type = ARRAY;
+    return v;
+}
+
+JsonValue JsonValue::object()
+{
+    JsonValue v;
+    v.m_type = OBJECT;
+    return v;
+}
+
+const JsonValue* JsonValue::get(const std::string& key) const
+{
+    if (m_type != OBJECT) return NULL;
+
+    Object::const_iterator it = m_object.find(key);
+    return (it != m_object.end()) ? &it->second : NULL;
+}
+
+JsonValue& JsonValue::operator[](const std::string& key)
+{
+    m_type = OBJECT;
+    return m_object[key];
+}
+
+JsonValue& JsonValue::push_back(const JsonValue& v)
+{
+    m_type = ARRAY;
+    m_array.push_back(v);
+    return m_array.back();
+}
+
+void JsonValue::take_string(std::string& s)
+{
+    m_type = STRING;
+    m_bool = false;
+    m_number = 0;
+    m_array.clear();
+    m_object.clear();
+
+    m_string.clear();
+    m_string.swap(s);
+}
+
+void JsonValue::swap(JsonValue& other)
+{
+    std::swap(m_type, other.m_type);
+    std::swap(m_bool, other.m_bool);
+    std::swap(m_number, other.m_number);
+    m_string.swap(other.m_string);
+    m_array.swap(other.m_array);
+    m_object.swap(other.m_object);
+}
+
+bool JsonValue::parse(const std::string& text, std::string& error)
+{
+    JsonValue v;
+    JsonParser parser(text);
+
+    if (!parser.parse(v, error))
+        return false;
+
+    swap(v);
+    return true;
+}
+
+static void write_string(const std::string& s, std::string& out)
+{
+    static const char* hex = "0123456789abcdef";
+
+    out += '"';
+
+    for (std::string::size_type i = 0; i < s.size(); ++i)
+    {
+        unsigned char c = s[i];
+
+        switch (c)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+            }
+            else {
+                out += static_cast<char>(c);
+            }
+        }
+    }
+
+    out += '"';
+}
+
+void JsonValue::write(std::string& out) const
+{
+    switch (m_type)
+    {
+    case NUL:
+        out += "null";
+        break;
+
+    case BOOLEAN:
+        out += m_bool ? "true" : "false";
+        break;
+
+    case NUMBER:
+    {
+        char buf[32];
+        if (m_number != m_number || m_number - m_number != 0)
+            snprintf(buf, sizeof(buf), "null");     // NaN and infinity
+        else if (m_number == floor(m_number) && fabs(m_number) < 1e15)
+            snprintf(buf, sizeof(buf), "%.0f", m_number);
+        else
+            snprintf(buf, sizeof(buf), "%.17g", m_number);
+        out += buf;
+        break;
+    }
+
+    case STRING:
+        write_string(m_string, out);
+        break;
+
+    case ARRAY:
+        out += '[';
+        for (Array::const_iterator it = m_array.begin(); it != m_array.end(); ++it)
+        {
+            if (it != m_array.begin()) out += ',';
+            it->write(out);
+        }
+        out += ']';
+        break;
+
+    case OBJECT:
+        out += '{';
+        for (Object::const_iterator it = m_object.begin(); it != m_object.end(); ++it)
+        {
+            if (it != m_object.begin()) out += ',';
+            write_string(it->first, out);
+            out += ':';
+            it->second.write(out);
+        }
+        out += '}';
+        break;
+    }
+}
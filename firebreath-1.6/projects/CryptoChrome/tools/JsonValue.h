@@ -0,0 +1,85 @@
+/**********************************************************\
+
+  JsonValue.h
+
+  Small JSON document type for the native messaging host. Numbers
+  are stored as double, strings as UTF-8.
+
+\**********************************************************/
+
+#ifndef H_JsonValue
+#define H_JsonValue
+
+#include <map>
+#include <string>
+#include <vector>
+
+class JsonValue
+{
+public:
+    enum Type
+    {
+        NUL,
+        BOOLEAN,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+
+    typedef std::vector<JsonValue> Array;
+    typedef std::map<std::string, JsonValue> Object;
+
+    JsonValue() : m_type(NUL), m_bool(false), m_number(0) {}
+    JsonValue(bool b) : m_type(BOOLEAN), m_bool(b), m_number(0) {}
+    JsonValue(double n) : m_type(NUMBER), m_bool(false), m_number(n) {}
+    JsonValue(const std::string& s) : m_type(STRING), m_bool(false), m_number(0), m_string(s) {}
+    JsonValue(const char* s) : m_type(STRING), m_bool(false), m_number(0), m_string(s) {}
+
+    /// Return an empty array or object.
+    static JsonValue array();
+    static JsonValue object();
+
+    Type type() const { return m_type; }
+
+    bool as_bool() const { return m_bool; }
+    double as_number() const { return m_number; }
+    const std::string& as_string() const { return m_string; }
+    const Array& as_array() const { return m_array; }
+    const Object& as_object() const { return m_object; }
+
+    /// Return the member key of an object, or NULL if there is none.
+    const JsonValue* get(const std::string& key) const;
+
+    /// Access a member of an object, adding it if necessary.
+    JsonValue& operator[](const std::string& key);
+
+    /// Append an element to an array and return the new element.
+    JsonValue& push_back(const JsonValue& v);
+
+    /// Make this a string value holding the text of s, which is taken
+    /// without copying and leaves s empty.
+    void take_string(std::string& s);
+
+    /// Exchange the contents with another value without copying strings.
+    void swap(JsonValue& other);
+
+    /// Parse a complete JSON text. Returns false and sets error if text is
+    /// not valid JSON.
+    bool parse(const std::string& text, std::string& error);
+
+    /// Append the serialization of this value to out.
+    void write(std::string& out) const;
+
+private:
+    friend class JsonParser;
+
+    Type m_type;
+    bool m_bool;
+    double m_number;
+    std::string m_string;
+    Array m_array;
+    Object m_object;
+};
+
+#endif // H_JsonValue
@@ -0,0 +1,476 @@
+/**********************************************************\
+
+  cryptochrome-cli.cpp
+
+  Command line driver for CryptoChromeCore, the same gpg code the
+  plugin ships, without a browser or FireBreath. Single operations
+  read stdin and write stdout, with gpg's messages on stderr; replay
+  runs a recorded workload with several threads and prints latency
+  percentiles and the core's counters as JSON lines.
+
+  Usage:
+    cryptochrome-cli [--gpg PATH] version
+    cryptochrome-cli [--gpg PATH] decrypt|clearsign < in > out
+    cryptochrome-cli [--gpg PATH] [--compress SPEC] encrypt|encrypt_sign RECIPIENT < in > out
+    cryptochrome-cli [--gpg PATH] [--compress SPEC] encrypt_file RECIPIENT[,RECIPIENT...] IN OUT
+    cryptochrome-cli [--gpg PATH] decrypt_file|sign_file IN OUT
+    cryptochrome-cli [--gpg PATH] [--compress SPEC] encrypt_container RECIPIENT[,RECIPIENT...] IN OUT
+    cryptochrome-cli [--gpg PATH] decrypt_container IN OUT
+    cryptochrome-cli [--gpg PATH] replay WORKLOAD [--threads N] [--repeat K]
+    cryptochrome-cli [--gpg PATH] agent
+    cryptochrome-cli [--gpg PATH] cache_ttl DEFAULT MAX
+
+  --compress sets gpg's compression for the encrypting operations:
+  auto (default, skipped for incompressible input), none, a level 0-9,
+  zip, zlib or bzip2, optionally with a level as in zlib:1.
+
+  A workload file lists one operation per line as
+  "op bytes [recipient] [interactive|prefetch|bulk]". Decrypt entries
+  need a recipient to prepare their ciphertext. Operations run in the
+  interactive class unless a priority is given. The lines "threads N"
+  and "repeat K" set the defaults for the replay. Lines starting with
+  # are ignored.
+
+  agent starts gpg-agent if necessary and prints its status, cache_ttl
+  sets its passphrase cache lifetimes in seconds and keeps them in
+  gpg-agent.conf.
+
+\**********************************************************/
+
+#include "CryptoChromeCore.h"
+#include "ThreadUtil.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+namespace {
+
+double timestamp()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void usage(const char* argv0)
+{
+    std::cerr << "Usage:" << std::endl
+              << "  " << argv0 << " [--gpg PATH] version" << std::endl
+              << "  " << argv0 << " [--gpg PATH] decrypt|clearsign < in > out" << std::endl
+              << "  " << argv0 << " [--gpg PATH] [--compress SPEC] encrypt|encrypt_sign RECIPIENT < in > out" << std::endl
+              << "  " << argv0 << " [--gpg PATH] [--compress SPEC] encrypt_file RECIPIENT[,RECIPIENT...] IN OUT" << std::endl
+              << "  " << argv0 << " [--gpg PATH] decrypt_file|sign_file IN OUT" << std::endl
+              << "  " << argv0 << " [--gpg PATH] [--compress SPEC] encrypt_container RECIPIENT[,RECIPIENT...] IN OUT" << std::endl
+              << "  " << argv0 << " [--gpg PATH] decrypt_container IN OUT" << std::endl
+              << "  " << argv0 << " [--gpg PATH] replay WORKLOAD [--threads N] [--repeat K]" << std::endl
+              << "  " << argv0 << " [--gpg PATH] agent" << std::endl
+              << "  " << argv0 << " [--gpg PATH] cache_ttl DEFAULT MAX" << std::endl;
+}
+
+// --- Workload replay -------------------------------------------------- //
+
+/// One recorded operation with its prepared input.
+struct Job
+{
+    CryptoChromeCore::Operation op;
+    JobScheduler::Priority prio;
+    std::string recipient;
+    std::string input;
+};
+
+/// Latency samples of one operation.
+struct Samples
+{
+    std::vector<double> latency;
+    unsigned int failures;
+    unsigned long long bytes;
+
+    Samples() : failures(0), bytes(0) {}
+};
+
+/// State shared by all replay threads.
+struct Replay
+{
+    CryptoChromeCore* core;
+    std::vector<Job> jobs;
+    unsigned int repeat;
+
+    Mutex lock;
+    unsigned int next;
+    std::map<std::string, Samples> samples;    // by "op/priority"
+
+    Replay() : core(NULL), repeat(1), next(0) {}
+};
+
+/// Return printable test data of the given size.
+std::string payload(unsigned int size)
+{
+    std::string data(size, ' ');
+    for (unsigned int i = 0; i < size; ++i)
+        data[i] = (i % 64 == 63) ? '\n' : static_cast<char>('a' + (i * 7) % 26);
+    return data;
+}
+
+void* replay_thread(void* arg)
+{
+    Replay* replay = static_cast<Replay*>(arg);
+    unsigned int total = replay->jobs.size() * replay->repeat;
+
+    while (true)
+    {
+        unsigned int n;
+        {
+            MutexLock lock(replay->lock);
+            if (replay->next >= total) break;
+            n = replay->next++;
+        }
+
+        const Job& job = replay->jobs[n % replay->jobs.size()];
+        std::string output;
+
+        double t0 = timestamp();
+        bool ok = (job.op == CryptoChromeCore::OP_DECRYPT)
+            ? replay->core->decrypt_armored(job.input, output, job.prio)
+            : replay->core->run(job.op, job.recipient, job.input, output, job.prio);
+        double t = timestamp() - t0;
+
+        MutexLock lock(replay->lock);
+        Samples& s = replay->samples[std::string(CryptoChromeCore::op_name(job.op)) + "/" +
+                                     JobScheduler::priority_name(job.prio)];
+        s.latency.push_back(t);
+        s.bytes += job.input.size();
+        if (!ok) {
+            ++s.failures;
+            std::cerr << CryptoChromeCore::op_name(job.op) << " failed: " << output << std::endl;
+        }
+    }
+
+    return NULL;
+}
+
+bool load_workload(const char* path, Replay& replay, unsigned int& threads)
+{
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open workload " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    unsigned int lineno = 0;
+
+    while (std::getline(in, line))
+    {
+        ++lineno;
+
+        std::istringstream iss(line);
+        std::string word;
+        if (!(iss >> word) || word[0] == '#') continue;
+
+        if (word == "threads") {
+            iss >> threads;
+            continue;
+        }
+        if (word == "repeat") {
+            iss >> replay.repeat;
+            continue;
+        }
+
+        Job job;
+        unsigned int size = 0;
+
+        if (!CryptoChromeCore::parse_op(word, job.op) || CryptoChromeCore::is_file_op(job.op) ||
+            !(iss >> size)) {
+            std::cerr << path << ":" << lineno << ": expected \"op bytes [recipient] [priority]\"" << std::endl;
+            return false;
+        }
+
+        job.prio = JobScheduler::INTERACTIVE;
+        while (iss >> word) {
+            if (!JobScheduler::parse_priority(word, job.prio))
+                job.recipient = word;
+        }
+
+        job.input = payload(size);
+
+        if (job.op == CryptoChromeCore::OP_DECRYPT)
+        {
+            // prepare the ciphertext outside of the measured replay
+            std::string crypt_txt;
+            if (!replay.core->run(CryptoChromeCore::OP_ENCRYPT, job.recipient, job.input, crypt_txt)) {
+                std::cerr << path << ":" << lineno << ": could not prepare ciphertext: " << crypt_txt << std::endl;
+                return false;
+            }
+            job.input.swap(crypt_txt);
+        }
+
+        replay.jobs.push_back(job);
+    }
+
+    if (replay.jobs.empty()) {
+        std::cerr << "Workload " << path << " contains no operations" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void report_samples(const std::string& op, Samples& s)
+{
+    if (s.latency.empty()) return;
+
+    std::sort(s.latency.begin(), s.latency.end());
+
+    double sum = 0;
+    for (unsigned int i = 0; i < s.latency.size(); ++i)
+        sum += s.latency[i];
+
+    std::cout << "{\"replay\":\"" << op << "\""
+              << ",\"count\":" << s.latency.size()
+              << ",\"failures\":" << s.failures
+              << ",\"bytes\":" << s.bytes
+              << ",\"mean_s\":" << sum / s.latency.size()
+              << ",\"p50_s\":" << s.latency[s.latency.size() / 2]
+              << ",\"p95_s\":" << s.latency[s.latency.size() * 95 / 100]
+              << ",\"max_s\":" << s.latency.back()
+              << "}" << std::endl;
+}
+
+void report_stats(CryptoChromeCore& core)
+{
+    CryptoChromeCore::StatsMap stats = core.stats();
+
+    for (CryptoChromeCore::StatsMap::const_iterator it = stats.begin();
+         it != stats.end(); ++it)
+    {
+        const CryptoChromeCore::OpStats& os = it->second;
+
+        std::cout << "{\"stats\":\"" << it->first << "\""
+                  << ",\"calls\":" << os.calls
+                  << ",\"failures\":" << os.failures
+                  << ",\"coalesced\":" << os.coalesced
+                  << ",\"cache_hits\":" << os.cache_hits
+                  << ",\"session_key_hits\":" << os.session_key_hits
+                  << ",\"queue_time\":" << os.queue_time
+                  << ",\"wall_time\":" << os.wall_time
+                  << ",\"spawn_time\":" << os.spawn_time
+                  << ",\"first_byte_time\":" << os.first_byte_time
+                  << ",\"user_time\":" << os.user_time
+                  << ",\"sys_time\":" << os.sys_time
+                  << ",\"bytes_in\":" << os.bytes_in
+                  << ",\"bytes_out\":" << os.bytes_out
+                  << ",\"select_calls\":" << os.select_calls
+                  << ",\"read_calls\":" << os.read_calls
+                  << ",\"write_calls\":" << os.write_calls
+                  << ",\"peak_buffer\":" << os.peak_buffer
+                  << "}" << std::endl;
+    }
+}
+
+int replay_workload(CryptoChromeCore& core, int argc, char* argv[], int argi)
+{
+    if (argi >= argc) return -1;
+
+    Replay replay;
+    replay.core = &core;
+
+    unsigned int threads = 1;
+    const char* path = argv[argi++];
+
+    if (!load_workload(path, replay, threads))
+        return 1;
+
+    for (; argi < argc; ++argi)
+    {
+        std::string arg = argv[argi];
+
+        if (arg == "--threads" && argi + 1 < argc)
+            threads = atoi(argv[++argi]);
+        else if (arg == "--repeat" && argi + 1 < argc)
+            replay.repeat = atoi(argv[++argi]);
+        else
+            return -1;
+    }
+
+    if (threads < 1) threads = 1;
+
+    // only measure the replay itself
+    core.reset_stats();
+
+    std::vector<pthread_t> tids(threads);
+    double t0 = timestamp();
+
+    for (unsigned int i = 0; i < threads; ++i)
+        pthread_create(&tids[i], NULL, &replay_thread, &replay);
+
+    for (unsigned int i = 0; i < threads; ++i)
+        pthread_join(tids[i], NULL);
+
+    double wall = timestamp() - t0;
+
+    unsigned int failures = 0;
+    for (std::map<std::string, Samples>::iterator it = replay.samples.begin();
+         it != replay.samples.end(); ++it) {
+        failures += it->second.failures;
+        report_samples(it->first, it->second);
+    }
+
+    unsigned int total = replay.jobs.size() * replay.repeat;
+
+    std::cout << "{\"replay\":\"total\""
+              << ",\"count\":" << total
+              << ",\"failures\":" << failures
+              << ",\"threads\":" << threads
+              << ",\"wall_s\":" << wall
+              << ",\"ops_per_s\":" << total / wall
+              << "}" << std::endl;
+
+    report_stats(core);
+
+    return failures ? 1 : 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    // gpg exiting before it read all input, e.g. for an unknown recipient,
+    // must surface as its exit code and messages, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    CryptoChromeCore core;
+    int argi = 1;
+
+    CryptoChromeCore::Compression compression;
+
+    while (argi + 1 < argc)
+    {
+        std::string opt = argv[argi];
+        if (opt == "--gpg")
+            core.set_gpg_path(argv[argi + 1]);
+        else if (opt == "--compress") {
+            if (!CryptoChromeCore::Compression::parse(argv[argi + 1], compression)) {
+                std::cerr << "Unknown compression " << argv[argi + 1] << std::endl;
+                return 1;
+            }
+        }
+        else
+            break;
+        argi += 2;
+    }
+
+    if (argi >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string cmd = argv[argi++];
+    int ret = -1;
+
+    if (cmd == "replay")
+    {
+        ret = replay_workload(core, argc, argv, argi);
+    }
+    else if (cmd == "version" && argi == argc)
+    {
+        std::cout << core.gpg_version();
+        ret = 0;
+    }
+    else if (cmd == "agent" && argi == argc)
+    {
+        std::string message;
+        if (!core.agent().ensure(message))
+            std::cerr << message << std::endl;
+
+        GpgAgent::Status st = core.agent().status();
+        std::cout << "running " << (st.running ? "yes" : "no") << std::endl
+                  << "pid " << st.pid << std::endl
+                  << "version " << st.version << std::endl
+                  << "default-cache-ttl " << st.default_cache_ttl << std::endl
+                  << "max-cache-ttl " << st.max_cache_ttl << std::endl;
+        ret = st.running ? 0 : 1;
+    }
+    else if (cmd == "cache_ttl" && argi + 2 == argc)
+    {
+        std::string message;
+        // asked for on the command line, so it stays after this process
+        bool ok = core.agent().set_cache_ttl(atol(argv[argi]), atol(argv[argi + 1]), true,
+                                             message);
+        if (!ok)
+            std::cerr << message << std::endl;
+        ret = ok ? 0 : 1;
+    }
+    else
+    {
+        CryptoChromeCore::Operation op;
+        std::string recipient;
+
+        if (CryptoChromeCore::parse_op(cmd, op) && CryptoChromeCore::is_file_op(op))
+        {
+            std::vector<std::string> recipients;
+
+            if ((op == CryptoChromeCore::OP_ENCRYPT_FILE ||
+                 op == CryptoChromeCore::OP_ENCRYPT_CONTAINER) && argi < argc) {
+                std::istringstream iss(argv[argi++]);
+                std::string r;
+                while (std::getline(iss, r, ','))
+                    recipients.push_back(r);
+            }
+
+            if (argi + 2 == argc)
+            {
+                std::string message;
+                bool ok = core.run_file(op, recipients, argv[argi], argv[argi + 1], message,
+                                        JobScheduler::INTERACTIVE, compression);
+                if (!ok)
+                    std::cerr << message << std::endl;
+                ret = ok ? 0 : 1;
+            }
+        }
+        else if (CryptoChromeCore::parse_op(cmd, op))
+        {
+            bool with_recipient = (op == CryptoChromeCore::OP_ENCRYPT ||
+                                   op == CryptoChromeCore::OP_ENCRYPT_SIGN);
+
+            if (with_recipient && argi + 1 == argc)
+                recipient = argv[argi++];
+
+            if (argi == argc && (!with_recipient || !recipient.empty()))
+            {
+                std::string input((std::istreambuf_iterator<char>(std::cin)),
+                                  std::istreambuf_iterator<char>());
+                std::string output, diagnostics;
+
+                bool ok = (op == CryptoChromeCore::OP_DECRYPT)
+                    ? core.decrypt_armored(input, output, JobScheduler::INTERACTIVE, &diagnostics)
+                    : core.run(op, recipient, input, output, JobScheduler::INTERACTIVE, compression,
+                               &diagnostics);
+                if (ok) {
+                    std::cout << output;
+                    std::cerr << diagnostics;
+                }
+                else {
+                    std::cerr << output;
+                }
+                ret = ok ? 0 : 1;
+            }
+        }
+    }
+
+    if (ret < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return ret;
+}
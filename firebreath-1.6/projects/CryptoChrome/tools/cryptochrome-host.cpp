@@ -0,0 +1,597 @@
+/**********************************************************\
+
+  cryptochrome-host.cpp
+
+  Native messaging host for the extension. It offers the methods of
+  CryptoChromeAPI without the NPAPI plugin: the browser starts the
+  host and exchanges messages with it over stdin and stdout, each a
+  32-bit length in native byte order followed by that many bytes of
+  UTF-8 JSON.
+
+  A request is {"id": ID, "method": NAME, "args": [...]}. The reply
+  carries the same id and either "result" or "error". Requests are
+  processed by a pool of worker threads, so many of them can be in
+  flight at once and replies arrive in completion order, not in
+  request order.
+
+  Usage: cryptochrome-host [--threads N] [--gpg PATH] [chrome-extension://...]
+
+  The browser passes the calling extension's origin as argument.
+
+\**********************************************************/
+
+#include "CryptoChromeCore.h"
+#include "JsonValue.h"
+#include "ThreadUtil.h"
+
+#include <deque>
+#include <map>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+/// largest request accepted, anything bigger is a broken stream
+const uint32_t max_request = 64 << 20;
+
+/// the browser refuses messages from the host above 1 MB
+const uint32_t max_reply = 1 << 20;
+
+/// Read exactly len bytes from fd. Returns false on EOF or error.
+bool read_full(int fd, void* buf, size_t len)
+{
+    char* p = static_cast<char*>(buf);
+
+    while (len > 0)
+    {
+        ssize_t rb = read(fd, p, len);
+
+        if (rb < 0 && errno == EINTR) continue;
+        if (rb <= 0) return false;
+
+        p += rb;
+        len -= rb;
+    }
+    return true;
+}
+
+/// Write exactly len bytes to fd. Returns false on error.
+bool write_full(int fd, const void* buf, size_t len)
+{
+    const char* p = static_cast<const char*>(buf);
+
+    while (len > 0)
+    {
+        ssize_t wb = write(fd, p, len);
+
+        if (wb < 0 && errno == EINTR) continue;
+        if (wb < 0) return false;
+
+        p += wb;
+        len -= wb;
+    }
+    return true;
+}
+
+class NativeHost
+{
+public:
+    NativeHost(unsigned int threads)
+        : m_threads(threads), m_eof(false), m_broken(false)
+    {
+    }
+
+    CryptoChromeCore& core() { return m_core; }
+
+    /// Read requests until stdin is closed, then wait for all replies.
+    /// Returns the process exit code.
+    int serve()
+    {
+        std::vector<pthread_t> tids(m_threads);
+        for (unsigned int i = 0; i < m_threads; ++i)
+            pthread_create(&tids[i], NULL, &NativeHost::worker_main, this);
+
+        int ret = 0;
+
+        while (true)
+        {
+            uint32_t len;
+            if (!read_full(STDIN_FILENO, &len, sizeof(len)))
+                break;
+
+            if (len > max_request) {
+                std::cerr << "cryptochrome-host: request of " << len << " bytes, giving up" << std::endl;
+                ret = 1;
+                break;
+            }
+
+            std::string text(len, '\0');
+            if (len > 0 && !read_full(STDIN_FILENO, &text[0], len)) {
+                std::cerr << "cryptochrome-host: truncated request" << std::endl;
+                ret = 1;
+                break;
+            }
+
+            MutexLock lock(m_queue_lock);
+            m_queue.push_back(std::string());
+            m_queue.back().swap(text);
+            m_queue_cond.signal();
+        }
+
+        {
+            MutexLock lock(m_queue_lock);
+            m_eof = true;
+            m_queue_cond.broadcast();
+        }
+
+        for (unsigned int i = 0; i < m_threads; ++i)
+            pthread_join(tids[i], NULL);
+
+        return (ret == 0 && m_broken) ? 1 : ret;
+    }
+
+private:
+    CryptoChromeCore m_core;
+    unsigned int m_threads;
+
+    /// raw requests waiting for a worker
+    Mutex m_queue_lock;
+    CondVar m_queue_cond;
+    std::deque<std::string> m_queue;
+    bool m_eof;
+
+    /// serializes the replies on stdout
+    Mutex m_output_lock;
+    bool m_broken;
+
+    static void* worker_main(void* arg)
+    {
+        static_cast<NativeHost*>(arg)->worker();
+        return NULL;
+    }
+
+    void worker()
+    {
+        while (true)
+        {
+            std::string text;
+            {
+                MutexLock lock(m_queue_lock);
+                while (m_queue.empty() && !m_eof)
+                    m_queue_cond.wait(m_queue_lock);
+
+                if (m_queue.empty()) return;
+
+                text.swap(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            JsonValue request;
+            std::string error;
+
+            if (!request.parse(text, error)) {
+                send(make_error(JsonValue(), error));
+                continue;
+            }
+
+            const JsonValue* id = request.get("id");
+            JsonValue result;
+
+            if (dispatch(request, result, error)) {
+                JsonValue reply = JsonValue::object();
+                reply["id"] = id ? *id : JsonValue();
+                reply["result"].swap(result);
+                send(reply);
+            }
+            else {
+                send(make_error(id ? *id : JsonValue(), error));
+            }
+        }
+    }
+
+    static JsonValue make_error(const JsonValue& id, const std::string& error)
+    {
+        JsonValue reply = JsonValue::object();
+        reply["id"] = id;
+        reply["error"] = error;
+        return reply;
+    }
+
+    /// Write one framed reply. Replies above the browser's limit are
+    /// replaced by an error so the caller is not left waiting.
+    void send(const JsonValue& reply)
+    {
+        std::string text;
+        reply.write(text);
+
+        if (text.size() > max_reply) {
+            const JsonValue* id = reply.get("id");
+            text.clear();
+            make_error(id ? *id : JsonValue(),
+                       "Reply exceeds the 1 MB native messaging limit").write(text);
+        }
+
+        uint32_t len = text.size();
+
+        MutexLock lock(m_output_lock);
+        if (m_broken) return;
+
+        if (!write_full(STDOUT_FILENO, &len, sizeof(len)) ||
+            !write_full(STDOUT_FILENO, text.data(), text.size()))
+        {
+            std::cerr << "cryptochrome-host: could not write reply: " << strerror(errno) << std::endl;
+            m_broken = true;
+        }
+    }
+
+    /// Make result the {ok, text} object of the methods which report
+    /// success and a message.
+    static void ok_text(JsonValue& result, bool ok, const std::string& text)
+    {
+        result = JsonValue::object();
+        result["ok"] = ok;
+        result["text"] = text;
+    }
+
+    /// Check that args holds n strings.
+    static bool string_args(const JsonValue::Array& args, unsigned int n)
+    {
+        if (args.size() != n) return false;
+        for (unsigned int i = 0; i < n; ++i)
+            if (args[i].type() != JsonValue::STRING) return false;
+        return true;
+    }
+
+    /// Check that args holds n non-negative numbers.
+    static bool number_args(const JsonValue::Array& args, unsigned int n)
+    {
+        if (args.size() != n) return false;
+        for (unsigned int i = 0; i < n; ++i)
+            if (args[i].type() != JsonValue::NUMBER || args[i].as_number() < 0) return false;
+        return true;
+    }
+
+    /// Convert an array of strings.
+    static bool string_list(const JsonValue& value, std::vector<std::string>& list,
+                            std::string& error)
+    {
+        const JsonValue::Array& array = value.as_array();
+
+        for (unsigned int i = 0; i < array.size(); ++i) {
+            if (array[i].type() != JsonValue::STRING) {
+                error = "Expected an array of strings";
+                return false;
+            }
+            list.push_back(array[i].as_string());
+        }
+        return true;
+    }
+
+    /// Parse the optional compression argument args[i].
+    static bool compression_arg(const JsonValue::Array& args, unsigned int i,
+                                CryptoChromeCore::Compression& compression, std::string& error)
+    {
+        if (args.size() <= i) return true;
+
+        if (args[i].type() != JsonValue::STRING ||
+            !CryptoChromeCore::Compression::parse(args[i].as_string(), compression))
+        {
+            error = "Unknown compression";
+            return false;
+        }
+        return true;
+    }
+
+    /// Run the method of a request, mirroring CryptoChromeAPI's methods and
+    /// their return values. Returns false on malformed requests.
+    bool dispatch(const JsonValue& request, JsonValue& result, std::string& error)
+    {
+        const JsonValue* method = request.get("method");
+        const JsonValue* args_value = request.get("args");
+
+        if (!method || method->type() != JsonValue::STRING) {
+            error = "Request without method";
+            return false;
+        }
+
+        static const JsonValue::Array no_args;
+        if (args_value && args_value->type() != JsonValue::ARRAY) {
+            error = "args must be an array";
+            return false;
+        }
+        const JsonValue::Array& args = args_value ? args_value->as_array() : no_args;
+
+        const std::string& name = method->as_string();
+
+        if (name == "gpg_version" && args.empty()) {
+            result = m_core.gpg_version();
+        }
+        else if (name == "set_gpg_path" && string_args(args, 1)) {
+            result = m_core.set_gpg_path(args[0].as_string());
+        }
+        else if (name == "set_gpg_profile" && args.size() == 2 &&
+                 args[0].type() == JsonValue::STRING && args[1].type() == JsonValue::ARRAY)
+        {
+            std::vector<std::string> options;
+            if (!string_list(args[1], options, error))
+                return false;
+
+            std::string message;
+            bool ok = m_core.set_profile(args[0].as_string(), options, message);
+            ok_text(result, ok, message);
+        }
+        else if (name == "remove_gpg_profile" && string_args(args, 1)) {
+            std::string message;
+            bool ok = m_core.remove_profile(args[0].as_string(), message);
+            ok_text(result, ok, message);
+        }
+        else if (name == "use_gpg_profile" && string_args(args, 2)) {
+            CryptoChromeCore::Operation op;
+            if (!CryptoChromeCore::parse_op(args[0].as_string(), op)) {
+                error = "Unknown operation " + args[0].as_string();
+                return false;
+            }
+
+            std::string message;
+            bool ok = m_core.use_profile(op, args[1].as_string(), message);
+            ok_text(result, ok, message);
+        }
+        else if (name == "gpg_profiles" && args.empty()) {
+            gpg_profiles(result);
+        }
+        else if (name == "decrypt" && string_args(args, 1)) {
+            std::string text = m_core.decrypt(args[0].as_string());
+            result.take_string(text);
+        }
+        else if ((name == "encrypt" || name == "encrypt_sign") &&
+                 (args.size() == 2 || args.size() == 3) &&
+                 args[0].type() == JsonValue::STRING && args[1].type() == JsonValue::STRING)
+        {
+            CryptoChromeCore::Compression compression;
+            if (!compression_arg(args, 2, compression, error))
+                return false;
+
+            std::string text = (name == "encrypt")
+                ? m_core.encrypt(args[0].as_string(), args[1].as_string(), compression)
+                : m_core.encrypt_sign(args[0].as_string(), args[1].as_string(), compression);
+            result.take_string(text);
+        }
+        else if (name == "clearsign" && string_args(args, 1)) {
+            std::string text = m_core.clearsign(args[0].as_string());
+            result.take_string(text);
+        }
+        else if (name == "decrypt_batch" && (args.size() == 1 || args.size() == 2) &&
+                 args[0].type() == JsonValue::ARRAY)
+        {
+            JobScheduler::Priority prio = JobScheduler::BULK;
+            if (args.size() == 2 && (args[1].type() != JsonValue::STRING ||
+                                     !JobScheduler::parse_priority(args[1].as_string(), prio)))
+            {
+                error = "decrypt_batch expects a priority of interactive, prefetch or bulk";
+                return false;
+            }
+
+            std::vector<std::string> blocks;
+            if (!string_list(args[0], blocks, error))
+                return false;
+
+            std::vector<CryptoChromeCore::Result> results;
+            m_core.decrypt_batch(blocks, results, prio);
+
+            result = JsonValue::array();
+            for (unsigned int i = 0; i < results.size(); ++i) {
+                JsonValue& entry = result.push_back(JsonValue::object());
+                entry["ok"] = results[i].ok;
+                entry["text"].take_string(results[i].output);
+                entry["diagnostics"].take_string(results[i].diagnostics);
+            }
+        }
+        else if (((name == "encrypt_file" || name == "encrypt_container") &&
+                  (args.size() == 3 || args.size() == 4) &&
+                  args[0].type() == JsonValue::ARRAY &&
+                  args[1].type() == JsonValue::STRING && args[2].type() == JsonValue::STRING) ||
+                 ((name == "decrypt_file" || name == "sign_file" ||
+                   name == "decrypt_container") && string_args(args, 2)))
+        {
+            CryptoChromeCore::Operation op;
+            CryptoChromeCore::parse_op(name, op);
+
+            bool encrypt = (op == CryptoChromeCore::OP_ENCRYPT_FILE ||
+                            op == CryptoChromeCore::OP_ENCRYPT_CONTAINER);
+
+            std::vector<std::string> recipients;
+            CryptoChromeCore::Compression compression;
+            if (encrypt && (!string_list(args[0], recipients, error) ||
+                            !compression_arg(args, 3, compression, error)))
+                return false;
+
+            // the chunks of a container must not crowd out interactive calls
+            JobScheduler::Priority prio =
+                (op == CryptoChromeCore::OP_ENCRYPT_CONTAINER ||
+                 op == CryptoChromeCore::OP_DECRYPT_CONTAINER)
+                ? JobScheduler::BULK : JobScheduler::INTERACTIVE;
+
+            unsigned int a = encrypt ? 1 : 0;
+            std::string message;
+            bool ok = m_core.run_file(op, recipients, args[a].as_string(), args[a+1].as_string(),
+                                      message, prio, compression);
+            ok_text(result, ok, message);
+        }
+        else if (name == "prefetch" && args.size() == 1 && args[0].type() == JsonValue::ARRAY) {
+            std::vector<std::string> blocks;
+            if (!string_list(args[0], blocks, error))
+                return false;
+
+            m_core.prefetch(blocks);
+            result = JsonValue();
+        }
+        else if (name == "clear_cache" && args.empty()) {
+            m_core.clear_cache();
+            result = JsonValue();
+        }
+        else if (name == "cancel_queued" && string_args(args, 1)) {
+            JobScheduler::Priority prio;
+            if (!JobScheduler::parse_priority(args[0].as_string(), prio)) {
+                error = "Unknown priority " + args[0].as_string();
+                return false;
+            }
+            result = static_cast<double>(m_core.scheduler().cancel_queued(prio));
+        }
+        else if (name == "agent_status" && args.empty()) {
+            agent_status(result);
+        }
+        else if (name == "agent_start" && args.empty()) {
+            std::string message;
+            bool ok = m_core.agent().ensure(message);
+            ok_text(result, ok, message);
+        }
+        else if (name == "set_agent_keepalive" && number_args(args, 1)) {
+            m_core.agent().set_keepalive(static_cast<unsigned int>(args[0].as_number()));
+            result = JsonValue();
+        }
+        else if (name == "set_cache_ttl" && number_args(args, 2)) {
+            std::string message;
+            bool ok = m_core.agent().set_cache_ttl(static_cast<long>(args[0].as_number()),
+                                                   static_cast<long>(args[1].as_number()),
+                                                   false, message);
+            ok_text(result, ok, message);
+        }
+        else if (name == "preset_passphrase" && string_args(args, 2)) {
+            const std::string& passphrase = args[1].as_string();
+            std::string message;
+            bool ok = m_core.agent().preset_passphrase(
+                args[0].as_string(), secure_string(passphrase.data(), passphrase.size()),
+                message);
+            ok_text(result, ok, message);
+        }
+        else if (name == "clear_passphrases" && args.empty()) {
+            m_core.agent().clear_passphrases();
+            result = JsonValue();
+        }
+        else if (name == "stats" && args.empty()) {
+            stats(result);
+        }
+        else if (name == "reset_stats" && args.empty()) {
+            m_core.reset_stats();
+            result = JsonValue();
+        }
+        else {
+            error = "Unknown method or bad arguments: " + name;
+            return false;
+        }
+
+        return true;
+    }
+
+    void agent_status(JsonValue& result)
+    {
+        GpgAgent::Status st = m_core.agent().status();
+        result = JsonValue::object();
+
+        result["running"] = st.running;
+        result["pid"] = static_cast<double>(st.pid);
+        result["version"] = st.version;
+        result["default_cache_ttl"] = static_cast<double>(st.default_cache_ttl);
+        result["max_cache_ttl"] = static_cast<double>(st.max_cache_ttl);
+        result["presets"] = static_cast<double>(st.presets);
+        result["restarts"] = static_cast<double>(st.restarts);
+        result["last_check"] = st.last_check;
+        result["keepalive"] = static_cast<double>(m_core.agent().keepalive());
+    }
+
+    void gpg_profiles(JsonValue& result)
+    {
+        CryptoChromeCore::ProfileMap profiles;
+        std::map<std::string, std::string> operations;
+        m_core.profiles(profiles, operations);
+
+        result = JsonValue::object();
+        JsonValue& defined = result["profiles"] = JsonValue::object();
+        for (CryptoChromeCore::ProfileMap::const_iterator it = profiles.begin();
+             it != profiles.end(); ++it)
+        {
+            JsonValue& options = defined[it->first] = JsonValue::array();
+            for (unsigned int i = 0; i < it->second.size(); ++i)
+                options.push_back(it->second[i]);
+        }
+
+        JsonValue& applied = result["operations"] = JsonValue::object();
+        for (std::map<std::string, std::string>::const_iterator it = operations.begin();
+             it != operations.end(); ++it)
+        {
+            applied[it->first] = it->second;
+        }
+    }
+
+    void stats(JsonValue& result)
+    {
+        CryptoChromeCore::StatsMap stats = m_core.stats();
+        result = JsonValue::object();
+
+        for (CryptoChromeCore::StatsMap::const_iterator it = stats.begin();
+             it != stats.end(); ++it)
+        {
+            const CryptoChromeCore::OpStats& os = it->second;
+            JsonValue& m = result[it->first];
+
+            m["calls"] = os.calls;
+            m["failures"] = os.failures;
+            m["coalesced"] = os.coalesced;
+            m["cache_hits"] = os.cache_hits;
+            m["session_key_hits"] = os.session_key_hits;
+            m["queue_time"] = os.queue_time;
+            m["wall_time"] = os.wall_time;
+            m["spawn_time"] = os.spawn_time;
+            m["first_byte_time"] = os.first_byte_time;
+            m["user_time"] = os.user_time;
+            m["sys_time"] = os.sys_time;
+            m["bytes_in"] = os.bytes_in;
+            m["bytes_out"] = os.bytes_out;
+            m["select_calls"] = os.select_calls;
+            m["read_calls"] = os.read_calls;
+            m["write_calls"] = os.write_calls;
+            m["peak_buffer"] = os.peak_buffer;
+        }
+    }
+};
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    unsigned int threads = 4;
+    std::string gpg;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--threads" && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (arg == "--gpg" && i + 1 < argc)
+            gpg = argv[++i];
+        else if (arg.compare(0, 19, "chrome-extension://") == 0 || arg.compare(0, 9, "--parent-") == 0)
+            continue;   // caller origin and window handle from the browser
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--threads N] [--gpg PATH]" << std::endl;
+            return 1;
+        }
+    }
+
+    // a closed browser side must surface as a write error, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    NativeHost host(threads < 1 ? 1 : threads);
+    if (!gpg.empty())
+        host.core().set_gpg_path(gpg);
+
+    return host.serve();
+}
@@ -0,0 +1,877 @@
+/**********************************************************\
+
+  execpipe-bench.cpp
+
+  Throughput and latency benchmarks for stx::ExecPipe, the RingBuffer,
+  the armor parser and the gpg round trips done by CryptoChromeCore. Each result is
+  printed as one JSON object per line, so runs can be collected and
+  compared for regression tracking.
+
+  Usage: execpipe-bench [--quick] [--no-gpg] [--gpg PATH]
+         execpipe-bench --stress PIPES [--threads N]
+
+  --stress runs PIPES pipes from N threads at once instead of the
+  benchmarks, and fails if any of them lost data.
+
+\**********************************************************/
+
+#include "stx-execpipe.h"
+#include "stx-ringbuffer.h"
+#include "CryptoChromeCore.h"
+#include "PgpArmor.h"
+#include "ThreadUtil.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+/// scale factor for all payloads and repetitions, reduced by --quick
+unsigned int g_scale = 8;
+
+double timestamp()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/// Print one result line. params is a JSON fragment describing the setup.
+void report(const std::string& bench, const std::string& params,
+            std::vector<double> times, unsigned long long bytes)
+{
+    std::sort(times.begin(), times.end());
+
+    double sum = 0;
+    for (unsigned int i = 0; i < times.size(); ++i)
+        sum += times[i];
+
+    double median = times[times.size() / 2];
+
+    std::ostringstream oss;
+    oss << "{\"bench\":\"" << bench << "\"";
+    if (!params.empty())
+        oss << "," << params;
+    oss << ",\"reps\":" << times.size()
+        << ",\"min_s\":" << times.front()
+        << ",\"median_s\":" << median
+        << ",\"mean_s\":" << sum / times.size()
+        << ",\"bytes\":" << bytes;
+    if (bytes > 0 && median > 0)
+        oss << ",\"mb_per_s\":" << bytes / median / 1e6;
+    oss << "}";
+
+    std::cout << oss.str() << std::endl;
+}
+
+unsigned int reps_for(unsigned long long payload)
+{
+    unsigned long long reps = (g_scale * 8ULL << 20) / (payload + 1);
+    return static_cast<unsigned int>(std::max(3ULL, std::min(50ULL, reps)));
+}
+
+// --- RingBuffer ------------------------------------------------------- //
+
+void bench_ringbuffer()
+{
+    static const unsigned int blocks[] = { 16, 256, 4096, 65536 };
+    unsigned long long total = g_scale * 8ULL << 20;
+
+    for (unsigned int b = 0; b < sizeof(blocks) / sizeof(blocks[0]); ++b)
+    {
+        std::vector<char> block(blocks[b], 'x');
+        std::vector<double> times;
+
+        for (unsigned int r = 0; r < 5; ++r)
+        {
+            stx::RingBuffer rb;
+            double t0 = timestamp();
+
+            for (unsigned long long done = 0; done < total; done += block.size())
+            {
+                rb.write(&block[0], block.size());
+
+                // consume like a pipe reader once a megabyte is pending
+                while (rb.size() > (1 << 20))
+                    rb.advance(rb.bottomsize());
+            }
+
+            times.push_back(timestamp() - t0);
+        }
+
+        std::ostringstream params;
+        params << "\"block\":" << blocks[b];
+        report("ringbuffer_write_advance", params.str(), times, total);
+    }
+}
+
+// --- PgpArmor --------------------------------------------------------- //
+
+/// Armor binary data of the given size like gpg does, with a checksum.
+std::string make_armor(unsigned long long size)
+{
+    static const char* alphabet =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string data(size, '\0');
+    for (unsigned long long i = 0; i < size; ++i)
+        data[i] = static_cast<char>(i * 131 + (i >> 8));
+
+    unsigned long crc = PgpArmor::crc24(PgpArmor::crc24_init,
+                                        reinterpret_cast<const unsigned char*>(data.data()),
+                                        data.size());
+    std::string bytes = data;
+    std::string out = "-----BEGIN PGP MESSAGE-----\n\n";
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        std::string line;
+        for (unsigned long long i = 0; i < bytes.size(); i += 3)
+        {
+            unsigned long v = static_cast<unsigned char>(bytes[i]) << 16;
+            if (i + 1 < bytes.size()) v |= static_cast<unsigned char>(bytes[i+1]) << 8;
+            if (i + 2 < bytes.size()) v |= static_cast<unsigned char>(bytes[i+2]);
+
+            line += alphabet[(v >> 18) & 63];
+            line += alphabet[(v >> 12) & 63];
+            line += (i + 1 < bytes.size()) ? alphabet[(v >> 6) & 63] : '=';
+            line += (i + 2 < bytes.size()) ? alphabet[v & 63] : '=';
+
+            if (line.size() == 64) {
+                out += line + "\n";
+                line.clear();
+            }
+        }
+        if (!line.empty()) out += line + "\n";
+
+        if (pass == 0) {
+            // second pass encodes the checksum
+            bytes.clear();
+            bytes += static_cast<char>(crc >> 16);
+            bytes += static_cast<char>(crc >> 8);
+            bytes += static_cast<char>(crc);
+            out += "=";
+        }
+    }
+
+    return out + "-----END PGP MESSAGE-----\n";
+}
+
+void bench_armor()
+{
+    static const unsigned long long payloads[] = { 1 << 10, 64 << 10, 1 << 20 };
+
+    for (unsigned int p = 0; p < sizeof(payloads) / sizeof(payloads[0]); ++p)
+    {
+        std::string text = make_armor(payloads[p]);
+        std::vector<double> times;
+
+        for (unsigned int r = 0; r < reps_for(text.size()); ++r)
+        {
+            std::vector<PgpArmor::Block> blocks;
+            std::string error;
+
+            double t0 = timestamp();
+            PgpArmor::split(text, blocks);
+            bool ok = (blocks.size() == 1 && PgpArmor::check(text, blocks[0], error));
+            times.push_back(timestamp() - t0);
+
+            if (!ok)
+                throw std::runtime_error("armor check failed: " + error);
+        }
+
+        std::ostringstream params;
+        params << "\"payload\":" << payloads[p];
+        report("armor_check", params.str(), times, text.size());
+    }
+}
+
+/// Armor lines quoted in a reply or dash-escaped in a clearsigned text must
+/// neither start nor end a block.
+void bench_armor_quoted()
+{
+    std::string message = make_armor(1 << 10);
+    std::string signature = message;
+    signature.replace(signature.find("MESSAGE"), 7, "SIGNATURE");
+    signature.replace(signature.rfind("MESSAGE"), 7, "SIGNATURE");
+
+    std::string text =
+        "> -----BEGIN PGP MESSAGE-----\n> \n> hQEMA+quoted\n> -----END PGP MESSAGE-----\n\n"
+        "-----BEGIN PGP SIGNED MESSAGE-----\nHash: SHA256\n\n"
+        "- -----END PGP SIGNATURE-----\n- -----BEGIN PGP MESSAGE-----\n"
+        + signature + "\n" + message;
+
+    std::vector<double> times;
+
+    for (unsigned int r = 0; r < reps_for(text.size()); ++r)
+    {
+        std::vector<PgpArmor::Block> blocks;
+        std::string error;
+
+        double t0 = timestamp();
+        PgpArmor::split(text, blocks);
+        bool ok = (blocks.size() == 2 &&
+                   blocks[0].type == "SIGNED MESSAGE" && blocks[1].type == "MESSAGE" &&
+                   PgpArmor::check(text, blocks[0], error) &&
+                   PgpArmor::check(text, blocks[1], error));
+        times.push_back(timestamp() - t0);
+
+        if (!ok)
+            throw std::runtime_error("quoted armor check failed: " + error);
+    }
+
+    std::ostringstream params;
+    params << "\"payload\":" << (1 << 10);
+    report("armor_quoted", params.str(), times, text.size());
+}
+
+// --- ExecPipe --------------------------------------------------------- //
+
+/// Input source which generates a payload in fixed-size chunks.
+class ChunkSource : public stx::PipeSource
+{
+public:
+    ChunkSource(unsigned long long size, unsigned int chunk)
+        : m_left(size), m_chunk(chunk, 'x')
+    {
+    }
+
+    virtual bool poll()
+    {
+        if (m_left == 0) return false;
+
+        unsigned int n = static_cast<unsigned int>(std::min<unsigned long long>(m_left, m_chunk.size()));
+        write(&m_chunk[0], n);
+        m_left -= n;
+        return true;
+    }
+
+private:
+    unsigned long long m_left;
+    std::vector<char> m_chunk;
+};
+
+/// Function stage which forwards its input unchanged.
+class CopyFunction : public stx::PipeFunction
+{
+public:
+    virtual void process(const void* data, unsigned int datalen)
+    {
+        write(data, datalen);
+    }
+
+    virtual void eof()
+    {
+    }
+};
+
+/// Sink which appends everything to a string.
+class StringSink : public stx::PipeSink
+{
+public:
+    explicit StringSink(std::string& output)
+        : m_output(output)
+    {
+    }
+
+    virtual void process(const void* data, unsigned int datalen)
+    {
+        m_output.append(static_cast<const char*>(data), datalen);
+    }
+
+    virtual void eof()
+    {
+    }
+
+private:
+    std::string& m_output;
+};
+
+void bench_spawn()
+{
+    std::vector<double> times;
+
+    for (unsigned int r = 0; r < 10 * g_scale; ++r)
+    {
+        stx::ExecPipe ep;
+        ep.add_execp("true");
+
+        double t0 = timestamp();
+        ep.run();
+        times.push_back(timestamp() - t0);
+    }
+
+    report("execpipe_true", "", times, 0);
+}
+
+void bench_cat_string()
+{
+    static const unsigned long long payloads[] = { 0, 1 << 10, 64 << 10, 1 << 20, 16 << 20 };
+
+    for (unsigned int p = 0; p < sizeof(payloads) / sizeof(payloads[0]); ++p)
+    {
+        unsigned long long payload = payloads[p] * g_scale / 8;
+        std::string input(payload, 'x');
+        std::vector<double> times;
+
+        for (unsigned int r = 0; r < reps_for(payload); ++r)
+        {
+            std::string output;
+
+            stx::ExecPipe ep;
+            ep.set_input_string(&input);
+            ep.add_execp("cat");
+            ep.set_output_string(&output);
+
+            double t0 = timestamp();
+            ep.run();
+            times.push_back(timestamp() - t0);
+
+            if (output.size() != input.size())
+                throw std::runtime_error("cat returned a short output");
+        }
+
+        std::ostringstream params;
+        params << "\"payload\":" << payload;
+        report("execpipe_cat_string", params.str(), times, payload);
+    }
+}
+
+void bench_cat_source()
+{
+    static const unsigned int chunks[] = { 512, 4096, 65536 };
+    unsigned long long payload = g_scale * 2ULL << 20;
+
+    for (unsigned int c = 0; c < sizeof(chunks) / sizeof(chunks[0]); ++c)
+    {
+        std::vector<double> times;
+
+        for (unsigned int r = 0; r < reps_for(payload); ++r)
+        {
+            std::string output;
+            ChunkSource source(payload, chunks[c]);
+
+            stx::ExecPipe ep;
+            ep.set_input_source(&source);
+            ep.add_execp("cat");
+            ep.set_output_string(&output);
+
+            double t0 = timestamp();
+            ep.run();
+            times.push_back(timestamp() - t0);
+        }
+
+        std::ostringstream params;
+        params << "\"payload\":" << payload << ",\"chunk\":" << chunks[c];
+        report("execpipe_cat_source", params.str(), times, payload);
+    }
+}
+
+/// File input read by cat itself and passed from a mapping.
+void bench_cat_file()
+{
+    unsigned long long payload = g_scale * 8ULL << 20;
+
+    char path[] = "/tmp/execpipe-bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        throw std::runtime_error(std::string("Could not create a temporary file: ") + strerror(errno));
+
+    std::string block(1 << 20, 'x');
+    for (unsigned long long done = 0; done < payload; done += block.size()) {
+        if (write(fd, block.data(), block.size()) != (ssize_t)block.size()) {
+            close(fd);
+            unlink(path);
+            throw std::runtime_error(std::string("Could not write a temporary file: ") + strerror(errno));
+        }
+    }
+
+    for (int mapped = 0; mapped < 2; ++mapped)
+    {
+        std::vector<double> times;
+
+        for (unsigned int r = 0; r < reps_for(payload); ++r)
+        {
+            stx::ExecPipe ep;
+            if (mapped)
+                ep.set_input_mapped(fd, 0, payload);
+            else
+                ep.set_input_file(path);
+            ep.add_execp("cat");
+            ep.set_output_file("/dev/null");
+
+            double t0 = timestamp();
+            ep.run();
+            times.push_back(timestamp() - t0);
+        }
+
+        std::ostringstream params;
+        params << "\"payload\":" << payload << ",\"mapped\":" << (mapped ? "true" : "false");
+        report("execpipe_cat_file", params.str(), times, payload);
+    }
+
+    close(fd);
+    unlink(path);
+}
+
+void bench_pipe_reuse()
+{
+    unsigned long long payload = 4 << 10;
+    std::string input(payload, 'x');
+    std::vector<std::string> args(1, "cat");
+
+    for (int reused = 0; reused < 2; ++reused)
+    {
+        std::vector<double> times;
+        CopyFunction func;
+        stx::ExecPipe kept;
+
+        // setting up the pipe is part of each call on the hot path
+        for (unsigned int r = 0; r < reps_for(payload); ++r)
+        {
+            std::string output;
+            double t0 = timestamp();
+
+            stx::ExecPipe ep = reused ? kept : stx::ExecPipe();
+            if (reused && r > 0)
+                ep.reset();
+            if (!reused || r == 0) {
+                ep.add_execp(&args);
+                ep.add_function(&func);
+            }
+            ep.set_input_string(&input);
+            ep.set_output_string(&output);
+            ep.run();
+            times.push_back(timestamp() - t0);
+
+            if (output.size() != input.size())
+                throw std::runtime_error("cat returned a short output");
+        }
+
+        std::ostringstream params;
+        params << "\"payload\":" << payload << ",\"reused\":" << (reused ? "true" : "false");
+        report("execpipe_reuse", params.str(), times, payload);
+    }
+}
+
+/// Run pipes while the process has no stdin and stdout, as a host started
+/// with them closed, so the pipes themselves take those numbers. Fails if
+/// the stage's stdin, stdout or stderr end up on the wrong pipe.
+void bench_closed_stdio()
+{
+    unsigned long long payload = 64 << 10;
+    std::string input(payload, 'x');
+    std::vector<double> times;
+
+    int saved_in = dup(STDIN_FILENO), saved_out = dup(STDOUT_FILENO);
+    if (saved_in < 0 || saved_out < 0)
+        throw std::runtime_error(std::string("Could not save stdio: ") + strerror(errno));
+
+    for (unsigned int r = 0; r < reps_for(payload); ++r)
+    {
+        std::string output, messages, status;
+        StringSink message_sink(messages), status_sink(status);
+        std::vector<std::string> args;
+        std::string error;
+
+        close(STDIN_FILENO);
+        close(STDOUT_FILENO);
+
+        double t0 = timestamp();
+        try {
+            // the extra pipe is created first and gets the free numbers,
+            // like gpg's --status-fd
+            stx::ExecPipe ep;
+            args.push_back("sh");
+            args.push_back("-c");
+            ep.set_input_string(&input);
+            ep.add_execp(&args);
+
+            std::ostringstream script;
+            script << "cat; echo done >&2; echo status >&" << ep.add_fd_output(&status_sink);
+            args.push_back(script.str());
+
+            ep.add_stderr_output(&message_sink);
+            ep.set_output_string(&output);
+            ep.run();
+        }
+        catch (std::runtime_error &e) {
+            error = e.what();
+        }
+        times.push_back(timestamp() - t0);
+
+        dup2(saved_in, STDIN_FILENO);
+        dup2(saved_out, STDOUT_FILENO);
+
+        if (!error.empty())
+            throw std::runtime_error(error);
+        if (output != input || messages != "done\n" || status != "status\n")
+            throw std::runtime_error("Pipe with closed stdio mixed up its streams");
+    }
+
+    close(saved_in);
+    close(saved_out);
+
+    std::ostringstream params;
+    params << "\"payload\":" << payload;
+    report("execpipe_closed_stdio", params.str(), times, payload);
+}
+
+void bench_function_stage()
+{
+    unsigned long long payload = g_scale * 2ULL << 20;
+    std::string input(payload, 'x');
+
+    for (int threaded = 0; threaded < 2; ++threaded)
+    {
+        std::vector<double> times;
+
+        for (unsigned int r = 0; r < reps_for(payload); ++r)
+        {
+            std::string output;
+            CopyFunction func;
+
+            stx::ExecPipe ep;
+            ep.set_input_string(&input);
+            ep.add_execp("cat");
+            ep.add_function(&func, threaded != 0);
+            ep.add_execp("cat");
+            ep.set_output_string(&output);
+
+            double t0 = timestamp();
+            ep.run();
+            times.push_back(timestamp() - t0);
+        }
+
+        std::ostringstream params;
+        params << "\"payload\":" << payload << ",\"threaded\":" << (threaded ? "true" : "false");
+        report("execpipe_function_stage", params.str(), times, payload);
+    }
+}
+
+// --- Concurrency stress ---------------------------------------------- //
+
+/// State shared by the stress threads.
+struct StressRun
+{
+    unsigned int pipes_per_thread;
+
+    /// pipes which are only copied, whose reference counts are changed by
+    /// all threads at once.
+    std::vector<stx::ExecPipe> shared;
+
+    AtomicCounter failures;
+};
+
+AtomicCounter g_debug_lines;
+
+void count_debug_line(const char*)
+{
+    g_debug_lines.fetch_add(1);
+}
+
+void* stress_thread(void* arg)
+{
+    StressRun* run = static_cast<StressRun*>(arg);
+
+    for (unsigned int i = 0; i < run->pipes_per_thread; ++i)
+    {
+        std::string input((i * 7919) % (64 << 10), 'x'), output;
+        CopyFunction func;
+
+        stx::ExecPipe ep;
+        ep.set_debug_output(count_debug_line);
+        ep.set_input_string(&input);
+        ep.add_execp("cat");
+        ep.add_function(&func, i % 2 != 0);
+        ep.add_execp("cat");
+        ep.set_output_string(&output);
+
+        for (unsigned int c = 0; c < 64; ++c) {
+            stx::ExecPipe copy = run->shared[(i + c) % run->shared.size()];
+            stx::ExecPipe other(copy);
+            copy = ep;
+        }
+
+        try {
+            ep.run();
+            if (output != input || !ep.all_return_codes_zero())
+                run->failures.fetch_add(1);
+        }
+        catch (std::runtime_error &e) {
+            std::cerr << "Stress pipe failed: " << e.what() << std::endl;
+            run->failures.fetch_add(1);
+        }
+    }
+
+    return NULL;
+}
+
+/// Run pipes from many threads at once. Returns false if any pipe failed.
+bool stress(unsigned int pipes, unsigned int threads)
+{
+    StressRun run;
+    run.pipes_per_thread = (pipes + threads - 1) / threads;
+    run.shared.resize(8);
+
+    double t0 = timestamp();
+
+    std::vector<pthread_t> tids(threads);
+    unsigned int started = 0;
+    for (; started < threads; ++started) {
+        if (pthread_create(&tids[started], NULL, stress_thread, &run) != 0)
+            break;
+    }
+    for (unsigned int t = 0; t < started; ++t)
+        pthread_join(tids[t], NULL);
+
+    if (started < threads)
+        run.failures.fetch_add(1);
+
+    std::cout << "{\"bench\":\"execpipe_stress\""
+              << ",\"threads\":" << started
+              << ",\"pipes\":" << started * run.pipes_per_thread
+              << ",\"wall_s\":" << timestamp() - t0
+              << ",\"debug_lines\":" << g_debug_lines.value()
+              << ",\"failures\":" << run.failures.value() << "}" << std::endl;
+
+    return run.failures.value() == 0;
+}
+
+// --- gpg round trips -------------------------------------------------- //
+
+/// Throwaway GNUPGHOME with a freshly generated, unprotected test key.
+class GpgHome
+{
+public:
+    GpgHome(const std::string& gpg)
+        : m_gpg(gpg)
+    {
+        char tmpl[] = "/tmp/cryptochrome-bench-XXXXXX";
+        if (!mkdtemp(tmpl))
+            throw std::runtime_error(std::string("Could not create GNUPGHOME: ") + strerror(errno));
+
+        m_home = tmpl;
+        setenv("GNUPGHOME", m_home.c_str(), 1);
+
+        std::string params =
+            "%no-protection\n"
+            "Key-Type: RSA\n"
+            "Key-Length: 2048\n"
+            "Subkey-Type: RSA\n"
+            "Subkey-Length: 2048\n"
+            "Name-Real: CryptoChrome Bench\n"
+            "Name-Email: " + recipient() + "\n"
+            "Expire-Date: 0\n"
+            "%commit\n";
+
+        stx::ExecPipe ep;
+        ep.set_input_string(&params);
+        ep.add_execp(m_gpg.c_str(), "--batch", "--quiet", "--gen-key");
+        ep.run();
+
+        if (!ep.all_return_codes_zero())
+            throw std::runtime_error("Could not generate the benchmark key");
+    }
+
+    ~GpgHome()
+    {
+        stx::ExecPipe agent;
+        agent.add_execp("gpgconf", "--kill", "gpg-agent");
+
+        stx::ExecPipe rm;
+        rm.add_execp("rm", "-rf", m_home.c_str());
+
+        try {
+            agent.run();
+            rm.run();
+        }
+        catch (std::runtime_error &e) {
+            std::cerr << "Could not clean up " << m_home << ": " << e.what() << std::endl;
+        }
+    }
+
+    std::string recipient() const
+    {
+        return "bench@cryptochrome.invalid";
+    }
+
+    /// Path of a scratch file inside the home directory.
+    std::string path(const std::string& name) const
+    {
+        return m_home + "/" + name;
+    }
+
+private:
+    std::string m_gpg;
+    std::string m_home;
+};
+
+/// Run an operation through the same CryptoChromeCore the plugin uses.
+std::string gpg_op(CryptoChromeCore& core, const std::string& op_name,
+                   const std::string& recipient, const std::string& input)
+{
+    CryptoChromeCore::Operation op;
+    if (!CryptoChromeCore::parse_op(op_name, op))
+        throw std::runtime_error("unknown operation " + op_name);
+
+    std::string output;
+    if (!core.run(op, recipient, input, output))
+        throw std::runtime_error("gpg " + op_name + " failed: " + output);
+
+    return output;
+}
+
+/// Encrypt and decrypt a file through the fd-based file operations.
+void bench_gpg_file(CryptoChromeCore& core, const GpgHome& home)
+{
+    unsigned long long payload = g_scale * 8ULL << 20;
+    std::string clear_path = home.path("clear.bin");
+    std::string crypt_path = home.path("crypt.gpg");
+    std::string out_path = home.path("out.bin");
+
+    {
+        // text-like content, compressible as most attachments are
+        std::string data;
+        for (unsigned int i = 0; data.size() < payload; ++i)
+            data += "line " + std::string(i % 64, 'a' + i % 26) + "\n";
+        data.resize(payload);
+
+        stx::ExecPipe ep;
+        ep.set_input_string(&data);
+        ep.add_execp("cat");
+        ep.set_output_file(clear_path.c_str());
+        ep.run();
+    }
+
+    static const CryptoChromeCore::Operation ops[] = {
+        CryptoChromeCore::OP_ENCRYPT_FILE, CryptoChromeCore::OP_DECRYPT_FILE
+    };
+
+    for (unsigned int o = 0; o < sizeof(ops) / sizeof(ops[0]); ++o)
+    {
+        bool encrypt = (ops[o] == CryptoChromeCore::OP_ENCRYPT_FILE);
+        std::vector<double> times;
+
+        for (unsigned int r = 0; r < 3; ++r)
+        {
+            std::string message;
+
+            double t0 = timestamp();
+            bool ok = core.run_file(ops[o], std::vector<std::string>(1, home.recipient()),
+                                    encrypt ? clear_path : crypt_path,
+                                    encrypt ? crypt_path : out_path, message);
+            times.push_back(timestamp() - t0);
+
+            if (!ok)
+                throw std::runtime_error(std::string("gpg ") + CryptoChromeCore::op_name(ops[o]) +
+                                         " failed: " + message);
+        }
+
+        std::ostringstream params;
+        params << "\"op\":\"" << CryptoChromeCore::op_name(ops[o]) << "\",\"payload\":" << payload;
+        report("gpg_file", params.str(), times, payload);
+    }
+}
+
+void bench_gpg(const std::string& gpg)
+{
+    static const unsigned long long payloads[] = { 1 << 10, 64 << 10, 1 << 20 };
+    static const char* ops[] = { "encrypt", "encrypt_sign", "clearsign", "decrypt" };
+
+    GpgHome home(gpg);
+
+    CryptoChromeCore core;
+    core.set_gpg_path(gpg);
+
+    for (unsigned int p = 0; p < sizeof(payloads) / sizeof(payloads[0]); ++p)
+    {
+        std::string clear_txt(payloads[p], 'x');
+        std::string crypt_txt = gpg_op(core, "encrypt", home.recipient(), clear_txt);
+
+        for (unsigned int o = 0; o < sizeof(ops) / sizeof(ops[0]); ++o)
+        {
+            const std::string op = ops[o];
+            const std::string& input = (op == "decrypt") ? crypt_txt : clear_txt;
+            std::vector<double> times;
+
+            for (unsigned int r = 0; r < std::max(3U, g_scale / 2); ++r)
+            {
+                double t0 = timestamp();
+                gpg_op(core, op, home.recipient(), input);
+                times.push_back(timestamp() - t0);
+            }
+
+            std::ostringstream params;
+            params << "\"op\":\"" << op << "\",\"payload\":" << payloads[p];
+            report("gpg_roundtrip", params.str(), times, payloads[p]);
+        }
+    }
+
+    bench_gpg_file(core, home);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    bool with_gpg = true;
+    std::string gpg = "gpg";
+    unsigned int stress_pipes = 0, stress_threads = 32;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--quick")
+            g_scale = 1;
+        else if (arg == "--no-gpg")
+            with_gpg = false;
+        else if (arg == "--gpg" && i + 1 < argc)
+            gpg = argv[++i];
+        else if (arg == "--stress" && i + 1 < argc)
+            stress_pipes = atoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            stress_threads = std::max(1, atoi(argv[++i]));
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--no-gpg] [--gpg PATH]" << std::endl
+                      << "       " << argv[0] << " --stress PIPES [--threads N]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (stress_pipes > 0)
+        return stress(stress_pipes, stress_threads) ? 0 : 1;
+
+    try {
+        bench_ringbuffer();
+        bench_armor();
+        bench_armor_quoted();
+        bench_spawn();
+        bench_cat_string();
+        bench_cat_source();
+        bench_cat_file();
+        bench_pipe_reuse();
+        bench_closed_stdio();
+        bench_function_stage();
+
+        if (with_gpg)
+            bench_gpg(gpg);
+    }
+    catch (std::runtime_error &e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
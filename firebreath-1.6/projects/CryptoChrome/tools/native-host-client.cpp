@@ -0,0 +1,140 @@
+/**********************************************************\
+
+  native-host-client.cpp
+
+  Stand-in for the browser side of native messaging, to exercise
+  cryptochrome-host without Chrome. Reads one JSON request per line
+  from stdin, sends all of them framed to the host at once, and
+  prints the replies one per line in the order they arrive. Fails if
+  a reply is malformed or if not every request id is answered
+  exactly once.
+
+  Usage: native-host-client HOST [HOST-ARGS...] < requests.jsonl
+
+\**********************************************************/
+
+#include "stx-execpipe.h"
+#include "JsonValue.h"
+
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace {
+
+void append_frame(std::string& out, const std::string& text)
+{
+    uint32_t len = text.size();
+    out.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    out += text;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " HOST [HOST-ARGS...] < requests.jsonl" << std::endl;
+        return 1;
+    }
+
+    // frame all requests and remember the ids to expect
+    std::string input, line;
+    std::map<std::string, unsigned int> pending;
+
+    while (std::getline(std::cin, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+
+        JsonValue request;
+        std::string error;
+        if (request.parse(line, error)) {
+            const JsonValue* id = request.get("id");
+            std::string key;
+            (id ? *id : JsonValue()).write(key);
+            ++pending[key];
+        }
+        else {
+            ++pending["null"];  // the host answers with a null id
+        }
+
+        append_frame(input, line);
+    }
+
+    std::vector<std::string> hostargs(argv + 1, argv + argc);
+    std::string output;
+
+    stx::ExecPipe ep;
+    ep.set_input_string(&input);
+    ep.add_execp(&hostargs);
+    ep.set_output_string(&output);
+
+    try {
+        ep.run();
+    }
+    catch (std::runtime_error &e) {
+        std::cerr << "Could not run host: " << e.what() << std::endl;
+        return 1;
+    }
+
+    bool ok = ep.all_return_codes_zero();
+    if (!ok)
+        std::cerr << "Host exited with status " << ep.get_return_code(0) << std::endl;
+
+    std::string::size_type pos = 0;
+    while (pos < output.size())
+    {
+        uint32_t len;
+        if (output.size() - pos < sizeof(len)) {
+            std::cerr << "Truncated reply length" << std::endl;
+            return 1;
+        }
+        memcpy(&len, output.data() + pos, sizeof(len));
+        pos += sizeof(len);
+
+        if (output.size() - pos < len) {
+            std::cerr << "Truncated reply" << std::endl;
+            return 1;
+        }
+
+        std::string text = output.substr(pos, len);
+        pos += len;
+
+        JsonValue reply;
+        std::string error;
+        if (!reply.parse(text, error)) {
+            std::cerr << "Malformed reply: " << error << std::endl;
+            return 1;
+        }
+
+        std::string key;
+        const JsonValue* id = reply.get("id");
+        (id ? *id : JsonValue()).write(key);
+
+        if (pending[key] == 0) {
+            std::cerr << "Unexpected reply for id " << key << std::endl;
+            ok = false;
+        }
+        else {
+            --pending[key];
+        }
+
+        std::cout << text << std::endl;
+    }
+
+    for (std::map<std::string, unsigned int>::const_iterator it = pending.begin();
+         it != pending.end(); ++it)
+    {
+        if (it->second != 0) {
+            std::cerr << "No reply for id " << it->first << std::endl;
+            ok = false;
+        }
+    }
+
+    return ok ? 0 : 1;
+}